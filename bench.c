@@ -0,0 +1,579 @@
+// bench.c
+// Synthetic peer load generator for the directory server.
+//
+// Every virtual user has its own UDP socket, so the server sees it as a separate
+// peer. The users register, announce their resources in bulk and answer hellos,
+// while each thread sends a mix of queries at a fixed rate from one more socket.
+// Latency is measured from the time a query was due rather than the time it was
+// sent, so a stalled server shows up as latency instead of a lower send rate.
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "protocol.h"
+
+#define SERVER_PORT 12345
+#define BUFFER_SIZE 4096
+#define PAGE_ROWS 50            // Rows requested per page of a query
+#define BULK_FRAME_BYTES 1400   // Largest bulk announce frame, to avoid IP fragmentation
+#define SETUP_TIMEOUT_MS 1000   // How long to wait for a setup reply before sending it again
+#define SETUP_ATTEMPTS 3
+#define DRAIN_MS 1000           // How long to wait for late replies after the run
+#define PENDING_SLOTS 65536     // Queries in flight per thread; older ones count as lost
+#define EPOLL_EVENTS 64
+
+// Kinds of query in the mix
+enum {
+    QUERY_USERS = 0,
+    QUERY_RESOURCES,
+    QUERY_RESOURCE_INFO,
+    QUERY_SEARCH,
+    QUERY_KINDS
+};
+
+const char* query_names[QUERY_KINDS] = { "query_users", "query_resources", "resource_info", "search" };
+const uint8_t query_opcodes[QUERY_KINDS] = { OP_QUERY_USERS, OP_QUERY_RESOURCES, OP_RESOURCE_INFO, OP_SEARCH };
+
+// Growable array of latency samples in nanoseconds
+typedef struct {
+    uint64_t* values;
+    size_t count;
+    size_t capacity;
+} SampleList;
+
+// A query waiting for its reply
+typedef struct {
+    uint32_t request_id;  // 0 if the slot is free
+    int kind;
+    uint64_t due_ns;      // When the query was scheduled to go out
+} PendingQuery;
+
+typedef struct {
+    int index;
+    pthread_t thread;
+    int first_user;
+    int user_count;
+    int* user_socks;
+    int query_sock;
+    int epoll_fd;
+    unsigned int seed;
+    uint32_t next_request_id;
+    PendingQuery* pending;
+    SampleList samples[QUERY_KINDS];
+    uint64_t sent[QUERY_KINDS];
+    uint64_t received[QUERY_KINDS];
+    uint64_t error_replies;
+    uint64_t hellos_answered;
+    int setup_failed;
+} BenchThread;
+
+// Settings from the command line
+struct sockaddr_in server_addr;
+int thread_count = 4;
+int user_count = 1000;
+int resources_per_user = 10;
+int query_rate = 10000;       // Queries per second over all threads
+int duration_sec = 10;
+int silent_percent = 0;       // Users that stop answering hellos once the run starts
+int query_mix[QUERY_KINDS] = { 1, 1, 4, 4 };
+int mix_total = 10;
+
+// Barrier between the setup and the load phase, so the timer starts together
+pthread_barrier_t start_barrier;
+uint64_t run_start_ns;
+uint64_t run_end_ns;
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Function to append one sample. Returns -1 if memory is exhausted.
+int sample_add(SampleList* list, uint64_t value) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        uint64_t* values = realloc(list->values, capacity * sizeof(uint64_t));
+        if (values == NULL) {
+            return -1;
+        }
+        list->values = values;
+        list->capacity = capacity;
+    }
+    list->values[list->count++] = value;
+    return 0;
+}
+
+int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to read a quantile from sorted samples
+uint64_t sample_quantile(const SampleList* list, double quantile) {
+    if (list->count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(quantile * (list->count - 1) + 0.5);
+    return list->values[rank];
+}
+
+// Function to name the user with a global index, and its resources
+void user_name(int user, char* out, size_t size) {
+    snprintf(out, size, "bench%d", user);
+}
+
+void resource_name(int user, int resource, char* out, size_t size) {
+    snprintf(out, size, "bench%d-file%d.dat", user, resource);
+}
+
+// Function to tell whether a user stays quiet during the run so the server expires it
+int user_is_silent(int user) {
+    return user % 100 < silent_percent;
+}
+
+// Function to answer a hello on a user's socket
+void answer_hello(BenchThread* bench, int sock) {
+    uint8_t frame[PROTO_HEADER_SIZE];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), OP_HELLO_RESPONSE, STATUS_OK, 0);
+    send(sock, frame, proto_finish(&writer), 0);
+    bench->hellos_answered++;
+}
+
+// Function to send a setup request and wait for its reply, answering any hello
+// that arrives first. Returns the reply status, or -1 if no reply came.
+int setup_request(BenchThread* bench, int sock, ProtoWriter* request, uint32_t request_id, ProtoReader* reader) {
+    uint8_t reply[BUFFER_SIZE];
+    ProtoHeader header;
+    size_t frame_len = proto_finish(request);
+    if (frame_len == 0) {
+        return -1;
+    }
+    for (int attempt = 0; attempt < SETUP_ATTEMPTS; attempt++) {
+        send(sock, request->data, frame_len, 0);
+        uint64_t deadline = monotonic_ns() + SETUP_TIMEOUT_MS * 1000000ull;
+        while (monotonic_ns() < deadline) {
+            ssize_t len = recv(sock, reply, sizeof(reply), 0);
+            if (len < 0) {
+                break;  // SO_RCVTIMEO expired
+            }
+            if (proto_reader_init(reader, &header, reply, len) < 0) {
+                continue;
+            }
+            if (header.opcode == OP_HELLO) {
+                answer_hello(bench, sock);
+            } else if (header.request_id == request_id) {
+                return header.status;
+            }
+        }
+    }
+    return -1;
+}
+
+// Function to register one user and announce its resources.
+// Returns 0 on success, -1 on failure.
+int setup_user(BenchThread* bench, int user, int sock) {
+    uint8_t request[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    char username[50], name[100];
+    user_name(user, username, sizeof(username));
+
+    uint32_t request_id = ++bench->next_request_id;
+    proto_writer_init(&writer, request, sizeof(request), OP_REGISTER, STATUS_OK, request_id);
+    proto_put_str(&writer, username);
+    proto_put_u16(&writer, 20000 + user % 40000);  // Never connected to; downloads are not simulated
+    if (setup_request(bench, sock, &writer, request_id, &reader) != STATUS_OK) {
+        printf("Failed to register %s.\n", username);
+        return -1;
+    }
+
+    int sent = 0;
+    while (sent < resources_per_user) {
+        request_id = ++bench->next_request_id;
+        proto_writer_init(&writer, request, BULK_FRAME_BYTES, OP_ANNOUNCE_BULK, STATUS_OK, request_id);
+        proto_put_str(&writer, username);
+        size_t count_offset = writer.len;
+        proto_put_u16(&writer, 0);  // name count, patched below
+        int batch = 0;
+        while (sent + batch < resources_per_user) {
+            size_t mark = writer.len;
+            resource_name(user, sent + batch, name, sizeof(name));
+            proto_put_str(&writer, name);
+            proto_put_u64(&writer, 0);  // size and content hash: not known
+            proto_put_u64(&writer, 0);
+            if (writer.overflow) {
+                writer.len = mark;
+                writer.overflow = 0;
+                break;
+            }
+            batch++;
+        }
+        proto_patch_u16(&writer, count_offset, batch);
+        if (setup_request(bench, sock, &writer, request_id, &reader) != STATUS_OK) {
+            printf("Failed to announce resources of %s.\n", username);
+            return -1;
+        }
+        sent += batch;
+    }
+    return 0;
+}
+
+// Function to open a UDP socket connected to the server and add it to the
+// thread's epoll set under slot, the user's index in the thread or user_count
+// for the query socket. Returns the socket, or -1 on error.
+int open_socket(BenchThread* bench, int slot) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct timeval timeout = { SETUP_TIMEOUT_MS / 1000, (SETUP_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = slot };
+    if (epoll_ctl(bench->epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+        perror("epoll_ctl");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to pick a query kind according to query_mix
+int pick_query(BenchThread* bench) {
+    int roll = rand_r(&bench->seed) % mix_total;
+    for (int kind = 0; kind < QUERY_KINDS; kind++) {
+        if (roll < query_mix[kind]) {
+            return kind;
+        }
+        roll -= query_mix[kind];
+    }
+    return QUERY_USERS;
+}
+
+// Function to send one query of the mix, due at due_ns
+void send_query(BenchThread* bench, uint64_t due_ns) {
+    uint8_t request[BUFFER_SIZE];
+    ProtoWriter writer;
+    char text[100];
+    int kind = pick_query(bench);
+    int user = rand_r(&bench->seed) % user_count;
+
+    uint32_t request_id = ++bench->next_request_id;
+    if (request_id == 0) {
+        request_id = ++bench->next_request_id;  // 0 marks a free pending slot
+    }
+    proto_writer_init(&writer, request, sizeof(request), query_opcodes[kind], STATUS_OK, request_id);
+    uint32_t cursor = 0;
+    switch (kind) {
+        case QUERY_RESOURCES:
+            // Start at a random page to exercise cursor seeks, not just the first rows
+            cursor = rand_r(&bench->seed) % ((uint32_t)user_count * resources_per_user + 1);
+            break;
+        case QUERY_RESOURCE_INFO:
+            resource_name(user, rand_r(&bench->seed) % resources_per_user, text, sizeof(text));
+            proto_put_str(&writer, text);
+            break;
+        case QUERY_SEARCH:
+            // Alternate between a substring and a glob that both match one user's files
+            if (request_id % 2) {
+                snprintf(text, sizeof(text), "bench%d-", user);
+            } else {
+                snprintf(text, sizeof(text), "bench%d-file*.dat", user);
+            }
+            proto_put_str(&writer, text);
+            break;
+    }
+    proto_put_u32(&writer, cursor);
+    proto_put_u16(&writer, PAGE_ROWS);
+
+    size_t frame_len = proto_finish(&writer);
+    PendingQuery* slot = &bench->pending[request_id % PENDING_SLOTS];
+    slot->request_id = request_id;  // Overwrites a query that never got its reply
+    slot->kind = kind;
+    slot->due_ns = due_ns;
+    bench->sent[kind]++;
+    send(bench->query_sock, request, frame_len, MSG_DONTWAIT);
+}
+
+// Function to read every datagram waiting on a socket
+void drain_socket(BenchThread* bench, int sock, int answer_hellos) {
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    ProtoHeader header;
+    ssize_t len;
+    while ((len = recv(sock, reply, sizeof(reply), MSG_DONTWAIT)) > 0) {
+        uint64_t now = monotonic_ns();
+        if (proto_reader_init(&reader, &header, reply, len) < 0) {
+            continue;
+        }
+        if (header.opcode == OP_HELLO) {
+            if (answer_hellos) {
+                answer_hello(bench, sock);
+            }
+            continue;
+        }
+        PendingQuery* slot = &bench->pending[header.request_id % PENDING_SLOTS];
+        if (sock != bench->query_sock || slot->request_id != header.request_id) {
+            continue;  // Late reply to a setup request, or a duplicate
+        }
+        slot->request_id = 0;
+        bench->received[slot->kind]++;
+        if (header.status != STATUS_OK) {
+            bench->error_replies++;
+        }
+        if (sample_add(&bench->samples[slot->kind], now - slot->due_ns) < 0) {
+            bench->error_replies++;
+        }
+    }
+}
+
+// Function to wait up to timeout_ns for datagrams and handle them. Silent
+// users stop answering hellos once the run starts. The timeout is kept in
+// nanoseconds so sub-millisecond query intervals sleep instead of spinning.
+void poll_sockets(BenchThread* bench, uint64_t timeout_ns) {
+    struct epoll_event events[EPOLL_EVENTS];
+    struct timespec timeout = { timeout_ns / 1000000000ull, timeout_ns % 1000000000ull };
+    int ready = epoll_pwait2(bench->epoll_fd, events, EPOLL_EVENTS, &timeout, NULL);
+    for (int i = 0; i < ready; i++) {
+        int slot = events[i].data.u32;
+        if (slot == bench->user_count) {
+            drain_socket(bench, bench->query_sock, 0);
+        } else {
+            drain_socket(bench, bench->user_socks[slot], !user_is_silent(bench->first_user + slot));
+        }
+    }
+}
+
+void* bench_thread(void* arg) {
+    BenchThread* bench = arg;
+    for (int u = 0; u < bench->user_count; u++) {
+        bench->user_socks[u] = open_socket(bench, u);
+        if (bench->user_socks[u] < 0 || setup_user(bench, bench->first_user + u, bench->user_socks[u]) < 0) {
+            bench->setup_failed = 1;
+            break;
+        }
+    }
+    bench->query_sock = open_socket(bench, bench->user_count);
+    if (bench->query_sock < 0) {
+        bench->setup_failed = 1;
+    }
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&start_barrier);  // run_start_ns is set between the two
+    if (bench->setup_failed) {
+        return NULL;
+    }
+
+    // Open loop: queries go out on schedule whether or not replies have come back
+    uint64_t interval_ns = 1000000000ull * thread_count / query_rate;
+    uint64_t next_due = run_start_ns + interval_ns * bench->index / thread_count;
+    while (1) {
+        uint64_t now = monotonic_ns();
+        if (now >= run_end_ns) {
+            break;
+        }
+        while (next_due <= now && next_due < run_end_ns) {
+            send_query(bench, next_due);
+            next_due += interval_ns;
+        }
+        uint64_t wake = next_due < run_end_ns ? next_due : run_end_ns;
+        poll_sockets(bench, wake > now ? wake - now : 0);
+    }
+    uint64_t drain_end = run_end_ns + DRAIN_MS * 1000000ull;
+    while (monotonic_ns() < drain_end) {
+        poll_sockets(bench, 10000000ull);
+    }
+    return NULL;
+}
+
+// Function to parse a query mix such as "1:1:4:4". Returns -1 if malformed.
+int parse_mix(const char* text) {
+    int weights[QUERY_KINDS];
+    if (sscanf(text, "%d:%d:%d:%d", &weights[0], &weights[1], &weights[2], &weights[3]) != QUERY_KINDS) {
+        return -1;
+    }
+    mix_total = 0;
+    for (int kind = 0; kind < QUERY_KINDS; kind++) {
+        if (weights[kind] < 0) {
+            return -1;
+        }
+        query_mix[kind] = weights[kind];
+        mix_total += weights[kind];
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+// Function to print throughput, loss and latency quantiles for one query kind
+// or, with kind -1, for all of them
+void report(BenchThread* benches, int kind, double seconds) {
+    SampleList merged = { NULL, 0, 0 };
+    uint64_t sent = 0, received = 0;
+    for (int t = 0; t < thread_count; t++) {
+        for (int k = 0; k < QUERY_KINDS; k++) {
+            if (kind >= 0 && k != kind) {
+                continue;
+            }
+            sent += benches[t].sent[k];
+            received += benches[t].received[k];
+            for (size_t i = 0; i < benches[t].samples[k].count; i++) {
+                sample_add(&merged, benches[t].samples[k].values[i]);
+            }
+        }
+    }
+    if (sent == 0) {
+        return;
+    }
+    qsort(merged.values, merged.count, sizeof(uint64_t), compare_samples);
+    uint64_t lost = sent > received ? sent - received : 0;
+    printf("%-16s %10llu %10.0f %8.3f%% %10.1f %10.1f %10.1f %10.1f\n",
+           kind >= 0 ? query_names[kind] : "total", (unsigned long long)sent, received / seconds,
+           100.0 * lost / sent, sample_quantile(&merged, 0.5) / 1000.0, sample_quantile(&merged, 0.99) / 1000.0,
+           sample_quantile(&merged, 0.999) / 1000.0, sample_quantile(&merged, 1.0) / 1000.0);
+    free(merged.values);
+}
+
+int main(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    int port = SERVER_PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:t:u:r:q:d:m:x:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'u':
+                user_count = atoi(optarg);
+                break;
+            case 'r':
+                resources_per_user = atoi(optarg);
+                break;
+            case 'q':
+                query_rate = atoi(optarg);
+                break;
+            case 'd':
+                duration_sec = atoi(optarg);
+                break;
+            case 'm':
+                if (parse_mix(optarg) < 0) {
+                    printf("Malformed query mix '%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x':
+                silent_percent = atoi(optarg);
+                break;
+            default:
+                printf("Usage: %s [-h server_ip] [-p port] [-t threads] [-u users] [-r resources_per_user]\n"
+                       "       [-q queries_per_sec] [-d duration_sec] [-m users:resources:info:search] "
+                       "[-x silent_percent]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (thread_count < 1 || user_count < thread_count || resources_per_user < 1 || query_rate < 1 ||
+        duration_sec < 1 || silent_percent < 0 || silent_percent > 100) {
+        printf("Invalid settings.\n");
+        return 1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        printf("Invalid server address '%s'.\n", host);
+        return 1;
+    }
+
+    // One socket per virtual user, plus a query socket and an epoll set per thread
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < (rlim_t)user_count + 2 * thread_count + 16) {
+        printf("Too many users for the open file limit of %llu.\n", (unsigned long long)files.rlim_cur);
+        return 1;
+    }
+
+    BenchThread* benches = calloc(thread_count, sizeof(BenchThread));
+    if (benches == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    uint64_t setup_start = monotonic_ns();
+    for (int t = 0; t < thread_count; t++) {
+        BenchThread* bench = &benches[t];
+        bench->index = t;
+        bench->first_user = (int)((long long)user_count * t / thread_count);
+        bench->user_count = (int)((long long)user_count * (t + 1) / thread_count) - bench->first_user;
+        bench->user_socks = calloc(bench->user_count, sizeof(int));
+        bench->pending = calloc(PENDING_SLOTS, sizeof(PendingQuery));
+        bench->seed = t * 7919 + 1;
+        bench->epoll_fd = epoll_create1(0);
+        if (bench->user_socks == NULL || bench->pending == NULL || bench->epoll_fd < 0) {
+            perror("Failed to set up thread");
+            return 1;
+        }
+        if (pthread_create(&bench->thread, NULL, bench_thread, bench) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    double setup_seconds = (monotonic_ns() - setup_start) / 1e9;
+    int failed = 0;
+    for (int t = 0; t < thread_count; t++) {
+        failed |= benches[t].setup_failed;
+    }
+    if (!failed) {
+        printf("Registered %d user(s) with %d resource(s) each in %.2f s.\n", user_count, resources_per_user,
+               setup_seconds);
+        printf("Sending %d queries/s for %d s from %d thread(s)...\n", query_rate, duration_sec, thread_count);
+    }
+    run_start_ns = monotonic_ns();
+    run_end_ns = run_start_ns + duration_sec * 1000000000ull;
+    pthread_barrier_wait(&start_barrier);
+    for (int t = 0; t < thread_count; t++) {
+        pthread_join(benches[t].thread, NULL);
+    }
+    if (failed) {
+        printf("Setup failed; is the server running unsharded on %s:%d?\n", host, port);
+        return 1;
+    }
+
+    uint64_t error_replies = 0, hellos_answered = 0;
+    for (int t = 0; t < thread_count; t++) {
+        error_replies += benches[t].error_replies;
+        hellos_answered += benches[t].hellos_answered;
+    }
+    printf("\n%-16s %10s %10s %9s %10s %10s %10s %10s\n", "query", "sent", "replies/s", "lost",
+           "p50 us", "p99 us", "p999 us", "max us");
+    for (int kind = 0; kind < QUERY_KINDS; kind++) {
+        report(benches, kind, duration_sec);
+    }
+    report(benches, -1, duration_sec);
+    printf("\nError replies: %llu, hellos answered: %llu\n", (unsigned long long)error_replies,
+           (unsigned long long)hellos_answered);
+    return 0;
+}
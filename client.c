@@ -1,209 +1,3303 @@
 // client.c
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "hash.h"
+#include "protocol.h"
+#include "shard.h"
 
 #define SERVER_PORT 12345
 #define BUFFER_SIZE 4096
 #define MAX_PATH_LENGTH 1024
 #define MAX_FILENAME_LENGTH 256
+#define PAGE_ROWS 50  // Rows requested per page of a query
+#define MAX_RESOURCE_NAME 100  // Longest resource name the server accepts, with the terminator
+#define BULK_FRAME_BYTES 1400  // Largest bulk announce or withdraw frame, to avoid IP fragmentation
+#define MAX_PENDING 32              // Requests in flight at once
+#define RETRANSMIT_INITIAL_MS 250   // Wait before the first retransmission; doubles with every retry
+#define RETRANSMIT_ATTEMPTS 5       // Sends of one request before giving up, about 8 s in all
+#define PIPELINE_DEPTH 8            // Bulk frames sent ahead of their replies
+#define TRANSFER_HEADER_SIZE 64     // Longest header line of a file transfer
+#define DOWNLOAD_CHUNK (64 * 1024)  // Bytes received per recv while downloading
+#define DEFAULT_MAX_UPLOADS 1024    // Downloads served at once; more wait in the accept queue
+#define DEFAULT_LISTEN_BACKLOG 512  // Connections the kernel queues while all upload slots are busy
+#define UPLOAD_REQUEST_BYTES 512    // Longest "get <filename>" request
+#define UPLOAD_SLICE (1 << 20)      // Bytes sent to one downloader before turning to the others
+#define UPLOAD_IDLE_SEC 30          // Uploads that make no progress for this long are dropped
+#define UPLOAD_ACCEPT_RETRY_MS 100  // Pause in accepting after running out of file descriptors
+#define UPLOAD_LEGACY_WAIT_MS 200   // Quiet time after which a first request without newline is complete
+#define UPLOAD_EVENTS 64
+#define UPLOAD_BURST_MS 100         // Tokens the upload bucket holds, in milliseconds of the rate cap
+#define UPLOAD_MIN_QUANTUM (16 * 1024)  // Smallest turn of a downloader, and bucket size, under a low cap
+#define MAX_UPLOAD_WEIGHTS 64       // Downloader addresses with a weight other than 1
+#define MAX_UPLOAD_WEIGHT 100
+#define CHUNK_SIZE (4 << 20)        // Bytes fetched per range request in a download
+#define MAX_SWARM_PEERS 16          // Owners a download is spread across
+#define PEER_STREAMS 2              // Connections to each owner in a download
+#define PEER_PIPELINE 2             // Chunk requests queued on one connection
+#define POOL_CONNECTIONS 64         // Idle peer connections kept for later downloads
+#define POOL_IDLE_SEC 20            // Pooled connections are closed before owners drop them (UPLOAD_IDLE_SEC)
+#define MAX_PEER_FAILURES 3         // Failed chunks in a row before an owner is dropped
+#define TRANSFER_TIMEOUT_SEC 10     // A peer sending nothing for this long has failed
+#define HASH_CACHE_NAME ".p2p-hashes"  // Content hashes of the sharing folder, kept inside it
+#define DEFAULT_STORE_DIR "p2p-store"  // Content-addressed copies of finished downloads
+#define COMPRESS_BLOCK (256 * 1024)    // Bytes of a file compressed as one block of a transfer
+#define COMPRESS_LEVEL 1               // zlib level: the fastest, since the link is the bottleneck
+#define COMPRESS_GIVE_UP 2             // Blocks in a row that don't shrink before the rest go raw
+#define COMPRESS_WORKERS 4             // Threads compressing blocks for the upload loop
+#define DEFAULT_BATCH_JOBS 4           // Downloads run at once in batch mode
+#define DEFAULT_PEER_DOWNLOADS 2       // Batch downloads one owner takes part in at once
+#define WATCH_LIMIT 8192               // Directories of the sharing folder watched for changes
+#define WATCH_SETTLE_MS 500            // Quiet time after a change before it is announced
+#define WATCH_BATCH_MS 5000            // Longest a change waits while others keep coming
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
 
-char response_buffer[BUFFER_SIZE];
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-int response_ready = 0;
+// A file of the sharing folder as announced to the directory
+typedef struct {
+    char name[MAX_RESOURCE_NAME];
+    uint64_t size;
+    uint64_t hash;  // XXH64 of the contents, 0 if unknown
+} SharedFile;
+
+// A record of the download store's index. Objects are hard links named by
+// hash; one edited in place no longer matches its inode and mtime and is ignored.
+typedef struct {
+    uint64_t hash;
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} StoreEntry;
+
+// A line of the hash cache. The hash is reused while the file keeps its inode,
+// size and modification time.
+typedef struct {
+    SharedFile file;  // First, so entries sort and search with compare_shared_files
+    unsigned long long inode;
+    long long mtime_sec;
+    long mtime_nsec;
+} HashCacheEntry;
+
+// Files of the sharing folder described while scanning it
+typedef struct {
+    HashCacheEntry* entries;
+    int count;
+    int capacity;
+    int hashed;  // Entries hashed rather than taken from the cache
+} Manifest;
+
+// A directory of the sharing folder under an inotify watch
+typedef struct {
+    int wd;
+    char path[MAX_RESOURCE_NAME];  // Relative to the sharing folder, "" for the folder itself
+} WatchedDir;
+
+// State of the thread announcing changes of the sharing folder
+typedef struct {
+    int fd;                        // inotify instance
+    int sock;
+    const char* username;
+    WatchedDir dirs[WATCH_LIMIT];
+    int dir_count;
+    int limit_reported;
+    SharedFile* changed;           // Names changed since the last batch, sizes and hashes unset
+    int changed_count;
+    int changed_capacity;
+    int rescan;                    // Events were lost; the next batch is a full sync
+    long long first_change_ms;     // When the pending batch started
+    long long last_change_ms;
+} Watcher;
+
+// Structure for one owner of a resource, as returned by OP_RESOURCE_INFO
+typedef struct {
+    char owner[50];
+    char ip[INET_ADDRSTRLEN];
+    int tcp_port;
+    uint64_t size;  // Content the owner announced; hash 0 if unknown
+    uint64_t hash;
+} OwnerInfo;
+
+// Progress of one name of a batch download
+enum {
+    BATCH_QUEUED = 0,
+    BATCH_RUNNING,
+    BATCH_DONE
+};
+
+// One name of a batch download
+typedef struct {
+    char name[MAX_RESOURCE_NAME];
+    OwnerInfo* owners;      // Owners of the most common content first
+    int owner_count;        // Owners of that content, 0 if the name has none
+    int lookup_failed;      // The owners could not be looked up, as opposed to there being none
+    char file[MAX_RESOURCE_NAME + 32];  // Where it is saved, unique within the batch
+    int state;
+} BatchJob;
+
+// Batch downloads an owner takes part in
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int tcp_port;
+    int active;
+} PeerLoad;
+
+// A batch download shared by its workers
+typedef struct {
+    int sock;
+    const char* username;
+    BatchJob* jobs;
+    int job_count;
+    PeerLoad* peers;
+    int peer_count;
+    int peer_limit;
+    int failed;
+    FILE* results;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;  // Signalled when a download ends
+} Batch;
+
+// Download state of one chunk
+enum {
+    CHUNK_PENDING = 0,
+    CHUNK_ACTIVE,
+    CHUNK_DONE
+};
+
+// An owner taking part in a download
+typedef struct {
+    OwnerInfo info;
+    int failures;         // Chunks failed in a row
+    int dropped;
+    long long received;   // Bytes of the file this owner delivered
+} SwarmPeer;
+
+// A download spread over several owners. Streams take the next pending chunk
+// when they finish one, so faster owners serve more of the file. Near the end,
+// an idle stream also fetches a chunk another owner is still working on, and
+// whichever copy arrives first is kept.
+typedef struct {
+    const char* name;
+    int fd;
+    long long size;
+    uint64_t hash;                  // Content hash the file must have, 0 if unknown
+    int chunk_count;
+    unsigned char* chunk_state;     // CHUNK_* of each chunk
+    unsigned char* chunk_fetchers;  // Streams currently fetching each chunk
+    int chunks_done;
+    long long wire_bytes;           // Bytes the kept chunks took on the network, after compression
+    int progress_fd;                // The .chunks file recording which chunks are done
+    size_t progress_header;         // Bytes before the first chunk's mark in it
+    SwarmPeer* peers;
+    int peer_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;         // Signalled when a chunk is done or becomes pending again
+} Swarm;
+
+// One connection's worth of work in a swarm download
+typedef struct {
+    Swarm* swarm;
+    int peer;
+} SwarmStream;
+
+// Request waiting for its reply. The listener thread matches replies to
+// slots by request id, so several requests can share the socket.
+typedef struct {
+    uint32_t request_id;       // 0 if the slot is free
+    int done;                  // Set by the listener once reply holds the reply
+    int sock;
+    struct sockaddr_in server_addr;
+    uint8_t frame[BUFFER_SIZE];  // Copy of the request, for retransmission
+    size_t frame_len;
+    struct timespec deadline;  // When to retransmit next
+    int timeout_ms;
+    uint8_t reply[BUFFER_SIZE];
+    size_t reply_len;
+    pthread_cond_t cond;
+} PendingRequest;
+
+// An idle connection to an owner, kept for the next download from it
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int tcp_port;
+    int sock;
+    time_t idle_since;
+} PooledConnection;
+
+// One download being served by the upload event loop
+typedef struct {
+    int sock;                             // -1 if the slot is free
+    int fd;                               // File being sent, -1 until the request is read
+    char request[UPLOAD_REQUEST_BYTES];
+    size_t request_len;
+    char header[TRANSFER_HEADER_SIZE];
+    size_t header_len;
+    size_t header_sent;
+    off_t offset;                         // Next byte of the file to send
+    off_t end;                            // End of the requested range
+    time_t last_progress;
+    int framed;                           // The range is sent as blocks (the peer asked for compression)
+    int compress_misses;                  // Blocks in a row that did not shrink
+    uint8_t* block;                       // Block header and, if compressed, its data
+    size_t block_len;
+    size_t block_sent;
+    uint32_t block_raw;                   // Bytes of the file the next block holds
+    long block_stored;                    // Its stored length once compressed, -1 if the file was unreadable
+    int compressing;                      // A compression worker is preparing the next block
+    off_t raw_end;                        // End of a raw block's data, which follows its header via sendfile
+    int keep_alive;                       // The connection stays open for another request after this one
+    int served;                           // Requests answered on the connection so far
+    long long request_due;                // When a request without newline is taken as complete, 0 if not waiting
+    char peer_ip[INET_ADDRSTRLEN];
+    int weight;                           // Share of the bandwidth relative to other uploads
+    long long deficit;                    // Bytes left of the current turn (see upload_schedule)
+    int turn;                             // The current turn's quantum has been granted
+    int queued;                           // In the scheduler's ring, waiting for or in its turn
+} Upload;
+
+// The upload event loop's table of uploads and the scheduler's ring
+typedef struct {
+    Upload* uploads;
+    int* free_slots;
+    int free_count;
+    int epoll_fd;
+    int* active;        // Slots with data to send and a writable socket, in turn order
+    int active_head;
+    int active_count;
+    long long rate;     // upload_rate as of this pass of the loop
+    long long tokens;   // Bytes the bucket allows now; below 0 after small replies sent on credit
+    // Blocks to compress, handed to the compression workers so the loop never
+    // waits for zlib. Each upload has at most one block in the queues.
+    pthread_mutex_t compress_mutex;
+    pthread_cond_t compress_ready;
+    int* compress_jobs;  // Slots waiting for a worker, in order
+    int compress_head;
+    int compress_count;
+    int* compressed;     // Slots whose block is ready
+    int compressed_count;
+    int compress_event;  // eventfd, readable while compressed is not empty
+    int compress_stop;   // Set when the loop exits; the workers finish their block and return
+    int compress_workers;
+    long long request_due;  // Earliest request_due of the uploads, 0 if none waits
+} UploadServer;
+
+// A downloader address given a weight in the upload scheduler
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int weight;
+} UploadWeight;
+
+PendingRequest pending_requests[MAX_PENDING];
+pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pending_slot_free = PTHREAD_COND_INITIALIZER;
 int running = 1;
+int max_uploads = DEFAULT_MAX_UPLOADS;
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+uint32_t next_request_id = 0;
 char sharing_folder[MAX_PATH_LENGTH]; // Global variable to hold sharing folder path
+ShardMap shard_map;  // Directory servers; resource names are routed with shard_for_name
+char store_dir[MAX_PATH_LENGTH] = DEFAULT_STORE_DIR;
+int share_downloads = 0;  // Link finished downloads into the sharing folder and announce them
+long long upload_rate = 0;  // Upload cap in bytes per second, 0 for none; changed from the menu
+UploadWeight upload_weights[MAX_UPLOAD_WEIGHTS];
+int upload_weight_count = 0;
+pthread_mutex_t limits_mutex = PTHREAD_MUTEX_INITIALIZER;
+int download_compressed = 0;  // Ask owners to compress the files they send
+StoreEntry* store_entries = NULL;  // The store's index, sorted by hash
+int store_count = 0, store_capacity = 0;
+pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+PooledConnection connection_pool[POOL_CONNECTIONS];
+int pool_count = 0;
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void register_with_server(int sock, struct sockaddr_in server_addr, const char* username, int tcp_port);
-void announce_resource(int sock, struct sockaddr_in server_addr, const char* resource_name, const char* username);
-void announce_resources(int sock, struct sockaddr_in server_addr, const char* username, const char* sharing_folder);
-void query_resources(int sock, struct sockaddr_in server_addr);
+uint32_t begin_request(ProtoWriter* writer, uint8_t* buffer, uint8_t opcode);
+void deadline_after(struct timespec* deadline, int timeout_ms);
+PendingRequest* start_request(int sock, struct sockaddr_in server_addr, ProtoWriter* request, uint32_t request_id);
+int finish_request(PendingRequest* pending, uint8_t* reply, ProtoReader* reader, ProtoHeader* header);
+int send_request(int sock, struct sockaddr_in server_addr, ProtoWriter* request, uint32_t request_id,
+                 uint8_t* reply, ProtoReader* reader, ProtoHeader* header);
+void print_reply_error(ProtoReader* reader, const char* fallback);
+int negotiate_protocol(int sock, struct sockaddr_in server_addr);
+int fetch_shard_map(int sock, struct sockaddr_in server_addr);
+struct sockaddr_in shard_addr(const char* resource_name);
+void register_with_server(int sock, const char* username, int tcp_port);
+int register_with_shard(int sock, struct sockaddr_in server_addr, const char* username, int tcp_port);
+int compare_shared_files(const void* a, const void* b);
+int load_hash_cache(const char* folder, HashCacheEntry** entries);
+void save_hash_cache(const char* folder, const HashCacheEntry* entries, int count);
+int describe_file(const char* folder, const char* name, const HashCacheEntry* cache, int cache_count,
+                  HashCacheEntry* out);
+void announce_resource(int sock, const char* resource_name, const char* username);
+int send_name_list(int sock, struct sockaddr_in server_addr, uint8_t opcode, const char* username,
+                   const SharedFile* files, int count);
+void withdraw_resource(int sock, const char* resource_name, const char* username);
+int fetch_owned_files(int sock, struct sockaddr_in server_addr, const char* username, SharedFile** files);
+void sync_shard(int sock, struct sockaddr_in shard_addr, const char* username, SharedFile* local, int local_count);
+int is_cache_name(const char* name);
+int manifest_add(Manifest* manifest, const HashCacheEntry* entry);
+void scan_directory(const char* relative, const HashCacheEntry* cache, int cache_count, Manifest* manifest);
+void announce_resources(int sock, const char* username, const char* sharing_folder);
+long long monotonic_ms();
+int watch_directory(Watcher* watcher, const char* relative, int mark);
+void unwatch_directory(Watcher* watcher, const char* relative);
+void rewatch_folder(Watcher* watcher);
+void mark_changed(Watcher* watcher, const char* name);
+void handle_watch_event(Watcher* watcher, const struct inotify_event* event);
+void flush_changes(Watcher* watcher);
+Watcher* start_watcher(int sock, const char* username);
+void* watcher_thread(void* arg);
+int request_page(int sock, struct sockaddr_in server_addr, uint8_t opcode, const char* name, int cursor,
+                 uint8_t* reply, ProtoReader* reader, int* rows);
+uint32_t write_page_request(ProtoWriter* writer, uint8_t* buffer, uint8_t opcode, const char* name, int cursor);
+int read_page_reply(const ProtoHeader* header, ProtoReader* reader, int* rows);
+void query_resources(int sock);
 void query_users(int sock, struct sockaddr_in server_addr);
-void respond_to_hello(int sock, struct sockaddr_in server_addr);
+void search_resources(int sock);
+void complete_request(const char* message, size_t len);
+void respond_to_hello(int sock, struct sockaddr_in server_addr, int binary);
 void* listener_thread(void* arg);
 void* tcp_server_thread(void* arg);
+void set_upload_limits();
 void display_menu(int sock, struct sockaddr_in server_addr, const char* username);
-void* handle_tcp_client(void* arg);
-void download_resource(int sock, struct sockaddr_in server_addr);
+int is_shared_path(const char* name);
+int is_compressed_name(const char* filename);
+void upload_open(Upload* upload);
+void upload_compress_block(Upload* upload, uint8_t* raw);
+void upload_next_block(Upload* upload);
+int upload_read_request(Upload* upload);
+int upload_send(Upload* upload, long long budget, long long* sent);
+int upload_next_request(Upload* upload);
+void upload_close(Upload* upload);
+int upload_weight(const char* ip);
+int set_upload_weight(const char* ip, int weight);
+void upload_watch(UploadServer* server, int slot, uint32_t events);
+void upload_queue(UploadServer* server, int slot);
+void upload_dequeue(UploadServer* server, int slot);
+void upload_release(UploadServer* server, int slot);
+void upload_respond(UploadServer* server, int slot, int credit);
+long long upload_expire_requests(UploadServer* server, long long now_ms);
+void upload_done(UploadServer* server, int slot);
+void upload_schedule(UploadServer* server, long long quantum);
+void upload_compress(UploadServer* server, int slot);
+void upload_compressed(UploadServer* server);
+void* compress_worker(void* arg);
+int read_transfer_header(int sock, char* line, size_t size);
+int peer_connect(const OwnerInfo* owner);
+void peer_release(const OwnerInfo* owner, int sock, int keep_alive);
+int send_transfer_request(int sock, const char* name, long long offset, long long length);
+int read_transfer_reply(int sock, long long offset, long long* length, long long* size, int* framed,
+                        int* keep_alive);
+int probe_size(const OwnerInfo* owner, const char* name, long long* size);
+int recv_all(int sock, void* buffer, size_t len);
+int receive_blocks(Swarm* swarm, int sock, long long offset, long long length, long long* wire);
+int vote_on_size(Swarm* swarm, OwnerInfo* owners, int owner_count);
+int receive_chunk(Swarm* swarm, int sock, int chunk, long long* wire, int* keep_alive);
+int next_chunk(Swarm* swarm, SwarmPeer* peer, int wait);
+void release_chunk(Swarm* swarm, SwarmPeer* peer, int chunk, int failed);
+void* swarm_stream(void* arg);
+int load_progress(Swarm* swarm, const char* progress_path);
+int start_progress(Swarm* swarm, const char* progress_path);
+void record_chunk(Swarm* swarm, int chunk);
+int verify_download(Swarm* swarm, const char* part_path);
+int compare_store_entries(const void* a, const void* b);
+int compare_store_records(const void* a, const void* b);
+void store_open();
+int store_valid(const StoreEntry* entry, char* path, size_t path_size);
+int find_local_copy(uint64_t hash, uint64_t size, char* path, size_t path_size);
+int clone_file(const char* source, const char* target);
+void store_add(const char* path, uint64_t hash, uint64_t size);
+void share_download(int sock, const char* username, const char* name, const char* filepath);
+int swarm_download(const char* name, OwnerInfo* owners, int owner_count, const char* filepath);
+int select_content(OwnerInfo* owners, int owner_count, int pick);
+void flatten_name(char* name);
+int read_owner_rows(ProtoReader* reader, int rows, OwnerInfo** owners, int* owner_count);
+void download_resource(int sock, const char* username);
+void batch_add(Batch* batch, const char* name);
+int load_manifest(int sock, const char* path, Batch* batch);
+int compare_batch_files(const void* a, const void* b);
+void name_batch_files(Batch* batch);
+void resolve_batch(int sock, Batch* batch);
+int* peer_load(Batch* batch, const OwnerInfo* owner);
+void report_batch_result(Batch* batch, const BatchJob* job, const char* status, long long bytes, double seconds,
+                         int owners, const char* filepath);
+void* batch_worker(void* arg);
+int run_batch(int sock, const char* username, const char* manifest, int jobs, int peer_limit, FILE* results);
+
+// Function to start a request frame with a fresh request id. Id 0 is never
+// used, since the server does not deduplicate it.
+uint32_t begin_request(ProtoWriter* writer, uint8_t* buffer, uint8_t opcode) {
+    uint32_t request_id = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+    if (request_id == 0) {
+        request_id = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+    }
+    proto_writer_init(writer, buffer, BUFFER_SIZE, opcode, STATUS_OK, request_id);
+    return request_id;
+}
+
+// Function to set a deadline timeout_ms from now
+void deadline_after(struct timespec* deadline, int timeout_ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Function to send a request frame without waiting for the reply, waiting
+// instead for a free pending slot if MAX_PENDING requests are in flight.
+// Returns the slot to pass to finish_request, or NULL if the request is too large.
+PendingRequest* start_request(int sock, struct sockaddr_in server_addr, ProtoWriter* request, uint32_t request_id) {
+    size_t frame_len = proto_finish(request);
+    if (frame_len == 0) {
+        printf("Request is too large.\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&pending_mutex);
+    PendingRequest* pending = NULL;
+    while (pending == NULL) {
+        for (int i = 0; i < MAX_PENDING && pending == NULL; i++) {
+            if (pending_requests[i].request_id == 0) {
+                pending = &pending_requests[i];
+            }
+        }
+        if (pending == NULL) {
+            pthread_cond_wait(&pending_slot_free, &pending_mutex);
+        }
+    }
+    pending->request_id = request_id;
+    pending->done = 0;
+    pending->sock = sock;
+    pending->server_addr = server_addr;
+    memcpy(pending->frame, request->data, frame_len);
+    pending->frame_len = frame_len;
+    pending->timeout_ms = RETRANSMIT_INITIAL_MS;
+    deadline_after(&pending->deadline, pending->timeout_ms);
+    pthread_mutex_unlock(&pending_mutex);
+    sendto(sock, pending->frame, frame_len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    return pending;
+}
+
+// Function to wait for the reply to a started request, sending the request
+// again with exponential backoff while none arrives. The slot is released.
+// Returns 0 with reader positioned on the reply payload, or -1 if no reply
+// came after RETRANSMIT_ATTEMPTS sends.
+int finish_request(PendingRequest* pending, uint8_t* reply, ProtoReader* reader, ProtoHeader* header) {
+    // Leave the reader empty so callers can use it even if nothing arrives
+    memset(reader, 0, sizeof(*reader));
+    reader->error = 1;
+    int attempts = 1;
+    pthread_mutex_lock(&pending_mutex);
+    while (!pending->done) {
+        if (pthread_cond_timedwait(&pending->cond, &pending_mutex, &pending->deadline) != ETIMEDOUT) {
+            continue;
+        }
+        if (attempts == RETRANSMIT_ATTEMPTS) {
+            break;
+        }
+        attempts++;
+        pending->timeout_ms *= 2;
+        deadline_after(&pending->deadline, pending->timeout_ms);
+        sendto(pending->sock, pending->frame, pending->frame_len, 0,
+               (struct sockaddr*)&pending->server_addr, sizeof(pending->server_addr));
+    }
+    int done = pending->done;
+    size_t reply_len = pending->reply_len;
+    if (done) {
+        memcpy(reply, pending->reply, reply_len);
+    }
+    pending->request_id = 0;
+    pthread_cond_signal(&pending_slot_free);
+    pthread_mutex_unlock(&pending_mutex);
+
+    if (!done) {
+        printf("No reply from server.\n");
+        return -1;
+    }
+    return proto_reader_init(reader, header, reply, reply_len);
+}
+
+// Function to send a request frame and wait for its reply.
+// Returns 0 with reader positioned on the reply payload, or -1 if the request
+// could not be sent or no reply came.
+int send_request(int sock, struct sockaddr_in server_addr, ProtoWriter* request, uint32_t request_id,
+                 uint8_t* reply, ProtoReader* reader, ProtoHeader* header) {
+    PendingRequest* pending = start_request(sock, server_addr, request, request_id);
+    if (pending == NULL) {
+        memset(reader, 0, sizeof(*reader));
+        reader->error = 1;
+        return -1;
+    }
+    return finish_request(pending, reply, reader, header);
+}
+
+// Function to hand a reply to the request waiting for it. Replies nobody is
+// waiting for, such as the answer to a retransmission, are dropped.
+void complete_request(const char* message, size_t len) {
+    ProtoReader reader;
+    ProtoHeader header;
+    if (proto_reader_init(&reader, &header, message, len) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&pending_mutex);
+    for (int i = 0; i < MAX_PENDING; i++) {
+        PendingRequest* pending = &pending_requests[i];
+        if (pending->request_id == header.request_id && pending->request_id != 0 && !pending->done) {
+            memcpy(pending->reply, message, len);
+            pending->reply_len = len;
+            pending->done = 1;
+            pthread_cond_signal(&pending->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pending_mutex);
+}
 
-void register_with_server(int sock, struct sockaddr_in server_addr, const char* username, int tcp_port) {
+// Function to print the message carried by an error reply
+void print_reply_error(ProtoReader* reader, const char* fallback) {
     char message[BUFFER_SIZE];
-    snprintf(message, BUFFER_SIZE, "register %s %d", username, tcp_port);
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (proto_get_str(reader, message, sizeof(message)) == 0) {
+        printf("%s\n", message);
+    } else {
+        printf("%s\n", fallback);
+    }
+}
+
+// Function to agree on a binary protocol version with the server.
+// Returns the version to use, or 0 if there is none in common.
+int negotiate_protocol(int sock, struct sockaddr_in server_addr) {
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    uint32_t request_id = begin_request(&writer, request, OP_NEGOTIATE);
+    if (send_request(sock, server_addr, &writer, request_id, reply, &reader, &header) < 0 ||
+        header.status != STATUS_OK || header.version > PROTO_VERSION) {
+        return 0;
+    }
+    return header.version;
+}
+
+// Function to learn the shard map from any server. An unsharded server sends
+// an empty map, in which case it is the only shard. Returns -1 on failure.
+int fetch_shard_map(int sock, struct sockaddr_in server_addr) {
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    uint32_t request_id = begin_request(&writer, request, OP_SHARD_MAP);
+    if (send_request(sock, server_addr, &writer, request_id, reply, &reader, &header) < 0 ||
+        header.status != STATUS_OK) {
+        return -1;
+    }
+    int count = proto_get_u16(&reader);
+    for (int i = 0; i < count && !reader.error; i++) {
+        struct sockaddr_in node;
+        memset(&node, 0, sizeof(node));
+        node.sin_family = AF_INET;
+        node.sin_addr.s_addr = htonl(proto_get_u32(&reader));
+        node.sin_port = htons(proto_get_u16(&reader));
+        shard_map_add(&shard_map, node);
+    }
+    if (reader.error) {
+        return -1;
+    }
+    if (shard_map.count == 0) {
+        shard_map_add(&shard_map, server_addr);
+    } else {
+        printf("Directory is split across %d shards.\n", shard_map.count);
+    }
+    shard_map_build(&shard_map);
+    return 0;
+}
+
+// Function to find the server that owns a resource name
+struct sockaddr_in shard_addr(const char* resource_name) {
+    return shard_map.nodes[shard_for_name(&shard_map, resource_name)];
+}
+
+// Function to register with every shard. Each shard tracks our liveness on
+// its own, so hellos may come from any of them.
+void register_with_server(int sock, const char* username, int tcp_port) {
+    int registered = 0;
+    for (int shard = 0; shard < shard_map.count; shard++) {
+        registered += register_with_shard(sock, shard_map.nodes[shard], username, tcp_port) == 0;
+    }
+    if (registered == 0) {
+        running = 0;
+    } else {
+        printf("Registered with %d of %d server(s) as %s.\n", registered, shard_map.count, username);
+    }
+}
+
+// Function to register with one server. Returns 0 on success, -1 on failure.
+int register_with_shard(int sock, struct sockaddr_in server_addr, const char* username, int tcp_port) {
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    uint32_t request_id = begin_request(&writer, request, OP_REGISTER);
+    proto_put_str(&writer, username);
+    proto_put_u16(&writer, tcp_port);
+
+    // Wait for acknowledgment
+    if (send_request(sock, server_addr, &writer, request_id, reply, &reader, &header) == 0 &&
+        header.status == STATUS_OK) {
+        return 0;
+    }
+    print_reply_error(&reader, "Registration failed.");
+    return -1;
+}
+
+// Function to order shared files by name
+int compare_shared_files(const void* a, const void* b) {
+    return strcmp(((const SharedFile*)a)->name, ((const SharedFile*)b)->name);
+}
+
+// Function to read the hash cache of a sharing folder, sorted by name.
+// Returns the number of entries, 0 if there is no cache.
+int load_hash_cache(const char* folder, HashCacheEntry** entries) {
+    char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH], line[MAX_FILENAME_LENGTH + 128];
+    int count = 0, capacity = 0;
+    *entries = NULL;
+    snprintf(path, sizeof(path), "%s/%s", folder, HASH_CACHE_NAME);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        HashCacheEntry entry;
+        unsigned long long size, hash;
+        if (sscanf(line, "%llu %lld %ld %llu %llx %99[^\n]", &entry.inode, &entry.mtime_sec, &entry.mtime_nsec,
+                   &size, &hash, entry.file.name) != 6) {
+            continue;
+        }
+        entry.file.size = size;
+        entry.file.hash = hash;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            HashCacheEntry* grown = realloc(*entries, capacity * sizeof(HashCacheEntry));
+            if (grown == NULL) {
+                break;
+            }
+            *entries = grown;
+        }
+        (*entries)[count++] = entry;
+    }
+    fclose(file);
+    qsort(*entries, count, sizeof(HashCacheEntry), compare_shared_files);
+    return count;
+}
+
+// Function to replace the hash cache of a sharing folder. The new cache is
+// written next to the old one and renamed over it, so a crash leaves one or
+// the other.
+void save_hash_cache(const char* folder, const HashCacheEntry* entries, int count) {
+    char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH], tmp_path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + 8];
+    snprintf(path, sizeof(path), "%s/%s", folder, HASH_CACHE_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("Failed to save content hashes");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%llu %lld %ld %llu %016llx %s\n", entries[i].inode, entries[i].mtime_sec,
+                entries[i].mtime_nsec, (unsigned long long)entries[i].file.size,
+                (unsigned long long)entries[i].file.hash, entries[i].file.name);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) < 0) {
+        perror("Failed to save content hashes");
+        unlink(tmp_path);
+    }
+}
+
+// Function to find the size and content hash of a file in the sharing folder.
+// The cached hash is used if the file still has the inode, size and
+// modification time it had when it was hashed. Returns 1 if the file was
+// hashed, 0 if the cached hash was used, or -1 if it is not a readable
+// regular file.
+int describe_file(const char* folder, const char* name, const HashCacheEntry* cache, int cache_count,
+                  HashCacheEntry* out) {
+    char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
+    struct stat file_stat;
+    snprintf(path, sizeof(path), "%s/%s", folder, name);
+    if (stat(path, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    snprintf(out->file.name, sizeof(out->file.name), "%s", name);
+    out->file.size = file_stat.st_size;
+    out->inode = file_stat.st_ino;
+    out->mtime_sec = file_stat.st_mtim.tv_sec;
+    out->mtime_nsec = file_stat.st_mtim.tv_nsec;
+    const HashCacheEntry* cached = NULL;
+    if (cache_count > 0) {
+        cached = bsearch(out, cache, cache_count, sizeof(HashCacheEntry), compare_shared_files);
+    }
+    if (cached != NULL && cached->inode == out->inode && cached->file.size == out->file.size &&
+        cached->mtime_sec == out->mtime_sec && cached->mtime_nsec == out->mtime_nsec) {
+        out->file.hash = cached->file.hash;
+        return 0;
+    }
+    // The modification time was taken first, so a file changed while it is
+    // being hashed is hashed again next time
+    return hash_file(path, &out->file.hash, &out->file.size) < 0 ? -1 : 1;
+}
+
+void announce_resource(int sock, const char* resource_name, const char* username) {
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    // A name that is not a file of the sharing folder is announced without content
+    HashCacheEntry* cache;
+    HashCacheEntry described;
+    int cache_count = load_hash_cache(sharing_folder, &cache);
+    if (describe_file(sharing_folder, resource_name, cache, cache_count, &described) < 0) {
+        memset(&described, 0, sizeof(described));
+    }
+    free(cache);
+    uint32_t request_id = begin_request(&writer, request, OP_ANNOUNCE);
+    proto_put_str(&writer, resource_name);
+    proto_put_str(&writer, username);
+    proto_put_u64(&writer, described.file.size);
+    proto_put_u64(&writer, described.file.hash);
+
+    // Wait for acknowledgment
+    if (send_request(sock, shard_addr(resource_name), &writer, request_id, reply, &reader, &header) == 0 &&
+        header.status == STATUS_OK) {
+        printf("Announced resource: %s\n", resource_name);
+    } else {
+        printf("Failed to announce resource.\n");
+    }
+}
+
+// Function to announce (OP_ANNOUNCE_BULK) or withdraw (OP_WITHDRAW) a list of
+// files, packing as many into each datagram as fit in BULK_FRAME_BYTES. Only
+// announces carry the size and content hash. Up to
+// PIPELINE_DEPTH frames are in flight at once; the server answers a
+// retransmitted frame from its reply cache, so no name is counted twice.
+// Returns the number of names the server changed, or -1 on error.
+int send_name_list(int sock, struct sockaddr_in server_addr, uint8_t opcode, const char* username,
+                   const SharedFile* files, int count) {
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    PendingRequest* in_flight[PIPELINE_DEPTH];
+    int changed = 0, sent = 0, failed = 0;
+    int oldest = 0, in_flight_count = 0;
+    while (1) {
+        while (!failed && sent < count && in_flight_count < PIPELINE_DEPTH) {
+            uint32_t request_id = begin_request(&writer, request, opcode);
+            writer.capacity = BULK_FRAME_BYTES;
+            proto_put_str(&writer, username);
+            size_t count_offset = writer.len;
+            proto_put_u16(&writer, 0);  // name count, patched below
+            int batch = 0;
+            while (sent + batch < count && batch < 0xFFFF) {
+                size_t mark = writer.len;
+                proto_put_str(&writer, files[sent + batch].name);
+                if (opcode == OP_ANNOUNCE_BULK) {
+                    proto_put_u64(&writer, files[sent + batch].size);
+                    proto_put_u64(&writer, files[sent + batch].hash);
+                }
+                if (writer.overflow) {
+                    writer.len = mark;
+                    writer.overflow = 0;
+                    break;
+                }
+                batch++;
+            }
+            proto_patch_u16(&writer, count_offset, batch);
+            PendingRequest* pending = start_request(sock, server_addr, &writer, request_id);
+            if (pending == NULL) {
+                failed = 1;
+                break;
+            }
+            in_flight[(oldest + in_flight_count++) % PIPELINE_DEPTH] = pending;
+            sent += batch;
+        }
+        if (in_flight_count == 0) {
+            break;
+        }
+
+        // Collect replies in order; after a failure the rest are still waited for to free their slots
+        PendingRequest* pending = in_flight[oldest];
+        oldest = (oldest + 1) % PIPELINE_DEPTH;
+        in_flight_count--;
+        if (finish_request(pending, reply, &reader, &header) < 0) {
+            failed = 1;
+        } else if (header.status != STATUS_OK) {
+            if (!failed) {
+                print_reply_error(&reader, "Request failed.");
+            }
+            failed = 1;
+        } else {
+            changed += proto_get_u16(&reader);
+        }
+    }
+    return failed ? -1 : changed;
+}
+
+void withdraw_resource(int sock, const char* resource_name, const char* username) {
+    SharedFile file;
+    memset(&file, 0, sizeof(file));
+    snprintf(file.name, sizeof(file.name), "%s", resource_name);
+    int removed = send_name_list(sock, shard_addr(resource_name), OP_WITHDRAW, username, &file, 1);
+    if (removed > 0) {
+        printf("Withdrew resource: %s\n", resource_name);
+    } else if (removed == 0) {
+        printf("Resource '%s' is not announced.\n", resource_name);
+    }
+}
+
+// Function to fetch the files the server lists for username. Returns the
+// number of files stored in *files, or -1 on error with *files freed.
+int fetch_owned_files(int sock, struct sockaddr_in server_addr, const char* username, SharedFile** files) {
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    int count = 0, capacity = 0, cursor = 0, rows;
+    *files = NULL;
+    do {
+        cursor = request_page(sock, server_addr, OP_LIST_OWNED, username, cursor, reply, &reader, &rows);
+        if (cursor == -2) {
+            free(*files);
+            *files = NULL;
+            return -1;
+        }
+        for (int i = 0; i < rows; i++) {
+            SharedFile file;
+            proto_get_str(&reader, file.name, sizeof(file.name));
+            file.size = proto_get_u64(&reader);
+            file.hash = proto_get_u64(&reader);
+            if (reader.error) {
+                break;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                SharedFile* grown = realloc(*files, capacity * sizeof(SharedFile));
+                if (grown == NULL) {
+                    free(*files);
+                    *files = NULL;
+                    return -1;
+                }
+                *files = grown;
+            }
+            (*files)[count++] = file;
+        }
+    } while (cursor >= 0);
+    return count;
+}
+
+// Function to bring one shard's list of our resources in line with the files
+// of the sharing folder that it owns. The files are summarised with OP_SYNC
+// first; only if the shard disagrees are the listed files fetched and the
+// differences sent as bulk announces and withdrawals. local is reordered.
+void sync_shard(int sock, struct sockaddr_in shard_addr, const char* username, SharedFile* local, int local_count) {
+    uint64_t digest = 0;
+    for (int k = 0; k < local_count; k++) {
+        digest += proto_manifest_entry_hash(local[k].name, local[k].size, local[k].hash);
+    }
+    char label[32] = "the server";
+    if (shard_map.count > 1) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &shard_addr.sin_addr, ip, sizeof(ip));
+        snprintf(label, sizeof(label), "%s:%d", ip, ntohs(shard_addr.sin_port));
+    }
+
+    uint8_t request[BUFFER_SIZE], reply[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoReader reader;
+    ProtoHeader header;
+    uint32_t request_id = begin_request(&writer, request, OP_SYNC);
+    proto_put_str(&writer, username);
+    proto_put_u32(&writer, local_count);
+    proto_put_u64(&writer, digest);
+    SharedFile* remote = NULL;
+    int remote_count = 0;
+    if (send_request(sock, shard_addr, &writer, request_id, reply, &reader, &header) < 0 ||
+        header.status != STATUS_OK) {
+        print_reply_error(&reader, "Failed to sync resources.");
+        return;
+    }
+    int in_sync = proto_get_u8(&reader);
+    uint32_t server_count = proto_get_u32(&reader);
+    if (in_sync) {
+        printf("Shared folder is in sync with %s (%d resources).\n", label, local_count);
+        return;
+    }
+    if (server_count > 0) {
+        remote_count = fetch_owned_files(sock, shard_addr, username, &remote);
+        if (remote_count < 0) {
+            printf("Failed to fetch announced resources.\n");
+            return;
+        }
+    }
+
+    // Merge the two sorted lists: files only we have, or whose content
+    // changed, are announced; names only the server has are withdrawn. The
+    // additions are compacted into local and the removals into remote.
+    qsort(local, local_count, sizeof(SharedFile), compare_shared_files);
+    qsort(remote, remote_count, sizeof(SharedFile), compare_shared_files);
+    int added_count = 0, removed_count = 0, i = 0, j = 0;
+    while (i < local_count || j < remote_count) {
+        int order = i == local_count ? 1 : j == remote_count ? -1 : strcmp(local[i].name, remote[j].name);
+        if (order == 0 && (local[i].size != remote[j].size || local[i].hash != remote[j].hash)) {
+            j++;
+            order = -1;
+        }
+        if (order < 0) {
+            SharedFile file = local[i];
+            local[i++] = local[added_count];
+            local[added_count++] = file;
+        } else if (order > 0) {
+            SharedFile file = remote[j];
+            remote[j++] = remote[removed_count];
+            remote[removed_count++] = file;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    int announced = send_name_list(sock, shard_addr, OP_ANNOUNCE_BULK, username, local, added_count);
+    int withdrawn = send_name_list(sock, shard_addr, OP_WITHDRAW, username, remote, removed_count);
+    if (announced < 0 || withdrawn < 0) {
+        printf("Failed to sync resources with %s.\n", label);
+    } else {
+        printf("Announced %d and withdrew %d resource(s) on %s.\n", announced, withdrawn, label);
+    }
+    free(remote);
+}
+
+// Function to tell whether a name of the sharing folder is one of the hash
+// cache's own files, which are never announced
+int is_cache_name(const char* name) {
+    return strncmp(name, HASH_CACHE_NAME, strlen(HASH_CACHE_NAME)) == 0;
+}
+
+// Function to add a described file to a manifest. Returns -1 if out of memory.
+int manifest_add(Manifest* manifest, const HashCacheEntry* entry) {
+    if (manifest->count == manifest->capacity) {
+        int capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+        HashCacheEntry* grown = realloc(manifest->entries, capacity * sizeof(HashCacheEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        manifest->entries = grown;
+        manifest->capacity = capacity;
+    }
+    manifest->entries[manifest->count++] = *entry;
+    return 0;
+}
+
+// Function to describe the files of a directory of the sharing folder and,
+// recursively, of its subdirectories. relative is the directory's path inside
+// the sharing folder ("" for the folder itself), and a file is named by its
+// path from there, such as "music/song.ogg". Symbolic links to directories are
+// not followed, so the walk cannot loop.
+void scan_directory(const char* relative, const HashCacheEntry* cache, int cache_count, Manifest* manifest) {
+    char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+    snprintf(path, sizeof(path), "%s/%s", sharing_folder, relative);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        perror("Failed to open sharing folder");
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip . and .., and the hash cache itself
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (relative[0] == '\0' && is_cache_name(entry->d_name))) {
+            continue;
+        }
+        char name[MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+        snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name);
+        if (strlen(name) >= MAX_RESOURCE_NAME) {
+            printf("Skipping %s: name is too long to announce.\n", name);
+            continue;
+        }
+        struct stat info;
+        snprintf(path, sizeof(path), "%s/%s", sharing_folder, name);
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && lstat(path, &info) == 0 &&
+                                        S_ISDIR(info.st_mode))) {
+            scan_directory(name, cache, cache_count, manifest);
+            continue;
+        }
+        // Unreadable files and other non-regular files cannot be downloaded, so they are not announced
+        HashCacheEntry described;
+        int result = describe_file(sharing_folder, name, cache, cache_count, &described);
+        if (result >= 0 && manifest_add(manifest, &described) == 0) {
+            manifest->hashed += result;
+        }
+    }
+    closedir(dir);
+}
+
+// Function to sync the sharing folder with the directory: every file, in
+// subdirectories too, is described by its size and content hash, and every
+// shard is synced with the files it owns. Only files that changed since the
+// last scan are hashed.
+void announce_resources(int sock, const char* username, const char* sharing_folder) {
+    HashCacheEntry* cache;
+    int cache_count = load_hash_cache(sharing_folder, &cache);
+    Manifest manifest = { 0 };
+    scan_directory("", cache, cache_count, &manifest);
+    HashCacheEntry* local = manifest.entries;
+    int local_count = manifest.count, hashed = manifest.hashed;
+    if (hashed > 0 || local_count != cache_count) {
+        save_hash_cache(sharing_folder, local, local_count);
+    }
+    if (hashed > 0) {
+        printf("Hashed %d new or changed file(s).\n", hashed);
+    }
+    free(cache);
+
+    SharedFile* owned = malloc((local_count + 1) * sizeof(SharedFile));
+    for (int shard = 0; owned != NULL && shard < shard_map.count; shard++) {
+        int owned_count = 0;
+        for (int k = 0; k < local_count; k++) {
+            if (shard_for_name(&shard_map, local[k].file.name) == shard) {
+                owned[owned_count++] = local[k].file;
+            }
+        }
+        sync_shard(sock, shard_map.nodes[shard], username, owned, owned_count);
+    }
+    free(owned);
+    free(local);
+}
+
+// Function to read a clock for timing watcher batches, in milliseconds
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Function to watch a directory of the sharing folder and, recursively, its
+// subdirectories. With mark set, the files found are marked as changed: they
+// may have been written before the watch was in place. Directories past
+// WATCH_LIMIT are left unwatched. Returns -1 if the directory could not be
+// watched.
+int watch_directory(Watcher* watcher, const char* relative, int mark) {
+    if (watcher->dir_count == WATCH_LIMIT) {
+        if (!watcher->limit_reported) {
+            printf("Watching only %d directories of the sharing folder; changes elsewhere are announced "
+                   "at the next start.\n", WATCH_LIMIT);
+            watcher->limit_reported = 1;
+        }
+        return -1;
+    }
+    char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+    snprintf(path, sizeof(path), "%s/%s", sharing_folder, relative);
+    int wd = inotify_add_watch(watcher->fd, path, WATCH_EVENTS);
+    if (wd < 0) {
+        if (errno == ENOSPC && !watcher->limit_reported) {
+            printf("The system limit on inotify watches is reached; raise fs.inotify.max_user_watches "
+                   "to watch the whole sharing folder.\n");
+            watcher->limit_reported = 1;
+        }
+        return -1;
+    }
+    // A directory moved back in place may still have its old watch
+    int slot = 0;
+    while (slot < watcher->dir_count && watcher->dirs[slot].wd != wd) {
+        slot++;
+    }
+    if (slot == watcher->dir_count) {
+        watcher->dir_count++;
+    }
+    watcher->dirs[slot].wd = wd;
+    snprintf(watcher->dirs[slot].path, sizeof(watcher->dirs[slot].path), "%s", relative);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (relative[0] == '\0' && is_cache_name(entry->d_name))) {
+            continue;
+        }
+        char name[MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+        snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name);
+        if (strlen(name) >= MAX_RESOURCE_NAME) {
+            continue;
+        }
+        struct stat info;
+        snprintf(path, sizeof(path), "%s/%s", sharing_folder, name);
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && lstat(path, &info) == 0 &&
+                                        S_ISDIR(info.st_mode))) {
+            watch_directory(watcher, name, mark);
+        } else if (mark) {
+            mark_changed(watcher, name);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Function to stop watching a directory that was moved away, and the
+// directories under it
+void unwatch_directory(Watcher* watcher, const char* relative) {
+    size_t len = strlen(relative);
+    for (int i = watcher->dir_count - 1; i >= 0; i--) {
+        const char* path = watcher->dirs[i].path;
+        if (strncmp(path, relative, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            inotify_rm_watch(watcher->fd, watcher->dirs[i].wd);
+            watcher->dirs[i] = watcher->dirs[--watcher->dir_count];
+        }
+    }
+}
+
+// Function to watch the sharing folder afresh after events were lost: the
+// directories created or moved meanwhile are not watched yet, and watches may
+// remain on paths that went away
+void rewatch_folder(Watcher* watcher) {
+    for (int i = 0; i < watcher->dir_count; i++) {
+        inotify_rm_watch(watcher->fd, watcher->dirs[i].wd);
+    }
+    watcher->dir_count = 0;
+    watcher->limit_reported = 0;
+    watch_directory(watcher, "", 0);
+}
+
+// Function to note that a name of the sharing folder may have changed. A name
+// ending in '/' stands for every file that was shared under that directory.
+void mark_changed(Watcher* watcher, const char* name) {
+    if (watcher->changed_count == 0) {
+        watcher->first_change_ms = monotonic_ms();
+    }
+    watcher->last_change_ms = monotonic_ms();
+    if (watcher->changed_count == watcher->changed_capacity) {
+        int capacity = watcher->changed_capacity ? watcher->changed_capacity * 2 : 64;
+        SharedFile* grown = realloc(watcher->changed, capacity * sizeof(SharedFile));
+        if (grown == NULL) {
+            watcher->rescan = 1;  // Catch up with a full scan instead
+            return;
+        }
+        watcher->changed = grown;
+        watcher->changed_capacity = capacity;
+    }
+    SharedFile* file = &watcher->changed[watcher->changed_count++];
+    memset(file, 0, sizeof(*file));
+    snprintf(file->name, sizeof(file->name), "%s", name);
+}
+
+// Function to turn one inotify event into changed names and watch updates
+void handle_watch_event(Watcher* watcher, const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost; only a full scan can tell what changed
+        if (watcher->changed_count == 0 && !watcher->rescan) {
+            watcher->first_change_ms = monotonic_ms();
+        }
+        watcher->last_change_ms = monotonic_ms();
+        watcher->rescan = 1;
+        return;
+    }
+    int slot = 0;
+    while (slot < watcher->dir_count && watcher->dirs[slot].wd != event->wd) {
+        slot++;
+    }
+    if (slot == watcher->dir_count) {
+        return;  // A directory unwatched earlier in this batch
+    }
+    if (event->mask & IN_IGNORED) {
+        watcher->dirs[slot] = watcher->dirs[--watcher->dir_count];  // The directory is gone
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+    const char* relative = watcher->dirs[slot].path;
+    char name[MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+    snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "", event->name);
+    // A directory's name needs room for the '/' it is marked with
+    if (strlen(name) >= MAX_RESOURCE_NAME - (event->mask & IN_ISDIR ? 1 : 0) ||
+        (relative[0] == '\0' && is_cache_name(event->name))) {
+        return;
+    }
+    if (!(event->mask & IN_ISDIR)) {
+        // A regular file being created is still being written: it is marked
+        // when it is closed (IN_CLOSE_WRITE). Links and special files are
+        // complete when created, and so is a new hard link to a file.
+        struct stat info;
+        char path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + MAX_RESOURCE_NAME];
+        snprintf(path, sizeof(path), "%s/%s", sharing_folder, name);
+        if (!(event->mask & IN_CREATE) || lstat(path, &info) < 0 || !S_ISREG(info.st_mode) || info.st_nlink > 1) {
+            mark_changed(watcher, name);
+        }
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        watch_directory(watcher, name, 1);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        unwatch_directory(watcher, name);
+        strcat(name, "/");
+        mark_changed(watcher, name);
+    }
+}
+
+// Function to bring the directory in line with the changed names: files that
+// exist are described and announced, the others withdrawn, in bulk frames per
+// shard. The hash cache is updated to match.
+void flush_changes(Watcher* watcher) {
+    HashCacheEntry* cache;
+    int cache_count = load_hash_cache(sharing_folder, &cache);
+    // Directories that went away stand for the files shared under them
+    int marked = watcher->changed_count;
+    for (int i = 0; i < marked; i++) {
+        size_t len = strlen(watcher->changed[i].name);
+        if (watcher->changed[i].name[len - 1] != '/') {
+            continue;
+        }
+        for (int k = 0; k < cache_count; k++) {
+            if (strncmp(cache[k].file.name, watcher->changed[i].name, len) == 0) {
+                mark_changed(watcher, cache[k].file.name);
+            }
+        }
+    }
+    qsort(watcher->changed, watcher->changed_count, sizeof(SharedFile), compare_shared_files);
+
+    Manifest kept = { 0 };
+    SharedFile* added = malloc((watcher->changed_count + 1) * sizeof(SharedFile));
+    SharedFile* removed = malloc((watcher->changed_count + 1) * sizeof(SharedFile));
+    int added_count = 0, removed_count = 0;
+    for (int i = 0; added != NULL && removed != NULL && i < watcher->changed_count; i++) {
+        const char* name = watcher->changed[i].name;
+        if ((i > 0 && strcmp(name, watcher->changed[i - 1].name) == 0) || name[strlen(name) - 1] == '/') {
+            continue;
+        }
+        HashCacheEntry described;
+        if (describe_file(sharing_folder, name, cache, cache_count, &described) >= 0) {
+            const HashCacheEntry* cached = bsearch(&described, cache, cache_count, sizeof(HashCacheEntry),
+                                                   compare_shared_files);
+            if (cached == NULL || cached->file.size != described.file.size ||
+                cached->file.hash != described.file.hash) {
+                added[added_count++] = described.file;
+            }
+            manifest_add(&kept, &described);
+        } else {
+            removed[removed_count++] = watcher->changed[i];
+        }
+    }
+    // Unchanged names keep their cache lines
+    for (int k = 0; k < cache_count; k++) {
+        if (bsearch(&cache[k], watcher->changed, watcher->changed_count, sizeof(SharedFile),
+                    compare_shared_files) == NULL) {
+            manifest_add(&kept, &cache[k]);
+        }
+    }
+    qsort(kept.entries, kept.count, sizeof(HashCacheEntry), compare_shared_files);
+    save_hash_cache(sharing_folder, kept.entries, kept.count);
+
+    int announced = 0, withdrawn = 0, failed = 0;
+    SharedFile* batch = malloc((watcher->changed_count + 1) * sizeof(SharedFile));
+    for (int shard = 0; batch != NULL && added != NULL && removed != NULL && shard < shard_map.count; shard++) {
+        struct sockaddr_in addr = shard_map.nodes[shard];
+        int count = 0;
+        for (int i = 0; i < added_count; i++) {
+            if (shard_for_name(&shard_map, added[i].name) == shard) {
+                batch[count++] = added[i];
+            }
+        }
+        int result = count > 0 ? send_name_list(watcher->sock, addr, OP_ANNOUNCE_BULK, watcher->username,
+                                                batch, count) : 0;
+        failed |= result < 0;
+        announced += result > 0 ? result : 0;
+        count = 0;
+        for (int i = 0; i < removed_count; i++) {
+            if (shard_for_name(&shard_map, removed[i].name) == shard) {
+                batch[count++] = removed[i];
+            }
+        }
+        result = count > 0 ? send_name_list(watcher->sock, addr, OP_WITHDRAW, watcher->username, batch, count) : 0;
+        failed |= result < 0;
+        withdrawn += result > 0 ? result : 0;
+    }
+    if (failed) {
+        printf("Failed to announce changes in the sharing folder.\n");
+    } else if (announced > 0 || withdrawn > 0) {
+        printf("Announced %d and withdrew %d resource(s) after changes in the sharing folder.\n", announced,
+               withdrawn);
+    }
+    free(batch);
+    free(added);
+    free(removed);
+    free(kept.entries);
+    free(cache);
+    watcher->changed_count = 0;
+}
+
+// Function to start watching the sharing folder. It is called before the
+// folder is first scanned, so nothing written in between is missed.
+// Returns NULL if inotify is not available.
+Watcher* start_watcher(int sock, const char* username) {
+    Watcher* watcher = calloc(1, sizeof(Watcher));
+    if (watcher == NULL) {
+        return NULL;
+    }
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        perror("Failed to watch the sharing folder");
+        free(watcher);
+        return NULL;
+    }
+    watcher->sock = sock;
+    watcher->username = username;
+    watch_directory(watcher, "", 0);
+    return watcher;
+}
+
+// Function to keep the directory up to date with the sharing folder. Events
+// are collected until the folder has been quiet for WATCH_SETTLE_MS, or for
+// at most WATCH_BATCH_MS while changes keep coming, and then sent as one
+// batch, so a file copied in or a tree unpacked costs a few bulk frames.
+void* watcher_thread(void* arg) {
+    Watcher* watcher = arg;
+    // Aligned as the kernel writes whole inotify_event structures into it
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (running) {
+        int timeout = 1000;
+        if (watcher->changed_count > 0 || watcher->rescan) {
+            long long now = monotonic_ms();
+            long long due = watcher->last_change_ms + WATCH_SETTLE_MS;
+            if (due > watcher->first_change_ms + WATCH_BATCH_MS) {
+                due = watcher->first_change_ms + WATCH_BATCH_MS;
+            }
+            if (due <= now) {
+                if (watcher->rescan) {
+                    watcher->rescan = 0;
+                    watcher->changed_count = 0;
+                    rewatch_folder(watcher);
+                    announce_resources(watcher->sock, watcher->username, sharing_folder);
+                } else {
+                    flush_changes(watcher);
+                }
+                continue;
+            }
+            timeout = due - now;
+        }
+        struct pollfd ready = { .fd = watcher->fd, .events = POLLIN };
+        if (poll(&ready, 1, timeout) <= 0) {
+            continue;
+        }
+        ssize_t len;
+        while ((len = read(watcher->fd, events, sizeof(events))) > 0) {
+            for (char* at = events; at < events + len;) {
+                const struct inotify_event* event = (const struct inotify_event*)at;
+                handle_watch_event(watcher, event);
+                at += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to fetch one page of a paged query; name is only sent for
+// OP_RESOURCE_INFO, OP_SEARCH and OP_LIST_OWNED. On success the reader is positioned on the rows and *rows
+// holds their count. Returns the cursor of the next page, -1 after the last
+// page, or -2 if the server answered with an error (which is printed).
+int request_page(int sock, struct sockaddr_in server_addr, uint8_t opcode, const char* name, int cursor,
+                 uint8_t* reply, ProtoReader* reader, int* rows) {
+    uint8_t request[BUFFER_SIZE];
+    ProtoWriter writer;
+    ProtoHeader header;
+    uint32_t request_id = write_page_request(&writer, request, opcode, name, cursor);
+    if (send_request(sock, server_addr, &writer, request_id, reply, reader, &header) < 0) {
+        return -2;
+    }
+    return read_page_reply(&header, reader, rows);
+}
+
+// Function to write the request for one page of a paged query; name is only
+// sent for OP_RESOURCE_INFO, OP_SEARCH and OP_LIST_OWNED. Returns the request id.
+uint32_t write_page_request(ProtoWriter* writer, uint8_t* buffer, uint8_t opcode, const char* name, int cursor) {
+    uint32_t request_id = begin_request(writer, buffer, opcode);
+    if (name != NULL) {
+        proto_put_str(writer, name);
+    }
+    proto_put_u32(writer, cursor);
+    proto_put_u16(writer, PAGE_ROWS);
+    return request_id;
+}
+
+// Function to read the start of a page reply, leaving the reader on the rows.
+// Returns the cursor of the next page, -1 after the last page, or -2 if the
+// server answered with an error (which is printed).
+int read_page_reply(const ProtoHeader* header, ProtoReader* reader, int* rows) {
+    if (header->status != STATUS_OK) {
+        print_reply_error(reader, "Query failed.");
+        return -2;
+    }
+    uint32_t next_cursor = proto_get_u32(reader);
+    *rows = proto_get_u16(reader);
+    if (reader->error) {
+        printf("Malformed reply from server.\n");
+        return -2;
+    }
+    return next_cursor == PROTO_END_CURSOR ? -1 : (int)next_cursor;
+}
+
+// Function to format an IPv4 address carried as a u32 in host byte order
+void format_ip(uint32_t ip, char* out) {
+    struct in_addr addr;
+    addr.s_addr = htonl(ip);
+    inet_ntop(AF_INET, &addr, out, INET_ADDRSTRLEN);
+}
+
+// Function to list the resources of every shard
+void query_resources(int sock) {
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    int cursor = 0, found = 0, rows, shard = 0;
+    do {
+        cursor = request_page(sock, shard_map.nodes[shard], OP_QUERY_RESOURCES, NULL, cursor, reply, &reader, &rows);
+        if (cursor == -2) {
+            return;
+        }
+        if (cursor == -1 && ++shard < shard_map.count) {
+            cursor = 0;  // Continue with the next shard
+        }
+        for (int i = 0; i < rows; i++) {
+            char resource_name[MAX_FILENAME_LENGTH], owner[50], owner_ip[INET_ADDRSTRLEN];
+            proto_get_str(&reader, resource_name, sizeof(resource_name));
+            proto_get_str(&reader, owner, sizeof(owner));
+            format_ip(proto_get_u32(&reader), owner_ip);
+            int owner_tcp_port = proto_get_u16(&reader);
+            if (reader.error) {
+                break;
+            }
+            if (!found) {
+                printf("Resources:\n");
+                found = 1;
+            }
+            printf("%s (Owner: %s, IP: %s, TCP Port: %d)\n", resource_name, owner, owner_ip, owner_tcp_port);
+        }
+    } while (cursor >= 0);
+    if (!found) {
+        printf("No resources available.\n");
+    }
+}
+
+void query_users(int sock, struct sockaddr_in server_addr) {
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    int cursor = 0, found = 0, rows;
+    do {
+        cursor = request_page(sock, server_addr, OP_QUERY_USERS, NULL, cursor, reply, &reader, &rows);
+        if (cursor == -2) {
+            return;
+        }
+        for (int i = 0; i < rows; i++) {
+            char username[50];
+            if (proto_get_str(&reader, username, sizeof(username)) < 0) {
+                break;
+            }
+            if (!found) {
+                printf("Active users:\n");
+                found = 1;
+            }
+            printf("%s\n", username);
+        }
+    } while (cursor >= 0);
+    if (!found) {
+        printf("No active users.\n");
+    }
+}
+
+// Function to search resource names on the server. A pattern without * ? or [
+// matches names containing it; otherwise it is a glob over the whole name.
+void search_resources(int sock) {
+    char pattern[MAX_FILENAME_LENGTH];
+    printf("Enter a search pattern (text or glob, e.g. report or *.pdf): ");
+    fgets(pattern, sizeof(pattern), stdin);
+    pattern[strcspn(pattern, "\n")] = '\0';
+
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    int cursor = 0, found = 0, rows, shard = 0;
+    do {
+        // Every name lives on exactly one shard, so the results of all shards are simply joined
+        cursor = request_page(sock, shard_map.nodes[shard], OP_SEARCH, pattern, cursor, reply, &reader, &rows);
+        if (cursor == -2) {
+            return;
+        }
+        if (cursor == -1 && ++shard < shard_map.count) {
+            cursor = 0;
+        }
+        for (int i = 0; i < rows; i++) {
+            char resource_name[MAX_FILENAME_LENGTH];
+            proto_get_str(&reader, resource_name, sizeof(resource_name));
+            int owner_count = proto_get_u16(&reader);
+            if (reader.error) {
+                break;
+            }
+            printf("%s (Owners: %d)\n", resource_name, owner_count);
+            found++;
+        }
+    } while (cursor >= 0);
+    if (found == 0) {
+        printf("No resources match '%s'.\n", pattern);
+    }
+}
+
+void respond_to_hello(int sock, struct sockaddr_in server_addr, int binary) {
+    if (binary) {
+        uint8_t frame[PROTO_HEADER_SIZE];
+        ProtoWriter writer;
+        proto_writer_init(&writer, frame, sizeof(frame), OP_HELLO_RESPONSE, STATUS_OK, 0);
+        sendto(sock, frame, proto_finish(&writer), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+        return;
+    }
+    char message[] = "hello response";
+    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+}
+
+void* listener_thread(void* arg) {
+    int sock = *(int*)arg;
+    char message[BUFFER_SIZE];
+    struct sockaddr_in from_addr;
+    socklen_t from_len = sizeof(from_addr);
+    while (running) {
+        int bytes_received = recvfrom(sock, message, BUFFER_SIZE, 0, (struct sockaddr*)&from_addr, &from_len);
+        if (bytes_received > 0) {
+            if (proto_is_frame(message, bytes_received) && (uint8_t)message[2] == OP_HELLO) {
+                respond_to_hello(sock, from_addr, 1);
+            } else if (bytes_received == 5 && memcmp(message, "hello", 5) == 0) {
+                respond_to_hello(sock, from_addr, 0);
+            } else {
+                complete_request(message, bytes_received);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to check that a requested name stays inside the sharing folder:
+// names may lead into subdirectories, but not start at the root or go up
+int is_shared_path(const char* name) {
+    if (name[0] == '/') {
+        return 0;
+    }
+    for (const char* part = name;; part++) {
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            return 0;
+        }
+        part = strchr(part, '/');
+        if (part == NULL) {
+            return 1;
+        }
+    }
+}
+
+// Function to tell from its extension whether a file is already compressed,
+// so compressing it again would only cost CPU
+int is_compressed_name(const char* filename) {
+    static const char* extensions[] = {
+        "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+        "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "webm", "mov", "ogg", "flac"
+    };
+    const char* dot = strrchr(filename, '.');
+    for (size_t i = 0; dot != NULL && i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcasecmp(dot + 1, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to parse a "get <filename> [<offset> <length> [<flags>]]" request
+// and open the file. On success the header becomes "OK <size> <offset>
+// <length> [<flags>]", with the size of the whole file and the range that
+// follows: the requested one, cut at the end of the file. The peer asks for
+// compression with the flag "z"; if the file is worth compressing, "z" is
+// echoed and the range is sent as blocks (see upload_next_block). With "k" it
+// asks to keep the connection open for further requests, which is always
+// granted and echoed. Otherwise the header carries the error, fd stays -1 and
+// the connection is closed after it. Only the first line of the request
+// buffer is parsed; requests pipelined behind it wait their turn.
+void upload_open(Upload* upload) {
+    char filename[MAX_FILENAME_LENGTH], flag[8] = "", line[UPLOAD_REQUEST_BYTES];
+    long long offset = 0, length = -1;
+    char* newline = memchr(upload->request, '\n', upload->request_len);
+    size_t line_len = newline != NULL ? (size_t)(newline - upload->request) : upload->request_len;
+    memcpy(line, upload->request, line_len);
+    line[line_len] = '\0';
+    int fields = sscanf(line, "get %255s %lld %lld %7s", filename, &offset, &length, flag);
+    if ((fields == 1 || (fields >= 3 && offset >= 0 && length >= 0)) && is_shared_path(filename)) {
+        char filepath[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
+        snprintf(filepath, sizeof(filepath), "%s/%s", sharing_folder, filename);
+        upload->fd = open(filepath, O_RDONLY);
+        struct stat info;
+        if (upload->fd >= 0 && (fstat(upload->fd, &info) < 0 || !S_ISREG(info.st_mode))) {
+            close(upload->fd);
+            upload->fd = -1;
+        }
+        if (upload->fd >= 0 && offset > info.st_size) {
+            close(upload->fd);
+            upload->fd = -1;
+            upload->header_len = snprintf(upload->header, sizeof(upload->header),
+                                          "Error: Range starts past the end of the file.\n");
+            return;
+        }
+        if (upload->fd >= 0) {
+            upload->offset = offset;
+            upload->end = length >= 0 && length < info.st_size - offset ? offset + length : info.st_size;
+            upload->raw_end = upload->offset;
+            if (strchr(flag, 'z') != NULL && !is_compressed_name(filename)) {
+                upload->block = malloc(8 + compressBound(COMPRESS_BLOCK));
+                upload->framed = upload->block != NULL;
+            }
+            upload->keep_alive = strchr(flag, 'k') != NULL;
+            upload->header_len = snprintf(upload->header, sizeof(upload->header), "OK %lld %lld %lld%s%s%s\n",
+                                          (long long)info.st_size, (long long)upload->offset,
+                                          (long long)(upload->end - upload->offset),
+                                          upload->framed || upload->keep_alive ? " " : "",
+                                          upload->framed ? "z" : "", upload->keep_alive ? "k" : "");
+            return;
+        }
+    }
+    upload->header_len = snprintf(upload->header, sizeof(upload->header), "Error: File not found.\n");
+}
+
+// Function to read the request of an upload, which ends at a newline. Peers
+// from before keep-alive send a single "get <filename>" without one, so a first
+// request that still looks like that when the data stops is given a
+// request_due, after which upload_expire_requests takes it as complete. A
+// request with further fields cannot be such a request and waits for its
+// newline. Returns 1 once the request is complete, 0 if more is expected, or -1
+// on error.
+int upload_read_request(Upload* upload) {
+    upload->request_due = 0;
+    if (memchr(upload->request, '\n', upload->request_len) != NULL) {
+        return 1;  // Pipelined behind the previous request
+    }
+    while (upload->request_len < UPLOAD_REQUEST_BYTES - 1) {
+        ssize_t n = recv(upload->sock, upload->request + upload->request_len,
+                         UPLOAD_REQUEST_BYTES - 1 - upload->request_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            char* space = memchr(upload->request, ' ', upload->request_len);
+            if (upload->served == 0 && upload->request_len > 0 &&
+                (space == NULL || memchr(space + 1, ' ', upload->request + upload->request_len - space - 1) == NULL)) {
+                upload->request_due = monotonic_ms() + UPLOAD_LEGACY_WAIT_MS;
+            }
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        upload->request_len += n;
+        if (memchr(upload->request, '\n', upload->request_len) != NULL) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// Function to compress the next block of a framed upload, block_raw bytes
+// from its offset, into its block buffer. Runs on a compression worker, which
+// passes its own raw buffer. Sets block_stored to the compressed length if it
+// saves at least an eighth, else to block_raw, or to -1 if the file cannot be
+// read.
+void upload_compress_block(Upload* upload, uint8_t* raw) {
+    uint32_t raw_len = upload->block_raw;
+    if (pread(upload->fd, raw, raw_len, upload->offset) != raw_len) {
+        upload->block_stored = -1;
+        return;
+    }
+    uLongf compressed_len = compressBound(COMPRESS_BLOCK);
+    upload->block_stored = raw_len;
+    if (compress2(upload->block + 8, &compressed_len, raw, raw_len, COMPRESS_LEVEL) == Z_OK &&
+        compressed_len < raw_len - raw_len / 8) {
+        upload->block_stored = compressed_len;
+    }
+}
+
+// Function to start the next block of a framed upload once its data is
+// ready. A block is a header of u32 raw_len and u32 stored_len, then
+// stored_len bytes: the zlib-compressed data, or the raw data if stored_len
+// equals raw_len. Blocks are compressed independently, so a downloader can
+// decompress the chunks it fetches in parallel. Once blocks stop shrinking,
+// the rest of the range is sent raw without trying.
+void upload_next_block(Upload* upload) {
+    uint32_t raw_len = upload->block_raw, stored_len = upload->block_stored;
+    if (stored_len < raw_len) {
+        upload->compress_misses = 0;
+    } else if (upload->compress_misses < COMPRESS_GIVE_UP) {
+        upload->compress_misses++;
+    }
+    uint32_t fields[2] = { htonl(raw_len), htonl(stored_len) };
+    memcpy(upload->block, fields, 8);
+    upload->block_sent = 0;
+    if (stored_len < raw_len) {
+        upload->block_len = 8 + stored_len;
+        upload->offset += raw_len;
+        upload->raw_end = upload->offset;
+    } else {
+        upload->block_len = 8;
+        upload->raw_end = upload->offset + raw_len;
+    }
+}
+
+// Function to send as much of the header and range as the socket takes without
+// blocking. The header always goes out whole; after it, at most budget bytes
+// of the range are sent, block headers included, and *sent is set to them.
+// Raw data goes from the page cache to the socket with sendfile, without being
+// copied through user space. Returns 1 when the upload is finished, -1 on
+// error, 2 when the next block has to be compressed first (block_raw is set),
+// or 0 otherwise: if *sent is below budget the socket is full and the upload
+// continues once it is writable.
+int upload_send(Upload* upload, long long budget, long long* sent) {
+    *sent = 0;
+    // Headers are held back to go out with the data after them; the socket has
+    // TCP_NODELAY, so a kept-alive connection does not wait for delayed ACKs
+    int more = budget > 0 && upload->fd >= 0 && upload->offset < upload->end ? MSG_MORE : 0;
+    while (upload->header_sent < upload->header_len) {
+        ssize_t n = send(upload->sock, upload->header + upload->header_sent,
+                         upload->header_len - upload->header_sent, MSG_NOSIGNAL | more);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        upload->header_sent += n;
+        upload->last_progress = time(NULL);
+    }
+    if (upload->fd < 0) {
+        return 1;  // Only an error header to send
+    }
+    while (upload->framed) {
+        long long left = budget - *sent;
+        if (upload->block_sent < upload->block_len) {
+            size_t want = upload->block_len - upload->block_sent;
+            if (left == 0) {
+                return 0;
+            }
+            ssize_t n = send(upload->sock, upload->block + upload->block_sent, want < (size_t)left ? want : left,
+                             MSG_NOSIGNAL | (upload->offset < upload->raw_end ? MSG_MORE : 0));
+            if (n < 0) {
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            }
+            upload->block_sent += n;
+            *sent += n;
+            upload->last_progress = time(NULL);
+        } else if (upload->offset < upload->raw_end) {
+            long long want = upload->raw_end - upload->offset;
+            if (left == 0) {
+                return 0;
+            }
+            ssize_t n = sendfile(upload->sock, upload->fd, &upload->offset, want < left ? want : left);
+            if (n < 0) {
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            *sent += n;
+            upload->last_progress = time(NULL);
+        } else if (upload->offset == upload->end) {
+            return 1;
+        } else if (left == 0) {
+            return 0;
+        } else {
+            upload->block_raw = upload->end - upload->offset < COMPRESS_BLOCK ? upload->end - upload->offset
+                                                                              : COMPRESS_BLOCK;
+            if (upload->compress_misses < COMPRESS_GIVE_UP) {
+                return 2;  // For a compression worker (see upload_compress)
+            }
+            upload->block_stored = upload->block_raw;
+            upload_next_block(upload);
+        }
+    }
+    while (upload->offset < upload->end) {
+        // Nothing past the range may follow on a kept-alive connection
+        long long want = upload->end - upload->offset, left = budget - *sent;
+        if (left == 0) {
+            return 0;
+        }
+        ssize_t n = sendfile(upload->sock, upload->fd, &upload->offset, want < left ? want : left);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;  // The file shrank under us
+        }
+        *sent += n;
+        upload->last_progress = time(NULL);
+    }
+    return 1;
+}
+
+// Function to get a kept-alive connection ready for its next request once a
+// response is finished: the file is closed and the answered line dropped from
+// the request buffer. Returns 1 if the next request is already buffered, 0 if
+// it has to be read first.
+int upload_next_request(Upload* upload) {
+    close(upload->fd);
+    upload->fd = -1;
+    free(upload->block);
+    upload->block = NULL;
+    upload->framed = 0;
+    upload->compress_misses = 0;
+    upload->block_len = 0;
+    upload->block_sent = 0;
+    upload->header_len = 0;
+    upload->header_sent = 0;
+    upload->keep_alive = 0;
+    upload->served++;
+    char* newline = memchr(upload->request, '\n', upload->request_len);
+    size_t line_len = newline != NULL ? (size_t)(newline - upload->request) + 1 : upload->request_len;
+    upload->request_len -= line_len;
+    memmove(upload->request, upload->request + line_len, upload->request_len);
+    return memchr(upload->request, '\n', upload->request_len) != NULL;
+}
+
+// Function to end an upload and free its slot
+void upload_close(Upload* upload) {
+    close(upload->sock);
+    if (upload->fd >= 0) {
+        close(upload->fd);
+    }
+    free(upload->block);
+    upload->block = NULL;
+    upload->sock = -1;
+    upload->fd = -1;
+}
+
+// Function to read the header line of a file transfer into line. It is read
+// a byte at a time so none of the file data after it is consumed. Returns -1
+// if the connection closed or the line does not fit.
+int read_transfer_header(int sock, char* line, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        if (recv(sock, line + len, 1, 0) != 1) {
+            return -1;
+        }
+        if (line[len] == '\n') {
+            line[len] = '\0';
+            return 0;
+        }
+        len++;
+    }
+    return -1;
+}
+
+// Function to find the weight of a downloader's connections in the upload
+// scheduler: the one set for its address, or 1
+int upload_weight(const char* ip) {
+    int weight = 1;
+    pthread_mutex_lock(&limits_mutex);
+    for (int i = 0; i < upload_weight_count; i++) {
+        if (strcmp(upload_weights[i].ip, ip) == 0) {
+            weight = upload_weights[i].weight;
+        }
+    }
+    pthread_mutex_unlock(&limits_mutex);
+    return weight;
+}
+
+// Function to set the weight of a downloader's address; weight 1 removes it
+// from the table. Returns -1 if the table is full.
+int set_upload_weight(const char* ip, int weight) {
+    int result = 0;
+    pthread_mutex_lock(&limits_mutex);
+    int i = 0;
+    while (i < upload_weight_count && strcmp(upload_weights[i].ip, ip) != 0) {
+        i++;
+    }
+    if (weight == 1) {
+        if (i < upload_weight_count) {
+            upload_weights[i] = upload_weights[--upload_weight_count];
+        }
+    } else if (i < upload_weight_count || upload_weight_count < MAX_UPLOAD_WEIGHTS) {
+        if (i == upload_weight_count) {
+            upload_weight_count++;
+        }
+        snprintf(upload_weights[i].ip, sizeof(upload_weights[i].ip), "%s", ip);
+        upload_weights[i].weight = weight;
+    } else {
+        result = -1;
+    }
+    pthread_mutex_unlock(&limits_mutex);
+    return result;
+}
+
+// Function to change which events of an upload's socket the loop waits for;
+// 0 while the upload waits for its turn in the scheduler
+void upload_watch(UploadServer* server, int slot, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.u32 = slot };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->uploads[slot].sock, &event);
+}
+
+// Function to put an upload with data to send at the back of the scheduler's ring
+void upload_queue(UploadServer* server, int slot) {
+    server->active[(server->active_head + server->active_count++) % max_uploads] = slot;
+    server->uploads[slot].queued = 1;
+    upload_watch(server, slot, 0);
+}
+
+// Function to take an upload out of the scheduler's ring, wherever it is
+void upload_dequeue(UploadServer* server, int slot) {
+    int k = 0;
+    while (k < server->active_count && server->active[(server->active_head + k) % max_uploads] != slot) {
+        k++;
+    }
+    for (; k + 1 < server->active_count; k++) {
+        server->active[(server->active_head + k) % max_uploads] =
+            server->active[(server->active_head + k + 1) % max_uploads];
+    }
+    server->active_count--;
+    Upload* upload = &server->uploads[slot];
+    upload->queued = 0;
+    upload->deficit = 0;
+    upload->turn = 0;
+}
+
+// Function to end an upload and free its slot, wherever it is in the loop
+void upload_release(UploadServer* server, int slot) {
+    if (server->uploads[slot].queued) {
+        upload_dequeue(server, slot);
+    }
+    upload_close(&server->uploads[slot]);  // Closing the socket also removes it from the epoll set
+    server->free_slots[server->free_count++] = slot;
+}
+
+// Function to answer the request at the front of an upload's request buffer.
+// The header goes out at once, ahead of the data queued for other
+// downloaders. With credit set, so does a range of up to UPLOAD_MIN_QUANTUM
+// bytes while the token bucket is not empty: size probes and small files are
+// never stuck behind bulk transfers, and the bucket goes at most that far into
+// debt. Requests pipelined behind the first, and longer ranges, wait for their
+// turn in the scheduler like any other.
+void upload_respond(UploadServer* server, int slot, int credit) {
+    Upload* upload = &server->uploads[slot];
+    while (1) {
+        upload_open(upload);
+        upload->weight = upload_weight(upload->peer_ip);
+        int small = credit && upload->fd >= 0 && upload->end - upload->offset <= UPLOAD_MIN_QUANTUM &&
+                    (server->rate == 0 || server->tokens > 0);
+        credit = 0;
+        long long sent;
+        int result = upload_send(upload, small ? UPLOAD_MIN_QUANTUM : 0, &sent);
+        if (server->rate > 0) {
+            server->tokens -= sent;
+        }
+        if (result == 2) {
+            upload_compress(server, slot);
+            return;
+        }
+        if (result == 0) {
+            upload_queue(server, slot);
+            return;
+        }
+        if (result < 0 || !upload->keep_alive) {
+            upload_release(server, slot);
+            return;
+        }
+        if (upload_next_request(upload) == 0) {
+            upload_watch(server, slot, EPOLLIN);
+            return;
+        }
+    }
+}
+
+// Function to answer the first requests without newline that have waited out
+// their request_due. Returns the earliest request_due still pending, or 0.
+long long upload_expire_requests(UploadServer* server, long long now_ms) {
+    long long next_due = 0;
+    for (int i = 0; i < max_uploads; i++) {
+        Upload* upload = &server->uploads[i];
+        if (upload->sock < 0 || upload->request_due == 0) {
+            continue;
+        }
+        if (upload->request_due <= now_ms) {
+            upload->request_due = 0;
+            upload_respond(server, i, 1);
+        } else if (next_due == 0 || upload->request_due < next_due) {
+            next_due = upload->request_due;
+        }
+    }
+    return next_due;
+}
+
+// Function to move on once an upload's range is sent: a kept-alive
+// connection answers the next pipelined request or waits for one, any other
+// is closed
+void upload_done(UploadServer* server, int slot) {
+    Upload* upload = &server->uploads[slot];
+    if (!upload->keep_alive) {
+        upload_release(server, slot);
+    } else if (upload_next_request(upload)) {
+        upload_respond(server, slot, 0);
+    } else {
+        upload_watch(server, slot, EPOLLIN);
+    }
+}
+
+// Function to share out the upload bandwidth by deficit round robin. Each
+// upload in the ring gets a quantum times its weight per round and sends up
+// to that much, as far as the token bucket allows; one that runs out of
+// tokens mid-turn keeps its turn for when they are back. An upload whose
+// socket fills up leaves the ring until it is writable again. tokens is
+// ignored without a rate cap. Each upload gets at most one turn per call.
+void upload_schedule(UploadServer* server, long long quantum) {
+    long long rate = server->rate, *tokens = &server->tokens;
+    for (int turns = server->active_count; turns > 0 && server->active_count > 0 && (rate == 0 || *tokens > 0);
+         turns--) {
+        int slot = server->active[server->active_head];
+        Upload* upload = &server->uploads[slot];
+        if (!upload->turn) {
+            upload->deficit += quantum * upload->weight;
+            upload->turn = 1;
+        }
+        long long budget = rate == 0 || upload->deficit < *tokens ? upload->deficit : *tokens;
+        long long sent;
+        int result = upload_send(upload, budget, &sent);
+        upload->deficit -= sent;
+        if (rate > 0) {
+            *tokens -= sent;
+        }
+        if (result != 0 || sent < budget) {
+            upload_dequeue(server, slot);
+            if (result < 0) {
+                upload_release(server, slot);
+            } else if (result == 1) {
+                upload_done(server, slot);
+            } else if (result == 2) {
+                upload_compress(server, slot);
+            } else {
+                upload_watch(server, slot, EPOLLOUT);
+            }
+        } else if (upload->deficit <= 0) {
+            // Turn over: to the back of the ring
+            server->active_head = (server->active_head + 1) % max_uploads;
+            server->active[(server->active_head + server->active_count - 1) % max_uploads] = slot;
+            upload->turn = 0;
+        } else {
+            break;  // Out of tokens
+        }
+    }
+}
+
+// Function to hand the next block of a framed upload to the compression
+// workers. The socket leaves the epoll set until the block is ready, and the
+// upload is not touched by the loop meanwhile.
+void upload_compress(UploadServer* server, int slot) {
+    if (server->compress_workers == 0) {
+        static uint8_t raw[COMPRESS_BLOCK];  // No worker could be started: compress here
+        upload_compress_block(&server->uploads[slot], raw);
+        if (server->uploads[slot].block_stored < 0) {
+            upload_release(server, slot);
+        } else {
+            upload_next_block(&server->uploads[slot]);
+            upload_queue(server, slot);
+        }
+        return;
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->uploads[slot].sock, NULL);
+    server->uploads[slot].compressing = 1;
+    pthread_mutex_lock(&server->compress_mutex);
+    server->compress_jobs[(server->compress_head + server->compress_count++) % max_uploads] = slot;
+    pthread_cond_signal(&server->compress_ready);
+    pthread_mutex_unlock(&server->compress_mutex);
+}
+
+// Function to take back the uploads whose block the workers have finished and
+// queue them for their turn
+void upload_compressed(UploadServer* server) {
+    uint64_t count;
+    if (read(server->compress_event, &count, sizeof(count)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&server->compress_mutex);
+    int ready = server->compressed_count;
+    int* slots = server->compressed;
+    server->compressed_count = 0;
+    for (int i = 0; i < ready; i++) {
+        int slot = slots[i];
+        Upload* upload = &server->uploads[slot];
+        upload->compressing = 0;
+        struct epoll_event event = { .events = 0, .data.u32 = slot };
+        if (upload->block_stored < 0 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, upload->sock, &event) < 0) {
+            upload_release(server, slot);
+            continue;
+        }
+        upload_next_block(upload);
+        upload_queue(server, slot);
+    }
+    pthread_mutex_unlock(&server->compress_mutex);
+}
+
+// Function run by each compression worker: compress blocks for the upload
+// loop, in the order they were asked for, and wake the loop when one is ready
+void* compress_worker(void* arg) {
+    UploadServer* server = arg;
+    uint8_t* raw = malloc(COMPRESS_BLOCK);
+    if (raw == NULL) {
+        return NULL;
+    }
+    uint64_t one = 1;
+    pthread_mutex_lock(&server->compress_mutex);
+    while (1) {
+        while (server->compress_count == 0 && !server->compress_stop) {
+            pthread_cond_wait(&server->compress_ready, &server->compress_mutex);
+        }
+        if (server->compress_stop) {
+            break;
+        }
+        int slot = server->compress_jobs[server->compress_head];
+        server->compress_head = (server->compress_head + 1) % max_uploads;
+        server->compress_count--;
+        pthread_mutex_unlock(&server->compress_mutex);
+        upload_compress_block(&server->uploads[slot], raw);
+        pthread_mutex_lock(&server->compress_mutex);
+        server->compressed[server->compressed_count++] = slot;
+        if (write(server->compress_event, &one, sizeof(one)) < 0) {
+            perror("Failed to wake the upload loop");
+        }
+    }
+    pthread_mutex_unlock(&server->compress_mutex);
+    free(raw);
+    return NULL;
+}
+
+// Function to serve downloads to other peers. One thread runs an epoll loop
+// over non-blocking sockets, and at most max_uploads downloads are served at
+// once from a table allocated up front. While the table is full the listening
+// socket is left out of the loop, so further peers wait in the kernel's accept
+// queue (listen_backlog) instead of being refused. Data is sent by
+// upload_schedule, paced by a token bucket when upload_rate is set; the
+// bucket holds UPLOAD_BURST_MS worth of the rate.
+void* tcp_server_thread(void* arg) {
+    int server_sock = *(int*)arg;
+    UploadServer server;
+    server.uploads = malloc(max_uploads * sizeof(Upload));
+    server.free_slots = malloc(max_uploads * sizeof(int));
+    server.active = malloc(max_uploads * sizeof(int));
+    server.compress_jobs = malloc(max_uploads * sizeof(int));
+    server.compressed = malloc(max_uploads * sizeof(int));
+    server.epoll_fd = epoll_create1(0);
+    server.compress_event = eventfd(0, EFD_NONBLOCK);
+    if (server.uploads == NULL || server.free_slots == NULL || server.active == NULL ||
+        server.compress_jobs == NULL || server.compressed == NULL || server.epoll_fd < 0 ||
+        server.compress_event < 0) {
+        perror("Failed to start the upload server");
+        free(server.uploads);
+        free(server.free_slots);
+        free(server.active);
+        free(server.compress_jobs);
+        free(server.compressed);
+        return NULL;
+    }
+    pthread_mutex_init(&server.compress_mutex, NULL);
+    pthread_cond_init(&server.compress_ready, NULL);
+    server.compress_head = 0;
+    server.compress_count = 0;
+    server.compressed_count = 0;
+    server.compress_stop = 0;
+    pthread_t compress_threads[COMPRESS_WORKERS];
+    int compress_started = 0;
+    while (compress_started < COMPRESS_WORKERS &&
+           pthread_create(&compress_threads[compress_started], NULL, compress_worker, &server) == 0) {
+        compress_started++;
+    }
+    server.compress_workers = compress_started;
+    Upload* uploads = server.uploads;
+    server.free_count = max_uploads;
+    server.active_head = 0;
+    server.active_count = 0;
+    for (int i = 0; i < max_uploads; i++) {
+        uploads[i].sock = -1;
+        uploads[i].fd = -1;
+        uploads[i].block = NULL;
+        server.free_slots[i] = max_uploads - 1 - i;
+    }
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.u32 = max_uploads };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server_sock, &listen_event);
+    struct epoll_event compress_event = { .events = EPOLLIN, .data.u32 = max_uploads + 1 };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.compress_event, &compress_event);
+    int accepting = 1;
+    // After running out of descriptors: when to accept again, unless an upload
+    // is released (free_count grows past accept_free_count) before then
+    long long accept_retry_ms = 0;
+    int accept_free_count = 0;
+    time_t last_sweep = time(NULL);
+    server.tokens = 0;
+    server.request_due = 0;
+    long long last_refill = monotonic_ms();
+
+    while (running) {
+        // Refill the bucket; the limits can change at any time from the menu
+        long long rate = server.rate = __atomic_load_n(&upload_rate, __ATOMIC_RELAXED);
+        long long burst = rate * UPLOAD_BURST_MS / 1000 > UPLOAD_MIN_QUANTUM ? rate * UPLOAD_BURST_MS / 1000
+                                                                              : UPLOAD_MIN_QUANTUM;
+        long long quantum = rate == 0 || burst > UPLOAD_SLICE ? UPLOAD_SLICE : burst;
+        long long now_ms = monotonic_ms();
+        long long added = rate * (now_ms - last_refill) / 1000;
+        if (added > 0 || rate == 0) {
+            server.tokens = server.tokens + added < burst ? server.tokens + added : burst;
+            last_refill = now_ms;
+        }
+        int timeout = 1000;
+        if (server.active_count > 0) {
+            timeout = rate == 0 || server.tokens > 0 ? 0 : (int)((1 - server.tokens) * 1000 / rate) + 1;
+        }
+        if (accept_retry_ms > 0 && accept_retry_ms - now_ms < timeout) {
+            timeout = accept_retry_ms > now_ms ? (int)(accept_retry_ms - now_ms) : 0;
+        }
+        if (server.request_due > 0 && server.request_due - now_ms < timeout) {
+            timeout = server.request_due > now_ms ? (int)(server.request_due - now_ms) : 0;
+        }
+
+        struct epoll_event events[UPLOAD_EVENTS];
+        int ready = epoll_wait(server.epoll_fd, events, UPLOAD_EVENTS, timeout);
+        for (int e = 0; e < ready; e++) {
+            if (events[e].data.u32 == (uint32_t)max_uploads) {
+                // Accept while there are free slots
+                while (server.free_count > 0) {
+                    struct sockaddr_in peer_addr;
+                    socklen_t peer_len = sizeof(peer_addr);
+                    int client_sock = accept4(server_sock, (struct sockaddr*)&peer_addr, &peer_len, SOCK_NONBLOCK);
+                    if (client_sock < 0) {
+                        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                            // The connection stays queued, so the listener would
+                            // report it again at once; stop watching it for a while
+                            accept_retry_ms = monotonic_ms() + UPLOAD_ACCEPT_RETRY_MS;
+                            accept_free_count = server.free_count;
+                        }
+                        break;
+                    }
+                    int nodelay = 1, tos = IPTOS_THROUGHPUT;  // Queued behind control traffic (see main)
+                    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                    setsockopt(client_sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+                    int slot = server.free_slots[--server.free_count];
+                    Upload* upload = &uploads[slot];
+                    memset(upload, 0, sizeof(*upload));
+                    upload->sock = client_sock;
+                    upload->fd = -1;
+                    upload->last_progress = time(NULL);
+                    inet_ntop(AF_INET, &peer_addr.sin_addr, upload->peer_ip, sizeof(upload->peer_ip));
+                    struct epoll_event event = { .events = EPOLLIN, .data.u32 = slot };
+                    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, client_sock, &event);
+                }
+                if (server.free_count == 0 || accept_retry_ms > 0) {
+                    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, server_sock, NULL);
+                    accepting = 0;
+                }
+                continue;
+            }
+            if (events[e].data.u32 == (uint32_t)max_uploads + 1) {
+                upload_compressed(&server);
+                continue;
+            }
+
+            int slot = events[e].data.u32;
+            Upload* upload = &uploads[slot];
+            if (upload->sock < 0) {
+                continue;  // Closed earlier in this batch
+            }
+            if (upload->queued) {
+                // Waiting for its turn, so only errors are reported
+                if (events[e].events & (EPOLLERR | EPOLLHUP)) {
+                    upload_release(&server, slot);
+                }
+            } else if (upload->header_len == 0) {
+                int result = upload_read_request(upload);
+                if (result < 0) {
+                    upload_release(&server, slot);
+                } else if (result == 1) {
+                    upload_respond(&server, slot, 1);
+                } else if (upload->request_due > 0 &&
+                           (server.request_due == 0 || upload->request_due < server.request_due)) {
+                    server.request_due = upload->request_due;
+                }
+            } else {
+                upload_queue(&server, slot);  // Writable again
+            }
+        }
+        if (server.request_due > 0 && monotonic_ms() >= server.request_due) {
+            server.request_due = upload_expire_requests(&server, monotonic_ms());
+        }
+        upload_schedule(&server, quantum);
+
+        // Drop uploads whose peer stopped reading or never sent a request;
+        // those waiting for their turn are held up by us, not the peer
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            last_sweep = now;
+            for (int i = 0; i < max_uploads; i++) {
+                if (uploads[i].queued || uploads[i].compressing) {
+                    uploads[i].last_progress = now;
+                } else if (uploads[i].sock >= 0 && now - uploads[i].last_progress > UPLOAD_IDLE_SEC) {
+                    upload_release(&server, i);
+                }
+            }
+        }
+        if (!accepting && server.free_count > 0 &&
+            (accept_retry_ms == 0 || server.free_count > accept_free_count || monotonic_ms() >= accept_retry_ms)) {
+            epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server_sock, &listen_event);
+            accepting = 1;
+            accept_retry_ms = 0;
+        }
+    }
+    pthread_mutex_lock(&server.compress_mutex);
+    server.compress_stop = 1;
+    pthread_cond_broadcast(&server.compress_ready);
+    pthread_mutex_unlock(&server.compress_mutex);
+    for (int i = 0; i < compress_started; i++) {
+        pthread_join(compress_threads[i], NULL);
+    }
+    close(server.epoll_fd);
+    close(server.compress_event);
+    free(uploads);
+    free(server.free_slots);
+    free(server.active);
+    free(server.compress_jobs);
+    free(server.compressed);
+    return NULL;
+}
+
+// Function to connect to an owner's upload port. An idle connection to the
+// owner is taken from the pool if the owner has not closed it meanwhile.
+// Returns the socket, or -1 on error.
+int peer_connect(const OwnerInfo* owner) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = pool_count - 1; i >= 0; i--) {
+        PooledConnection* pooled = &connection_pool[i];
+        int expired = now - pooled->idle_since > POOL_IDLE_SEC;
+        if (!expired && (pooled->tcp_port != owner->tcp_port || strcmp(pooled->ip, owner->ip) != 0)) {
+            continue;
+        }
+        int sock = pooled->sock;
+        *pooled = connection_pool[--pool_count];
+        char byte;
+        if (!expired && recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+            pthread_mutex_unlock(&pool_mutex);
+            return sock;
+        }
+        close(sock);  // Expired, or closed by the owner
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct timeval timeout = { TRANSFER_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int nodelay = 1;  // Pipelined requests must not wait for the ACK of the one before
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct sockaddr_in owner_addr;
+    memset(&owner_addr, 0, sizeof(owner_addr));
+    owner_addr.sin_family = AF_INET;
+    owner_addr.sin_port = htons(owner->tcp_port);
+    inet_pton(AF_INET, owner->ip, &owner_addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&owner_addr, sizeof(owner_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to give back a connection once its last reply has been read. It
+// goes into the pool if the owner keeps it open, replacing the oldest idle
+// connection when the pool is full; otherwise it is closed.
+void peer_release(const OwnerInfo* owner, int sock, int keep_alive) {
+    if (!keep_alive) {
+        close(sock);
+        return;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    PooledConnection* slot = &connection_pool[pool_count];
+    if (pool_count == POOL_CONNECTIONS) {
+        slot = &connection_pool[0];
+        for (int i = 1; i < pool_count; i++) {
+            if (connection_pool[i].idle_since < slot->idle_since) {
+                slot = &connection_pool[i];
+            }
+        }
+        close(slot->sock);
+    } else {
+        pool_count++;
+    }
+    snprintf(slot->ip, sizeof(slot->ip), "%s", owner->ip);
+    slot->tcp_port = owner->tcp_port;
+    slot->sock = sock;
+    slot->idle_since = time(NULL);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Function to send a range request. It always asks the owner to keep the
+// connection open ("k"), and for compression ("z") if downloads are compressed.
+int send_transfer_request(int sock, const char* name, long long offset, long long length) {
+    char request[BUFFER_SIZE];
+    int request_len = snprintf(request, sizeof(request), "get %s %lld %lld k%s\n", name, offset, length,
+                               download_compressed ? "z" : "");
+    return send(sock, request, request_len, MSG_NOSIGNAL) == request_len ? 0 : -1;
+}
+
+// Function to read the header of the reply to a range request. The range must
+// start at offset and be no longer than *length. On success *size is set to
+// the size of the whole file, *length to the bytes of the range, and *framed
+// and *keep_alive to what the owner agreed to. Returns -1 on error.
+int read_transfer_reply(int sock, long long offset, long long* length, long long* size, int* framed,
+                        int* keep_alive) {
+    char header[TRANSFER_HEADER_SIZE], flags[8] = "";
+    long long served_offset, served_length;
+    if (read_transfer_header(sock, header, sizeof(header)) < 0 ||
+        sscanf(header, "OK %lld %lld %lld %7s", size, &served_offset, &served_length, flags) < 3 ||
+        served_offset != offset || served_length < 0 || served_length > *length) {
+        return -1;
+    }
+    *length = served_length;
+    *framed = strchr(flags, 'z') != NULL;
+    *keep_alive = strchr(flags, 'k') != NULL;
+    return 0;
+}
+
+// Function to ask an owner for the size of a file with an empty range.
+// Returns -1 if the owner does not serve it.
+int probe_size(const OwnerInfo* owner, const char* name, long long* size) {
+    long long length = 0;
+    int framed, keep_alive;
+    int sock = peer_connect(owner);
+    if (sock < 0) {
+        return -1;
+    }
+    if (send_transfer_request(sock, name, 0, 0) < 0 ||
+        read_transfer_reply(sock, 0, &length, size, &framed, &keep_alive) < 0) {
+        close(sock);
+        return -1;
+    }
+    peer_release(owner, sock, keep_alive);
+    return 0;
+}
+
+// Function to receive exactly len bytes. Returns -1 if the connection failed.
+int recv_all(int sock, void* buffer, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (char*)buffer + received, len - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// Function to receive a range sent as blocks (see upload_next_block) and write
+// it into place, decompressing in the calling stream's thread. The bytes
+// received are added to *wire. Returns -1 if the owner failed or sent a
+// malformed block.
+int receive_blocks(Swarm* swarm, int sock, long long offset, long long length, long long* wire) {
+    uLong bound = compressBound(COMPRESS_BLOCK);
+    uint8_t* stored = malloc(bound);
+    uint8_t* raw = malloc(COMPRESS_BLOCK);
+    int result = stored != NULL && raw != NULL ? 0 : -1;
+    long long received = 0;
+    while (result == 0 && received < length) {
+        uint32_t fields[2];
+        if (recv_all(sock, fields, sizeof(fields)) < 0) {
+            result = -1;
+            break;
+        }
+        uint32_t raw_len = ntohl(fields[0]), stored_len = ntohl(fields[1]);
+        if (raw_len == 0 || raw_len > COMPRESS_BLOCK || raw_len > length - received || stored_len > raw_len ||
+            recv_all(sock, stored_len == raw_len ? raw : stored, stored_len) < 0) {
+            result = -1;
+            break;
+        }
+        uLongf raw_out = raw_len;
+        if (stored_len < raw_len &&
+            (uncompress(raw, &raw_out, stored, stored_len) != Z_OK || raw_out != raw_len)) {
+            result = -1;
+            break;
+        }
+        if (pwrite(swarm->fd, raw, raw_len, offset + received) != raw_len) {
+            result = -1;
+            break;
+        }
+        *wire += 8 + stored_len;
+        received += raw_len;
+    }
+    free(stored);
+    free(raw);
+    return result;
+}
+
+// Function to receive the reply to a chunk request sent earlier on sock and
+// write the chunk into place. *wire is set to the bytes of chunk data
+// received and *keep_alive to whether the connection can carry further
+// requests. Returns 0 on success, -1 if the owner failed or sent a different
+// file, after which the connection must be closed.
+int receive_chunk(Swarm* swarm, int sock, int chunk, long long* wire, int* keep_alive) {
+    long long offset = (long long)chunk * CHUNK_SIZE;
+    long long length = swarm->size - offset < CHUNK_SIZE ? swarm->size - offset : CHUNK_SIZE;
+    long long expected = length, size;
+    int framed;
+    *wire = 0;
+    if (read_transfer_reply(sock, offset, &length, &size, &framed, keep_alive) < 0 || size != swarm->size ||
+        length != expected) {
+        return -1;
+    }
+    if (framed) {
+        return receive_blocks(swarm, sock, offset, length, wire);
+    }
+    char* buffer = malloc(DOWNLOAD_CHUNK);
+    long long received = 0;
+    while (buffer != NULL && received < length) {
+        size_t want = length - received < DOWNLOAD_CHUNK ? (size_t)(length - received) : DOWNLOAD_CHUNK;
+        ssize_t n = recv(sock, buffer, want, 0);
+        if (n <= 0 || pwrite(swarm->fd, buffer, n, offset + received) != n) {
+            break;
+        }
+        received += n;
+    }
+    free(buffer);
+    *wire = received;
+    return received == length ? 0 : -1;
+}
+
+// Function to pick the next chunk for a stream of an owner: a pending chunk if
+// there is one, otherwise, if wait is set, one that only a single stream is
+// fetching. With wait set it blocks while neither exists but chunks are still
+// in flight; without it, it returns at once. Called with the swarm mutex
+// held. Returns the chunk, or -1 if there is none for the stream.
+int next_chunk(Swarm* swarm, SwarmPeer* peer, int wait) {
+    while (!peer->dropped && swarm->chunks_done < swarm->chunk_count) {
+        int duplicate = -1;
+        for (int chunk = 0; chunk < swarm->chunk_count; chunk++) {
+            if (swarm->chunk_state[chunk] == CHUNK_PENDING) {
+                return chunk;
+            }
+            if (duplicate < 0 && swarm->chunk_state[chunk] == CHUNK_ACTIVE && swarm->chunk_fetchers[chunk] == 1) {
+                duplicate = chunk;
+            }
+        }
+        if (!wait) {
+            return -1;
+        }
+        if (duplicate >= 0) {
+            return duplicate;
+        }
+        pthread_cond_wait(&swarm->changed, &swarm->mutex);
+    }
+    return -1;
+}
+
+// Function to give up one fetch of a chunk; it becomes pending again unless
+// another stream is still fetching it. With failed set the fetch counts
+// against the owner. Called with the swarm mutex held.
+void release_chunk(Swarm* swarm, SwarmPeer* peer, int chunk, int failed) {
+    swarm->chunk_fetchers[chunk]--;
+    if (failed && ++peer->failures >= MAX_PEER_FAILURES && !peer->dropped) {
+        peer->dropped = 1;
+        printf("Dropping owner %s after %d failed chunks.\n", peer->info.owner, peer->failures);
+    }
+    if (swarm->chunk_state[chunk] == CHUNK_ACTIVE && swarm->chunk_fetchers[chunk] == 0) {
+        swarm->chunk_state[chunk] = CHUNK_PENDING;
+    }
+}
+
+// Function run by each stream of a swarm download. A stream keeps one
+// connection to its owner and, once the owner has shown that it keeps
+// connections open, queues up to PEER_PIPELINE chunk requests on it, so the
+// next chunk is already on its way while the current one is written out. An
+// idle stream only duplicates a chunk of another stream when its own queue is
+// empty.
+void* swarm_stream(void* arg) {
+    SwarmStream* stream = arg;
+    Swarm* swarm = stream->swarm;
+    SwarmPeer* peer = &swarm->peers[stream->peer];
+    int queue[PEER_PIPELINE];
+    int queued = 0, sock = -1, keep_alive = 0;
+    pthread_mutex_lock(&swarm->mutex);
+    while (1) {
+        while (queued < (keep_alive ? PEER_PIPELINE : 1)) {
+            int chunk = next_chunk(swarm, peer, queued == 0);
+            if (chunk < 0) {
+                break;
+            }
+            swarm->chunk_state[chunk] = CHUNK_ACTIVE;
+            swarm->chunk_fetchers[chunk]++;
+            queue[queued++] = chunk;
+            pthread_mutex_unlock(&swarm->mutex);
+            if (sock < 0) {
+                sock = peer_connect(&peer->info);
+            }
+            long long offset = (long long)chunk * CHUNK_SIZE;
+            long long length = swarm->size - offset < CHUNK_SIZE ? swarm->size - offset : CHUNK_SIZE;
+            int sent = sock >= 0 && send_transfer_request(sock, swarm->name, offset, length) == 0;
+            pthread_mutex_lock(&swarm->mutex);
+            if (!sent) {
+                // The queue is dropped with the connection; only the new request counts as failed
+                for (int i = 0; i < queued; i++) {
+                    release_chunk(swarm, peer, queue[i], i == queued - 1);
+                }
+                queued = 0;
+                if (sock >= 0) {
+                    close(sock);
+                }
+                sock = -1;
+                keep_alive = 0;
+                pthread_cond_broadcast(&swarm->changed);
+            }
+        }
+        if (queued == 0) {
+            break;
+        }
+
+        int chunk = queue[0];
+        pthread_mutex_unlock(&swarm->mutex);
+        long long wire;
+        int result = receive_chunk(swarm, sock, chunk, &wire, &keep_alive);
+        pthread_mutex_lock(&swarm->mutex);
+        queued--;
+        memmove(queue, queue + 1, queued * sizeof(int));
+        if (result == 0) {
+            swarm->chunk_fetchers[chunk]--;
+            peer->failures = 0;
+            if (swarm->chunk_state[chunk] != CHUNK_DONE) {
+                swarm->chunk_state[chunk] = CHUNK_DONE;
+                swarm->chunks_done++;
+                swarm->wire_bytes += wire;
+                record_chunk(swarm, chunk);
+                long long offset = (long long)chunk * CHUNK_SIZE;
+                peer->received += swarm->size - offset < CHUNK_SIZE ? swarm->size - offset : CHUNK_SIZE;
+            }
+        } else {
+            // Hand the chunk back so another owner picks it up
+            release_chunk(swarm, peer, chunk, 1);
+        }
+        if (result < 0 || !keep_alive) {
+            // The connection ends here; requests queued behind it were never answered
+            for (int i = 0; i < queued; i++) {
+                release_chunk(swarm, peer, queue[i], 0);
+            }
+            queued = 0;
+            close(sock);
+            sock = -1;
+            keep_alive = 0;
+        }
+        pthread_cond_broadcast(&swarm->changed);
+    }
+    pthread_mutex_unlock(&swarm->mutex);
+    if (sock >= 0) {
+        peer_release(&peer->info, sock, keep_alive);
+    }
+    return NULL;
+}
+
+// Function to pick up an earlier attempt at a download from its .chunks file.
+// The file holds a line "<size> <chunk_size> <content hash>" and then one byte
+// per chunk, '1' once the chunk is in the .part file. Marks the chunks already
+// done and returns their count, or -1 if there is no record for this content
+// and chunk size.
+int load_progress(Swarm* swarm, const char* progress_path) {
+    int fd = open(progress_path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    char header[TRANSFER_HEADER_SIZE];
+    ssize_t header_len = pread(fd, header, sizeof(header) - 1, 0);
+    char* end = header_len > 0 ? memchr(header, '\n', header_len) : NULL;
+    long long size, chunk_size;
+    unsigned long long hash = 0;
+    if (end == NULL || sscanf(header, "%lld %lld %llx", &size, &chunk_size, &hash) < 2 || size != swarm->size ||
+        chunk_size != CHUNK_SIZE || hash != swarm->hash) {
+        close(fd);
+        return -1;
+    }
+    swarm->progress_header = end - header + 1;
+    if (pread(fd, swarm->chunk_state, swarm->chunk_count, swarm->progress_header) != swarm->chunk_count) {
+        close(fd);
+        return -1;
+    }
+    int done = 0;
+    for (int chunk = 0; chunk < swarm->chunk_count; chunk++) {
+        swarm->chunk_state[chunk] = swarm->chunk_state[chunk] == '1' ? CHUNK_DONE : CHUNK_PENDING;
+        done += swarm->chunk_state[chunk] == CHUNK_DONE;
+    }
+    swarm->progress_fd = fd;
+    return done;
+}
+
+// Function to create the .chunks file of a new download. Returns -1 on error.
+int start_progress(Swarm* swarm, const char* progress_path) {
+    int fd = open(progress_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    char header[TRANSFER_HEADER_SIZE];
+    swarm->progress_header = snprintf(header, sizeof(header), "%lld %d %016llx\n", swarm->size, CHUNK_SIZE,
+                                      (unsigned long long)swarm->hash);
+    char* marks = malloc(swarm->chunk_count + 1);
+    int result = -1;
+    if (marks != NULL) {
+        memset(marks, '0', swarm->chunk_count);
+        if (write(fd, header, swarm->progress_header) == (ssize_t)swarm->progress_header &&
+            write(fd, marks, swarm->chunk_count) == swarm->chunk_count) {
+            result = 0;
+        }
+        free(marks);
+    }
+    if (result < 0) {
+        close(fd);
+        return -1;
+    }
+    memset(swarm->chunk_state, CHUNK_PENDING, swarm->chunk_count);
+    swarm->progress_fd = fd;
+    return 0;
+}
+
+// Function to mark a chunk as done in the .chunks file, once its data is written
+void record_chunk(Swarm* swarm, int chunk) {
+    char mark = '1';
+    if (pwrite(swarm->progress_fd, &mark, 1, swarm->progress_header + chunk) != 1) {
+        perror("Failed to record download progress");
+    }
+}
 
-    // Wait for acknowledgment
-    pthread_mutex_lock(&mutex);
-    while (!response_ready) {
-        pthread_cond_wait(&cond, &mutex);
+// Function to pick the owners of a download whose content is unknown: every
+// owner is asked for the size, and those that agree with the most others are
+// added to the swarm. Returns -1 if no owner answered.
+int vote_on_size(Swarm* swarm, OwnerInfo* owners, int owner_count) {
+    long long* sizes = calloc(owner_count, sizeof(long long));
+    if (sizes == NULL) {
+        return -1;
+    }
+    int best = -1, best_votes = 0;
+    for (int i = 0; i < owner_count; i++) {
+        if (probe_size(&owners[i], swarm->name, &sizes[i]) < 0) {
+            printf("Owner %s is not serving '%s'.\n", owners[i].owner, swarm->name);
+            sizes[i] = -1;
+            continue;
+        }
+        int votes = 0;
+        for (int j = 0; j <= i; j++) {
+            votes += sizes[j] == sizes[i];
+        }
+        if (votes > best_votes) {
+            best = i;
+            best_votes = votes;
+        }
     }
-    response_ready = 0;
-    pthread_mutex_unlock(&mutex);
+    if (best >= 0) {
+        swarm->size = sizes[best];
+        for (int i = 0; i < owner_count; i++) {
+            if (sizes[i] == swarm->size) {
+                swarm->peers[swarm->peer_count++].info = owners[i];
+            } else if (sizes[i] >= 0) {
+                printf("Skipping owner %s, whose copy differs.\n", owners[i].owner);
+            }
+        }
+    }
+    free(sizes);
+    return best < 0 ? -1 : 0;
+}
 
-    if (strcmp(response_buffer, "Registration successful") == 0) {
-        printf("Registered with server as %s.\n", username);
-    } else {
-        printf("Registration failed.\n");
-        running = 0;
+// Function to check a finished download against the content hash its owners
+// announced. A file that does not match is deleted with its .chunks record,
+// since there is no telling which chunks are wrong. Returns -1 on mismatch.
+int verify_download(Swarm* swarm, const char* part_path) {
+    uint64_t hash, size;
+    if (hash_file(part_path, &hash, &size) == 0 && hash == swarm->hash && (long long)size == swarm->size) {
+        return 0;
     }
+    printf("Download of '%s' does not match the announced content; discarding it.\n", swarm->name);
+    unlink(part_path);
+    return -1;
 }
 
-void announce_resource(int sock, struct sockaddr_in server_addr, const char* resource_name, const char* username) {
-    char message[BUFFER_SIZE];
-    snprintf(message, BUFFER_SIZE, "announce %s %s", resource_name, username);
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+// Function to order store records by hash
+int compare_store_entries(const void* a, const void* b) {
+    uint64_t left = ((const StoreEntry*)a)->hash, right = ((const StoreEntry*)b)->hash;
+    return left < right ? -1 : left > right;
+}
 
-    // Wait for acknowledgment
-    pthread_mutex_lock(&mutex);
-    while (!response_ready) {
-        pthread_cond_wait(&cond, &mutex);
-    }
-    response_ready = 0;
-    pthread_mutex_unlock(&mutex);
+// Function to order positions in store_entries by hash, then by position
+int compare_store_records(const void* a, const void* b) {
+    int left = *(const int*)a, right = *(const int*)b;
+    int order = compare_store_entries(&store_entries[left], &store_entries[right]);
+    return order != 0 ? order : left - right;
+}
 
-    if (strcmp(response_buffer, "Resource announced successfully") == 0) {
-        printf("Announced resource: %s\n", resource_name);
-    } else {
-        printf("Failed to announce resource.\n");
+// Function to load the index of the download store. The index is a file of
+// fixed-size StoreEntry records, appended to as downloads finish. When a hash
+// appears more than once the last record wins, and the index is rewritten
+// without the older ones.
+void store_open() {
+    char path[MAX_PATH_LENGTH + 16], tmp_path[MAX_PATH_LENGTH + 32];
+    if (mkdir(store_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create download store");
+        return;
     }
-}
+    snprintf(path, sizeof(path), "%s/index", store_dir);
+    int fd = open(path, O_RDONLY);
+    struct stat index_stat;
+    if (fd < 0 || fstat(fd, &index_stat) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    int records = index_stat.st_size / sizeof(StoreEntry);
+    store_entries = malloc((records + 1) * sizeof(StoreEntry));
+    ssize_t bytes_read = store_entries != NULL ? read(fd, store_entries, records * sizeof(StoreEntry)) : -1;
+    close(fd);
+    if (bytes_read < 0) {
+        free(store_entries);
+        store_entries = NULL;
+        return;
+    }
+    records = bytes_read / sizeof(StoreEntry);
 
-void announce_resources(int sock, struct sockaddr_in server_addr, const char* username, const char* sharing_folder) {
-    DIR* dir = opendir(sharing_folder);
-    if (dir == NULL) {
-        perror("Failed to open sharing folder");
+    // Sort record positions by hash and then by position, so the last record
+    // of each hash comes last among its duplicates
+    int* order = malloc((records + 1) * sizeof(int));
+    StoreEntry* sorted = malloc((records + 1) * sizeof(StoreEntry));
+    if (order == NULL || sorted == NULL) {
+        free(order);
+        free(sorted);
+        free(store_entries);
+        store_entries = NULL;
         return;
     }
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            // Announce resource
-            announce_resource(sock, server_addr, entry->d_name, username);
+    for (int i = 0; i < records; i++) {
+        order[i] = i;
+    }
+    qsort(order, records, sizeof(int), compare_store_records);
+    for (int i = 0; i < records; i++) {
+        if (store_count > 0 && sorted[store_count - 1].hash == store_entries[order[i]].hash) {
+            store_count--;
+        }
+        sorted[store_count++] = store_entries[order[i]];
+    }
+    free(order);
+    free(store_entries);
+    store_entries = sorted;
+    store_capacity = records + 1;
+    if (store_count < records) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && write(fd, store_entries, store_count * sizeof(StoreEntry)) ==
+            (ssize_t)(store_count * sizeof(StoreEntry)) && close(fd) == 0) {
+            rename(tmp_path, path);
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+            unlink(tmp_path);
         }
     }
-    closedir(dir);
 }
 
-void query_resources(int sock, struct sockaddr_in server_addr) {
-    char message[BUFFER_SIZE] = "query resources";
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+// Function to check that a store object is still the file it was when it was
+// recorded, and to format its path. Returns -1 if it is gone or was modified.
+int store_valid(const StoreEntry* entry, char* path, size_t path_size) {
+    struct stat object_stat;
+    snprintf(path, path_size, "%s/%016llx", store_dir, (unsigned long long)entry->hash);
+    return stat(path, &object_stat) == 0 && (uint64_t)object_stat.st_size == entry->size &&
+           object_stat.st_ino == entry->inode && object_stat.st_mtim.tv_sec == entry->mtime_sec &&
+           object_stat.st_mtim.tv_nsec == entry->mtime_nsec ? 0 : -1;
+}
 
-    // Wait for response
-    pthread_mutex_lock(&mutex);
-    while (!response_ready) {
-        pthread_cond_wait(&cond, &mutex);
+// Function to find a local file with the given content: an earlier download
+// in the store, or a file of the sharing folder. Returns 0 with its path in
+// path, or -1 if there is none.
+int find_local_copy(uint64_t hash, uint64_t size, char* path, size_t path_size) {
+    StoreEntry key = { .hash = hash };
+    pthread_mutex_lock(&store_mutex);
+    StoreEntry* entry = store_count > 0 ?
+        bsearch(&key, store_entries, store_count, sizeof(StoreEntry), compare_store_entries) : NULL;
+    int found = entry != NULL && entry->size == size && store_valid(entry, path, path_size) == 0;
+    pthread_mutex_unlock(&store_mutex);
+    if (found) {
+        return 0;
     }
-    response_ready = 0;
-    pthread_mutex_unlock(&mutex);
 
-    printf("%s\n", response_buffer);
+    HashCacheEntry* cache;
+    int cache_count = load_hash_cache(sharing_folder, &cache);
+    for (int i = 0; i < cache_count && !found; i++) {
+        HashCacheEntry current;
+        // describe_file only hashes again if the file changed since it was cached
+        if (cache[i].file.hash == hash && cache[i].file.size == size &&
+            describe_file(sharing_folder, cache[i].file.name, cache, cache_count, &current) >= 0 &&
+            current.file.hash == hash) {
+            snprintf(path, path_size, "%s/%s", sharing_folder, cache[i].file.name);
+            found = 1;
+        }
+    }
+    free(cache);
+    return found ? 0 : -1;
 }
 
-void query_users(int sock, struct sockaddr_in server_addr) {
-    char message[BUFFER_SIZE] = "query users";
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-
-    // Wait for response
-    pthread_mutex_lock(&mutex);
-    while (!response_ready) {
-        pthread_cond_wait(&cond, &mutex);
+// Function to make target a copy of source without sending it over the
+// network: a hard link if both are on one filesystem, otherwise a reflink
+// where the filesystem supports it, otherwise a copy inside the kernel.
+// Returns -1 on failure.
+int clone_file(const char* source, const char* target) {
+    unlink(target);
+    if (link(source, target) == 0) {
+        return 0;
+    }
+    int in = open(source, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
     }
-    response_ready = 0;
-    pthread_mutex_unlock(&mutex);
+    int result = 0;
+    if (ioctl(out, FICLONE, in) < 0) {
+        ssize_t copied;
+        while ((copied = copy_file_range(in, NULL, out, NULL, UPLOAD_SLICE, 0)) > 0) {
+        }
+        result = copied < 0 ? -1 : 0;
+    }
+    close(in);
+    if (close(out) < 0 || result < 0) {
+        unlink(target);
+        return -1;
+    }
+    return 0;
+}
 
-    printf("%s\n", response_buffer);
+// Function to add a finished, verified download to the store as a hard link.
+// Nothing is stored if the store is on another filesystem, since a copy would
+// double the disk space.
+void store_add(const char* path, uint64_t hash, uint64_t size) {
+    char object_path[MAX_PATH_LENGTH + 32], index_path[MAX_PATH_LENGTH + 16];
+    StoreEntry entry = { .hash = hash, .size = size };
+    pthread_mutex_lock(&store_mutex);
+    StoreEntry* existing = store_count > 0 ?
+        bsearch(&entry, store_entries, store_count, sizeof(StoreEntry), compare_store_entries) : NULL;
+    if (existing != NULL && store_valid(existing, object_path, sizeof(object_path)) == 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+    snprintf(object_path, sizeof(object_path), "%s/%016llx", store_dir, (unsigned long long)hash);
+    snprintf(index_path, sizeof(index_path), "%s/index", store_dir);
+    unlink(object_path);
+    struct stat object_stat;
+    if (link(path, object_path) < 0 || stat(object_path, &object_stat) < 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+    entry.inode = object_stat.st_ino;
+    entry.mtime_sec = object_stat.st_mtim.tv_sec;
+    entry.mtime_nsec = object_stat.st_mtim.tv_nsec;
+    int fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || write(fd, &entry, sizeof(entry)) != sizeof(entry)) {
+        perror("Failed to update the download store");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (existing != NULL) {
+        *existing = entry;
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+    if (store_count == store_capacity) {
+        // Without memory the object is only found after a restart, from the index file
+        int new_capacity = store_capacity ? store_capacity * 2 : 64;
+        StoreEntry* grown = realloc(store_entries, new_capacity * sizeof(StoreEntry));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&store_mutex);
+            return;
+        }
+        store_entries = grown;
+        store_capacity = new_capacity;
+    }
+    int i = store_count++;
+    for (; i > 0 && store_entries[i - 1].hash > hash; i--) {
+        store_entries[i] = store_entries[i - 1];
+    }
+    store_entries[i] = entry;
+    pthread_mutex_unlock(&store_mutex);
 }
 
-void respond_to_hello(int sock, struct sockaddr_in server_addr) {
-    char message[] = "hello response";
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+// Function to add a finished download to the sharing folder under its
+// resource name and announce it, so later downloaders can fetch it from here.
+// The name comes from another peer, so it must stay inside the folder; the
+// subdirectories it names are created as needed.
+void share_download(int sock, const char* username, const char* name, const char* filepath) {
+    if (!is_shared_path(name)) {
+        printf("Not sharing '%s': the name leads outside the sharing folder.\n", name);
+        return;
+    }
+    char shared_path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
+    snprintf(shared_path, sizeof(shared_path), "%s/%s", sharing_folder, name);
+    size_t folder_len = strlen(sharing_folder);
+    for (char* slash = strchr(shared_path + folder_len + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int result = mkdir(shared_path, 0755);
+        *slash = '/';
+        if (result < 0 && errno != EEXIST) {
+            perror("Failed to create a directory in the sharing folder");
+            return;
+        }
+    }
+    if (access(shared_path, F_OK) == 0) {
+        printf("Not sharing '%s': the sharing folder already has a file of that name.\n", name);
+        return;
+    }
+    if (clone_file(filepath, shared_path) < 0) {
+        perror("Failed to add the download to the sharing folder");
+        return;
+    }
+    announce_resource(sock, name, username);
 }
 
-void* listener_thread(void* arg) {
-    int sock = *(int*)arg;
-    char message[BUFFER_SIZE];
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    while (running) {
-        int bytes_received = recvfrom(sock, message, BUFFER_SIZE, 0, (struct sockaddr*)&from_addr, &from_len);
-        if (bytes_received > 0) {
-            message[bytes_received] = '\0';
-            if (strcmp(message, "hello") == 0) {
-                respond_to_hello(sock, from_addr);
-            } else {
-                pthread_mutex_lock(&mutex);
-                strcpy(response_buffer, message);
-                response_ready = 1;
-                pthread_cond_signal(&cond);
-                pthread_mutex_unlock(&mutex);
+// Function to download a file from one or more owners into filepath, in
+// CHUNK_SIZE ranges written with pwrite into a preallocated file. The owners
+// are expected to hold the same content (see select_content); if it is known,
+// the finished file is checked against its hash, and otherwise owners whose
+// copy has a different size than most of the others are left out.
+// Until it is complete the file is kept as <filepath>.part, next to a
+// <filepath>.chunks record of the chunks it holds, and a later download of
+// the same file resumes from there.
+// Returns 0 on success, -1 if the file could not be downloaded completely.
+int swarm_download(const char* name, OwnerInfo* owners, int owner_count, const char* filepath) {
+    if (owner_count > MAX_SWARM_PEERS) {
+        owner_count = MAX_SWARM_PEERS;
+    }
+    char source[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
+    if (owners[0].hash != 0 && find_local_copy(owners[0].hash, owners[0].size, source, sizeof(source)) == 0 &&
+        clone_file(source, filepath) == 0) {
+        printf("The content of '%s' is already here as %s; no download needed.\n", name, source);
+        return 0;
+    }
+    Swarm swarm;
+    memset(&swarm, 0, sizeof(swarm));
+    swarm.name = name;
+    swarm.hash = owners[0].hash;
+    swarm.peers = calloc(owner_count, sizeof(SwarmPeer));
+    if (swarm.peers == NULL) {
+        perror("Failed to allocate download");
+        return -1;
+    }
+    if (swarm.hash != 0) {
+        // The directory already told us what the owners hold
+        swarm.size = owners[0].size;
+        for (int i = 0; i < owner_count; i++) {
+            swarm.peers[swarm.peer_count++].info = owners[i];
+        }
+    } else if (vote_on_size(&swarm, owners, owner_count) < 0) {
+        free(swarm.peers);
+        return -1;
+    }
+
+    swarm.chunk_count = (swarm.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    swarm.chunk_state = calloc(swarm.chunk_count + 1, 1);
+    swarm.chunk_fetchers = calloc(swarm.chunk_count + 1, 1);
+    int stream_count = swarm.peer_count * PEER_STREAMS;
+    SwarmStream* streams = calloc(stream_count, sizeof(SwarmStream));
+    pthread_t* threads = calloc(stream_count, sizeof(pthread_t));
+    char part_path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + 8], progress_path[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH + 8];
+    snprintf(part_path, sizeof(part_path), "%s.part", filepath);
+    snprintf(progress_path, sizeof(progress_path), "%s.chunks", filepath);
+    swarm.fd = -1;
+    swarm.progress_fd = -1;
+    if (swarm.chunk_state != NULL) {
+        swarm.chunks_done = load_progress(&swarm, progress_path);
+        if (swarm.chunks_done >= 0) {
+            swarm.fd = open(part_path, O_RDWR);
+        }
+        if (swarm.fd >= 0) {
+            printf("Resuming '%s' with %d of %d chunks already downloaded.\n", name, swarm.chunks_done,
+                   swarm.chunk_count);
+        } else {
+            if (swarm.progress_fd >= 0) {
+                close(swarm.progress_fd);
+                swarm.progress_fd = -1;
+            }
+            swarm.chunks_done = 0;
+            swarm.fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (swarm.fd >= 0 && start_progress(&swarm, progress_path) < 0) {
+                close(swarm.fd);
+                swarm.fd = -1;
             }
         }
     }
-    return NULL;
+    if (swarm.chunk_state == NULL || swarm.chunk_fetchers == NULL || streams == NULL || threads == NULL ||
+        swarm.fd < 0) {
+        perror("Failed to open file for writing");
+        if (swarm.fd >= 0) {
+            close(swarm.fd);
+        }
+        if (swarm.progress_fd >= 0) {
+            close(swarm.progress_fd);
+        }
+        free(swarm.chunk_state);
+        free(swarm.chunk_fetchers);
+        free(streams);
+        free(threads);
+        free(swarm.peers);
+        return -1;
+    }
+    // Reserve the space up front so chunks written out of order don't fragment the file
+    if (swarm.size > 0 && posix_fallocate(swarm.fd, 0, swarm.size) != 0 && ftruncate(swarm.fd, swarm.size) < 0) {
+        perror("Failed to allocate file");
+    }
+
+    printf("Downloading %lld bytes of '%s' from %d owner(s)...\n", swarm.size, name, swarm.peer_count);
+    pthread_mutex_init(&swarm.mutex, NULL);
+    pthread_cond_init(&swarm.changed, NULL);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (int i = 0; i < stream_count; i++) {
+        streams[i].swarm = &swarm;
+        streams[i].peer = i % swarm.peer_count;
+        if (pthread_create(&threads[started], NULL, swarm_stream, &streams[i]) == 0) {
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    int complete = swarm.chunks_done == swarm.chunk_count, corrupt = 0;
+    close(swarm.progress_fd);
+    if (complete && swarm.hash != 0 && verify_download(&swarm, part_path) < 0) {
+        unlink(progress_path);
+        complete = 0;
+        corrupt = 1;
+    }
+    if (complete && rename(part_path, filepath) < 0) {
+        perror("Failed to rename the downloaded file");
+        complete = 0;
+    } else if (complete) {
+        unlink(progress_path);
+        if (swarm.hash != 0) {
+            store_add(filepath, swarm.hash, swarm.size);
+        }
+    }
+    if (complete) {
+        long long received = 0;
+        for (int i = 0; i < swarm.peer_count; i++) {
+            printf("  %s sent %lld bytes\n", swarm.peers[i].info.owner, swarm.peers[i].received);
+            received += swarm.peers[i].received;
+        }
+        printf("Received %lld bytes in %.2f s (%.1f MB/s).\n", received, seconds,
+               seconds > 0 ? received / seconds / 1e6 : 0.0);
+        if (download_compressed) {
+            printf("%lld bytes of file data crossed the network.\n", swarm.wire_bytes);
+        }
+    } else if (!corrupt) {
+        printf("Download of '%s' stopped with %d of %d chunks. Download it again to resume.\n", name,
+               swarm.chunks_done, swarm.chunk_count);
+    }
+    pthread_mutex_destroy(&swarm.mutex);
+    pthread_cond_destroy(&swarm.changed);
+    close(swarm.fd);
+    free(swarm.chunk_state);
+    free(swarm.chunk_fetchers);
+    free(streams);
+    free(threads);
+    free(swarm.peers);
+    return complete ? 0 : -1;
 }
 
-void* handle_tcp_client(void* arg) {
-    int client_sock = *(int*)arg;
-    free(arg);
-    char buffer[BUFFER_SIZE];
-    int bytes_received = recv(client_sock, buffer, BUFFER_SIZE, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        // Assume the request is "get filename"
-        if (strncmp(buffer, "get ", 4) == 0) {
-            char filename[MAX_FILENAME_LENGTH];
-            sscanf(buffer, "get %255s", filename);
-            // Send the file
-            char filepath[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
-            snprintf(filepath, sizeof(filepath), "%s/%s", sharing_folder, filename);
-            FILE* fp = fopen(filepath, "rb");
-            if (fp != NULL) {
-                // Send the file contents
-                char file_buffer[BUFFER_SIZE];
-                int bytes_read;
-                while ((bytes_read = fread(file_buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                    send(client_sock, file_buffer, bytes_read, 0);
-                }
-                fclose(fp);
-            } else {
-                // File not found
-                char error_message[] = "Error: File not found.\n";
-                send(client_sock, error_message, strlen(error_message), 0);
+// Function to move the owners holding the same content as owners[pick] to the
+// front of the list, or those of the content most owners hold if pick is -1.
+// The directory lists owners of the same content next to each other. Returns
+// the number of owners moved; owners[0] is the picked one.
+int select_content(OwnerInfo* owners, int owner_count, int pick) {
+    if (pick < 0) {
+        int best_run = 0;
+        for (int start = 0, end; start < owner_count; start = end) {
+            for (end = start + 1; end < owner_count && owners[end].size == owners[start].size &&
+                 owners[end].hash == owners[start].hash; end++) {
+            }
+            if (end - start > best_run) {
+                best_run = end - start;
+                pick = start;
             }
         }
     }
-    close(client_sock);
-    return NULL;
+    OwnerInfo chosen = owners[pick];
+    owners[pick] = owners[0];
+    owners[0] = chosen;
+    int count = 1;
+    for (int i = 1; i < owner_count; i++) {
+        if (owners[i].size == chosen.size && owners[i].hash == chosen.hash) {
+            OwnerInfo same = owners[i];
+            owners[i] = owners[count];
+            owners[count++] = same;
+        }
+    }
+    return count;
 }
 
-void* tcp_server_thread(void* arg) {
-    int server_sock = *(int*)arg;
-    while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock >= 0) {
-            // Handle the connection in a separate thread
-            pthread_t client_thread;
-            int* client_sock_ptr = malloc(sizeof(int));
-            *client_sock_ptr = client_sock;
-            pthread_create(&client_thread, NULL, handle_tcp_client, client_sock_ptr);
-            pthread_detach(client_thread);
+// Function to add the owner rows of an OP_RESOURCE_INFO page to a growing
+// list. Returns -1 if out of memory.
+int read_owner_rows(ProtoReader* reader, int rows, OwnerInfo** owners, int* owner_count) {
+    OwnerInfo* grown = realloc(*owners, (*owner_count + rows + 1) * sizeof(OwnerInfo));
+    if (grown == NULL) {
+        return -1;
+    }
+    *owners = grown;
+    for (int i = 0; i < rows; i++) {
+        OwnerInfo* info = &grown[*owner_count];
+        proto_get_str(reader, info->owner, sizeof(info->owner));
+        format_ip(proto_get_u32(reader), info->ip);
+        info->tcp_port = proto_get_u16(reader);
+        info->size = proto_get_u64(reader);
+        info->hash = proto_get_u64(reader);
+        if (reader->error) {
+            break;
         }
+        (*owner_count)++;
     }
-    return NULL;
+    return 0;
 }
 
-void download_resource(int sock, struct sockaddr_in server_addr) {
+// Function to turn a resource name from a subdirectory of its owner's sharing
+// folder into a plain file name, so downloads all land in the current directory
+void flatten_name(char* name) {
+    for (char* slash = strchr(name, '/'); slash != NULL; slash = strchr(slash, '/')) {
+        *slash = '_';
+    }
+}
+
+void download_resource(int sock, const char* username) {
     // Query resources first
-    query_resources(sock, server_addr);
+    query_resources(sock);
 
     // Ask the user to enter the resource name
     char resource_name[MAX_FILENAME_LENGTH];
@@ -211,103 +3305,422 @@ void download_resource(int sock, struct sockaddr_in server_addr) {
     fgets(resource_name, sizeof(resource_name), stdin);
     resource_name[strcspn(resource_name, "\n")] = '\0';
 
-    // Request owner info from the server
-    char message[BUFFER_SIZE];
-    snprintf(message, BUFFER_SIZE, "get resource_info %s", resource_name);
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-
-    // Wait for response
-    pthread_mutex_lock(&mutex);
-    while (!response_ready) {
-        pthread_cond_wait(&cond, &mutex);
-    }
-    response_ready = 0;
-    char resource_info[BUFFER_SIZE];
-    strcpy(resource_info, response_buffer);
-    pthread_mutex_unlock(&mutex);
-
-    if (strncmp(resource_info, "Error", 5) == 0) {
-        printf("%s\n", resource_info);
-        return;
-    }
-
-    // Parse the list of owners
-    char* lines[10];
-    int owner_count = 0;
-    char* line = strtok(resource_info, "\n");
-    while (line != NULL && owner_count < 10) {
-        lines[owner_count++] = line;
-        line = strtok(NULL, "\n");
-    }
+    // Request owner info from the server, one page at a time
+    uint8_t reply[BUFFER_SIZE];
+    ProtoReader reader;
+    OwnerInfo* owners = NULL;
+    int owner_count = 0, cursor = 0, rows;
+    do {
+        cursor = request_page(sock, shard_addr(resource_name), OP_RESOURCE_INFO, resource_name, cursor, reply, &reader, &rows);
+        if (cursor == -2) {
+            free(owners);
+            return;
+        }
+        if (read_owner_rows(&reader, rows, &owners, &owner_count) < 0) {
+            perror("Failed to allocate owner list");
+            free(owners);
+            return;
+        }
+    } while (cursor >= 0);
 
     if (owner_count == 0) {
         printf("No active owners found for resource '%s'.\n", resource_name);
+        free(owners);
         return;
     }
 
     // Display the list of owners
     printf("Available owners for resource '%s':\n", resource_name);
     for (int i = 0; i < owner_count; i++) {
-        printf("%d. %s\n", i + 1, lines[i]);
+        printf("%d. %s %s %d", i + 1, owners[i].owner, owners[i].ip, owners[i].tcp_port);
+        if (owners[i].hash != 0) {
+            printf(" (%llu bytes, content %016llx)", (unsigned long long)owners[i].size,
+                   (unsigned long long)owners[i].hash);
+        }
+        printf("\n");
     }
 
-    // Ask the user to select an owner
+    // Ask the user to select an owner, or all of them
     int choice;
-    printf("Select an owner (1-%d): ", owner_count);
+    printf("Select an owner (1-%d, or 0 for all of them): ", owner_count);
     scanf("%d", &choice);
     getchar(); // consume newline
 
-    if (choice < 1 || choice > owner_count) {
+    if (choice < 0 || choice > owner_count) {
         printf("Invalid choice.\n");
+        free(owners);
         return;
     }
 
-    // Extract owner info
-    char owner[50], owner_ip[INET_ADDRSTRLEN];
-    int owner_tcp_port;
-    sscanf(lines[choice - 1], "%s %s %d", owner, owner_ip, &owner_tcp_port);
-
-    printf("Downloading resource '%s' from %s (%s:%d)\n", resource_name, owner, owner_ip, owner_tcp_port);
+    char filepath[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
+    int result;
+    if (choice == 0) {
+        int count = select_content(owners, owner_count, -1);
+        if (count < owner_count) {
+            printf("Using the %d owner(s) of the most common version; %d hold a different one.\n", count,
+                   owner_count - count);
+        }
+        snprintf(filepath, sizeof(filepath), "downloaded_%s", resource_name);
+        flatten_name(filepath);
+        result = swarm_download(resource_name, owners, count, filepath);
+    } else {
+        // Other owners of the same content serve it too; without a hash there is no telling who they are
+        int count = select_content(owners, owner_count, choice - 1);
+        OwnerInfo* owner = &owners[0];
+        if (owner->hash == 0) {
+            count = 1;
+        }
+        printf("Downloading resource '%s' from %s (%s:%d)", resource_name, owner->owner, owner->ip, owner->tcp_port);
+        if (count > 1) {
+            printf(" and %d other owner(s) of the same content", count - 1);
+        }
+        printf("\n");
+        snprintf(filepath, sizeof(filepath), "downloaded_%s_%s", owner->owner, resource_name);
+        flatten_name(filepath);
+        result = swarm_download(resource_name, owners, count, filepath);
+    }
+    free(owners);
+    if (result == 0) {
+        printf("Resource '%s' downloaded and saved as '%s'\n", resource_name, filepath);
+        if (share_downloads) {
+            share_download(sock, username, resource_name, filepath);
+        }
+    }
+}
 
-    // Connect to the owner's TCP server and request the file
-    int client_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_sock < 0) {
-        perror("Socket creation failed");
+// Function to add a name to a batch, unless it is already there
+void batch_add(Batch* batch, const char* name) {
+    for (int i = 0; i < batch->job_count; i++) {
+        if (strcmp(batch->jobs[i].name, name) == 0) {
+            return;
+        }
+    }
+    BatchJob* grown = realloc(batch->jobs, (batch->job_count + 1) * sizeof(BatchJob));
+    if (grown == NULL) {
         return;
     }
-    struct sockaddr_in owner_addr;
-    owner_addr.sin_family = AF_INET;
-    owner_addr.sin_port = htons(owner_tcp_port);
-    inet_pton(AF_INET, owner_ip, &owner_addr.sin_addr);
+    batch->jobs = grown;
+    BatchJob* job = &batch->jobs[batch->job_count++];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->name, sizeof(job->name), "%s", name);
+}
 
-    if (connect(client_sock, (struct sockaddr*)&owner_addr, sizeof(owner_addr)) < 0) {
-        perror("Connection to owner failed");
-        close(client_sock);
-        return;
+// Function to read a batch manifest: one resource name or glob pattern per
+// line, with blank lines and lines starting with '#' ignored. Patterns are
+// expanded with OP_SEARCH on every shard. path "-" reads standard input.
+// Returns -1 if the manifest cannot be read.
+int load_manifest(int sock, const char* path, Batch* batch) {
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open the manifest");
+        return -1;
+    }
+    char line[MAX_FILENAME_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (strpbrk(line, "*?[") == NULL) {
+            batch_add(batch, line);
+            continue;
+        }
+        uint8_t reply[BUFFER_SIZE];
+        ProtoReader reader;
+        int cursor = 0, rows, shard = 0, found = 0;
+        do {
+            cursor = request_page(sock, shard_map.nodes[shard], OP_SEARCH, line, cursor, reply, &reader, &rows);
+            if (cursor == -2) {
+                break;
+            }
+            if (cursor == -1 && ++shard < shard_map.count) {
+                cursor = 0;
+            }
+            for (int i = 0; i < rows; i++) {
+                char name[MAX_FILENAME_LENGTH];
+                proto_get_str(&reader, name, sizeof(name));
+                proto_get_u16(&reader);  // owner count
+                if (reader.error) {
+                    break;
+                }
+                batch_add(batch, name);
+                found++;
+            }
+        } while (cursor >= 0);
+        if (found == 0) {
+            printf("No resources match '%s'.\n", line);
+        }
+    }
+    if (file != stdin) {
+        fclose(file);
     }
+    return 0;
+}
 
-    // Send "get filename" request
-    snprintf(message, BUFFER_SIZE, "get %s", resource_name);
-    send(client_sock, message, strlen(message), 0);
+// Function to order batch jobs by file name, then by their place in the manifest
+int compare_batch_files(const void* a, const void* b) {
+    const BatchJob* left = *(BatchJob* const*)a;
+    const BatchJob* right = *(BatchJob* const*)b;
+    int order = strcmp(left->file, right->file);
+    return order != 0 ? order : (left < right ? -1 : left > right);
+}
 
-    // Receive file contents and save to local file
-    char filepath[MAX_PATH_LENGTH + MAX_FILENAME_LENGTH];
-    snprintf(filepath, sizeof(filepath), "downloaded_%s_%s", owner, resource_name);
-    FILE* fp = fopen(filepath, "wb");
-    if (fp == NULL) {
-        perror("Failed to open file for writing");
-        close(client_sock);
+// Function to choose the file each name of a batch is saved as. Names are
+// flattened as in interactive downloads, so "a/b" and "a_b" would both become
+// downloaded_a_b and two workers would write the same file. The first of such
+// names in the manifest keeps the file; the others are saved as
+// downloaded-<n>_a_b, which no flattened name can be, so a rerun of the same
+// manifest picks the same files and can resume them.
+void name_batch_files(Batch* batch) {
+    BatchJob** order = malloc((batch->job_count + 1) * sizeof(BatchJob*));
+    for (int j = 0; j < batch->job_count; j++) {
+        snprintf(batch->jobs[j].file, sizeof(batch->jobs[j].file), "downloaded_%s", batch->jobs[j].name);
+        flatten_name(batch->jobs[j].file);
+        if (order != NULL) {
+            order[j] = &batch->jobs[j];
+        }
+    }
+    if (order == NULL) {
         return;
     }
-    char file_buffer[BUFFER_SIZE];
-    int bytes_received;
-    while ((bytes_received = recv(client_sock, file_buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(file_buffer, 1, bytes_received, fp);
+    qsort(order, batch->job_count, sizeof(BatchJob*), compare_batch_files);
+    // order[first] starts a run of equal files and keeps its own
+    for (int j = 1, first = 0; j < batch->job_count; j++) {
+        if (strcmp(order[j]->file, order[first]->file) != 0) {
+            first = j;
+            continue;
+        }
+        char flat[MAX_RESOURCE_NAME];
+        snprintf(flat, sizeof(flat), "%s", order[j]->name);
+        flatten_name(flat);
+        snprintf(order[j]->file, sizeof(order[j]->file), "downloaded-%d_%s", j - first + 1, flat);
+    }
+    free(order);
+}
+
+// Function to look up the owners of every name of a batch. The first page of
+// each lookup is sent ahead of the replies, up to PIPELINE_DEPTH at once, so
+// the whole manifest is resolved in about one round trip; the rare name with
+// more owners than fit a page has the rest fetched afterwards. Each name is
+// then left with the owners of its most common content (see select_content).
+void resolve_batch(int sock, Batch* batch) {
+    PendingRequest* in_flight[PIPELINE_DEPTH];
+    int sent = 0, done = 0;
+    while (done < batch->job_count) {
+        while (sent < batch->job_count && sent - done < PIPELINE_DEPTH) {
+            uint8_t request[BUFFER_SIZE];
+            ProtoWriter writer;
+            uint32_t request_id = write_page_request(&writer, request, OP_RESOURCE_INFO, batch->jobs[sent].name, 0);
+            in_flight[sent % PIPELINE_DEPTH] = start_request(sock, shard_addr(batch->jobs[sent].name), &writer,
+                                                             request_id);
+            sent++;
+        }
+        BatchJob* job = &batch->jobs[done];
+        PendingRequest* pending = in_flight[done % PIPELINE_DEPTH];
+        done++;
+        uint8_t reply[BUFFER_SIZE];
+        ProtoReader reader;
+        ProtoHeader header;
+        int rows, cursor = -2;
+        job->lookup_failed = 1;
+        if (pending != NULL && finish_request(pending, reply, &reader, &header) == 0) {
+            cursor = read_page_reply(&header, &reader, &rows);
+            job->lookup_failed = cursor == -2 && header.status != STATUS_NOT_FOUND;
+        }
+        while (cursor != -2) {
+            if (read_owner_rows(&reader, rows, &job->owners, &job->owner_count) < 0 || cursor == -1) {
+                break;
+            }
+            cursor = request_page(sock, shard_addr(job->name), OP_RESOURCE_INFO, job->name, cursor, reply, &reader,
+                                  &rows);
+        }
+        job->owner_count = job->owner_count > 0 ? select_content(job->owners, job->owner_count, -1) : 0;
+        job->state = job->owner_count > 0 ? BATCH_QUEUED : BATCH_DONE;
+    }
+}
+
+// Function to find how many batch downloads are using an owner, adding it to
+// the table if it is new. Called with the batch mutex held.
+int* peer_load(Batch* batch, const OwnerInfo* owner) {
+    for (int i = 0; i < batch->peer_count; i++) {
+        if (batch->peers[i].tcp_port == owner->tcp_port && strcmp(batch->peers[i].ip, owner->ip) == 0) {
+            return &batch->peers[i].active;
+        }
+    }
+    PeerLoad* peer = &batch->peers[batch->peer_count++];
+    snprintf(peer->ip, sizeof(peer->ip), "%s", owner->ip);
+    peer->tcp_port = owner->tcp_port;
+    peer->active = 0;
+    return &peer->active;
+}
+
+// Function to write the result line of one name of a batch: tab-separated
+// name, status (ok, failed, not_found or lookup_failed), bytes, seconds, MB/s, owners used
+// and the file it was saved as
+void report_batch_result(Batch* batch, const BatchJob* job, const char* status, long long bytes, double seconds,
+                         int owners, const char* filepath) {
+    fprintf(batch->results, "%s\t%s\t%lld\t%.3f\t%.1f\t%d\t%s\n", job->name, status, bytes, seconds,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0, owners, filepath);
+    fflush(batch->results);
+}
+
+// Function run by each worker of a batch. A worker takes the next queued
+// name that has an owner below the per-owner limit and downloads it from
+// those owners; names whose owners are all busy wait for a download to end.
+void* batch_worker(void* arg) {
+    Batch* batch = arg;
+    pthread_mutex_lock(&batch->mutex);
+    while (1) {
+        BatchJob* job = NULL;
+        int queued = 0;
+        OwnerInfo owners[MAX_SWARM_PEERS];
+        int owner_count = 0;
+        for (int j = 0; job == NULL && j < batch->job_count; j++) {
+            if (batch->jobs[j].state != BATCH_QUEUED) {
+                continue;
+            }
+            queued++;
+            for (int k = 0; k < batch->jobs[j].owner_count && owner_count < MAX_SWARM_PEERS; k++) {
+                if (*peer_load(batch, &batch->jobs[j].owners[k]) < batch->peer_limit) {
+                    owners[owner_count++] = batch->jobs[j].owners[k];
+                }
+            }
+            if (owner_count > 0) {
+                job = &batch->jobs[j];
+            }
+        }
+        if (queued == 0) {
+            break;
+        }
+        if (job == NULL) {
+            pthread_cond_wait(&batch->changed, &batch->mutex);
+            continue;
+        }
+        job->state = BATCH_RUNNING;
+        for (int k = 0; k < owner_count; k++) {
+            (*peer_load(batch, &owners[k]))++;
+        }
+        pthread_mutex_unlock(&batch->mutex);
+
+        const char* filepath = job->file;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = swarm_download(job->name, owners, owner_count, filepath);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        struct stat info;
+        long long bytes = result == 0 && stat(filepath, &info) == 0 ? info.st_size : 0;
+        if (result == 0 && share_downloads) {
+            share_download(batch->sock, batch->username, job->name, filepath);
+        }
+
+        pthread_mutex_lock(&batch->mutex);
+        for (int k = 0; k < owner_count; k++) {
+            (*peer_load(batch, &owners[k]))--;
+        }
+        job->state = BATCH_DONE;
+        batch->failed += result != 0;
+        report_batch_result(batch, job, result == 0 ? "ok" : "failed", bytes, seconds, owner_count, filepath);
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+// Function to download every name of a manifest without any prompts. Owners
+// are looked up for all names first and picked automatically (the most common
+// content, from all its owners); then up to jobs downloads run at once, with
+// at most peer_limit of them using any one owner. A line per name goes to
+// results as each one ends. Returns the number of names not downloaded, or
+// -1 if the manifest could not be read.
+int run_batch(int sock, const char* username, const char* manifest, int jobs, int peer_limit, FILE* results) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.sock = sock;
+    batch.username = username;
+    batch.peer_limit = peer_limit;
+    batch.results = results;
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+    if (load_manifest(sock, manifest, &batch) < 0) {
+        return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    name_batch_files(&batch);
+    resolve_batch(sock, &batch);
+    int owner_total = 0;
+    for (int j = 0; j < batch.job_count; j++) {
+        owner_total += batch.jobs[j].owner_count;
+        if (batch.jobs[j].owner_count > 0) {
+            continue;
+        }
+        if (batch.jobs[j].lookup_failed) {
+            printf("Failed to look up the owners of '%s'.\n", batch.jobs[j].name);
+            report_batch_result(&batch, &batch.jobs[j], "lookup_failed", 0, 0, 0, "-");
+        } else {
+            printf("No active owners found for resource '%s'.\n", batch.jobs[j].name);
+            report_batch_result(&batch, &batch.jobs[j], "not_found", 0, 0, 0, "-");
+        }
+        batch.failed++;
+    }
+    batch.peers = malloc((owner_total + 1) * sizeof(PeerLoad));
+    int worker_count = jobs < batch.job_count ? jobs : batch.job_count;
+    pthread_t* workers = malloc((worker_count + 1) * sizeof(pthread_t));
+    if (batch.peers == NULL || workers == NULL) {
+        perror("Failed to start the batch");
+        worker_count = 0;
+        batch.failed = batch.job_count;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_create(&workers[i], NULL, batch_worker, &batch);
     }
-    fclose(fp);
-    close(client_sock);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Downloaded %d of %d resource(s) in %.2f s.\n", batch.job_count - batch.failed, batch.job_count, seconds);
+    for (int j = 0; j < batch.job_count; j++) {
+        free(batch.jobs[j].owners);
+    }
+    free(batch.jobs);
+    free(batch.peers);
+    free(workers);
+    pthread_mutex_destroy(&batch.mutex);
+    pthread_cond_destroy(&batch.changed);
+    return batch.failed;
+}
 
-    printf("Resource '%s' downloaded and saved as '%s'\n", resource_name, filepath);
+// Function to change the upload scheduler's limits while the client runs.
+// A new rate cap applies at once; weights apply from the next request of a
+// downloader.
+void set_upload_limits() {
+    char line[64];
+    printf("Upload rate cap in KB/s, 0 for none (now %lld): ", __atomic_load_n(&upload_rate, __ATOMIC_RELAXED) / 1024);
+    if (fgets(line, sizeof(line), stdin) != NULL && line[0] != '\n') {
+        long long rate = atoll(line);
+        if (rate >= 0) {
+            __atomic_store_n(&upload_rate, rate * 1024, __ATOMIC_RELAXED);
+        } else {
+            printf("Invalid rate.\n");
+        }
+    }
+    while (1) {
+        char ip[INET_ADDRSTRLEN];
+        int weight;
+        struct in_addr addr;
+        printf("Downloader IP and weight 1-%d (e.g. 10.0.0.5 4), empty to finish: ", MAX_UPLOAD_WEIGHT);
+        if (fgets(line, sizeof(line), stdin) == NULL || line[0] == '\n') {
+            break;
+        }
+        if (sscanf(line, "%15s %d", ip, &weight) != 2 || inet_pton(AF_INET, ip, &addr) != 1 || weight < 1 ||
+            weight > MAX_UPLOAD_WEIGHT) {
+            printf("Invalid IP or weight.\n");
+        } else if (set_upload_weight(ip, weight) < 0) {
+            printf("At most %d downloaders can have a weight.\n", MAX_UPLOAD_WEIGHTS);
+        }
+    }
 }
 
 void display_menu(int sock, struct sockaddr_in server_addr, const char* username) {
@@ -320,7 +3733,10 @@ void display_menu(int sock, struct sockaddr_in server_addr, const char* username
         printf("2. Query available resources\n");
         printf("3. Query active users\n");
         printf("4. Download a resource\n");
-        printf("5. Exit\n");
+        printf("5. Search resources\n");
+        printf("6. Withdraw a resource\n");
+        printf("7. Exit\n");
+        printf("8. Set upload limits\n");
         printf("Select an option: ");
         scanf("%d", &choice);
         getchar();
@@ -330,20 +3746,32 @@ void display_menu(int sock, struct sockaddr_in server_addr, const char* username
                 printf("Enter resource name: ");
                 fgets(resource_name, sizeof(resource_name), stdin);
                 resource_name[strcspn(resource_name, "\n")] = 0;
-                announce_resource(sock, server_addr, resource_name, username);
+                announce_resource(sock, resource_name, username);
                 break;
             case 2:
-                query_resources(sock, server_addr);
+                query_resources(sock);
                 break;
             case 3:
                 query_users(sock, server_addr);
                 break;
             case 4:
-                download_resource(sock, server_addr);
+                download_resource(sock, username);
                 break;
             case 5:
+                search_resources(sock);
+                break;
+            case 6:
+                printf("Enter resource name: ");
+                fgets(resource_name, sizeof(resource_name), stdin);
+                resource_name[strcspn(resource_name, "\n")] = 0;
+                withdraw_resource(sock, resource_name, username);
+                break;
+            case 7:
                 running = 0;
                 break;
+            case 8:
+                set_upload_limits();
+                break;
             default:
                 printf("Invalid choice. Please try again.\n");
         }
@@ -351,13 +3779,70 @@ void display_menu(int sock, struct sockaddr_in server_addr, const char* username
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        printf("Usage: %s <server_ip> <username>\n", argv[0]);
+    int opt, batch_jobs = DEFAULT_BATCH_JOBS, peer_limit = DEFAULT_PEER_DOWNLOADS;
+    const char* manifest = NULL;
+    const char* folder = NULL;
+    while ((opt = getopt(argc, argv, "c:b:s:azm:j:p:f:r:")) != -1) {
+        switch (opt) {
+            case 'r':
+                upload_rate = atoll(optarg) * 1024;
+                break;
+            case 'm':
+                manifest = optarg;
+                break;
+            case 'j':
+                batch_jobs = atoi(optarg);
+                break;
+            case 'p':
+                peer_limit = atoi(optarg);
+                break;
+            case 'f':
+                folder = optarg;
+                break;
+            case 'z':
+                download_compressed = 1;
+                break;
+            case 's':
+                snprintf(store_dir, sizeof(store_dir), "%s", optarg);
+                break;
+            case 'a':
+                share_downloads = 1;
+                break;
+            case 'c':
+                max_uploads = atoi(optarg);
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;  // Print the usage below
+                break;
+        }
+    }
+    if (argc - optind < 2 || max_uploads < 1 || listen_backlog < 1 || batch_jobs < 1 || peer_limit < 1 ||
+        upload_rate < 0) {
+        printf("Usage: %s [-c max_uploads] [-b listen_backlog] [-r upload_kb_per_s] [-s store_dir] [-a] [-z] [-f sharing_folder] "
+               "[-m manifest [-j jobs] [-p per_owner]] <server_ip> <username> [server_port]\n", argv[0]);
         return 1;
     }
+    if (manifest != NULL && folder == NULL) {
+        // Batch mode reads nothing from the terminal, and "-m -" takes stdin for the manifest
+        printf("Batch mode (-m) needs the sharing folder given with -f.\n");
+        return 1;
+    }
+    // In batch mode the results are the only output on stdout; messages go to stderr
+    FILE* results = NULL;
+    if (manifest != NULL) {
+        results = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        if (results == NULL) {
+            perror("Failed to open the results");
+            return 1;
+        }
+    }
 
-    const char* server_ip = argv[1];
-    const char* username = argv[2];
+    const char* server_ip = argv[optind];
+    const char* username = argv[optind + 1];
 
     int sock;
     struct sockaddr_in server_addr;
@@ -367,8 +3852,11 @@ int main(int argc, char* argv[]) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    // Hello responses and other requests to the server go out ahead of queued uploads
+    int tos = IPTOS_LOWDELAY;
+    setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(argc - optind > 2 ? atoi(argv[optind + 2]) : SERVER_PORT);
     inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
 
     // TCP server setup
@@ -391,7 +3879,14 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(tcp_server_sock, 5) < 0) {
+    // Every upload holds a socket and a file open
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    if (listen(tcp_server_sock, listen_backlog) < 0) {
         perror("TCP listen failed");
         close(tcp_server_sock);
         exit(EXIT_FAILURE);
@@ -402,10 +3897,24 @@ int main(int argc, char* argv[]) {
     getsockname(tcp_server_sock, (struct sockaddr*)&tcp_server_addr, &addrlen);
     int tcp_port = ntohs(tcp_server_addr.sin_port);
 
-    // Prompt for sharing folder
-    printf("Enter the path to the sharing folder: ");
-    fgets(sharing_folder, sizeof(sharing_folder), stdin);
-    sharing_folder[strcspn(sharing_folder, "\n")] = '\0';
+    // Prompt for sharing folder, unless it was given
+    if (folder != NULL) {
+        snprintf(sharing_folder, sizeof(sharing_folder), "%s", folder);
+    } else {
+        printf("Enter the path to the sharing folder: ");
+        fgets(sharing_folder, sizeof(sharing_folder), stdin);
+        sharing_folder[strcspn(sharing_folder, "\n")] = '\0';
+    }
+
+    store_open();
+
+    for (int i = 0; i < MAX_PENDING; i++) {
+        pthread_cond_init(&pending_requests[i].cond, NULL);
+    }
+    // Start request ids at a random point, so a restarted client is not
+    // mistaken for a retransmission of the previous run
+    srand(time(NULL) ^ getpid());
+    next_request_id = (uint32_t)rand();
 
     // Create listener thread
     pthread_t listener;
@@ -415,12 +3924,33 @@ int main(int argc, char* argv[]) {
     pthread_t tcp_server_thread_id;
     pthread_create(&tcp_server_thread_id, NULL, tcp_server_thread, &tcp_server_sock);
 
-    register_with_server(sock, server_addr, username, tcp_port);
+    if (negotiate_protocol(sock, server_addr) != PROTO_VERSION) {
+        printf("Server does not support protocol version %d.\n", PROTO_VERSION);
+        running = 0;
+    } else {
+        if (fetch_shard_map(sock, server_addr) < 0) {
+            printf("Failed to fetch the shard map.\n");
+            running = 0;
+        } else {
+            register_with_server(sock, username, tcp_port);
+        }
+    }
 
+    Watcher* watcher = NULL;
+    pthread_t watcher_thread_id;
+    int exit_status = manifest != NULL && !running;  // A batch that cannot start has failed
     if (running) {
-        // Announce resources upon registration
-        announce_resources(sock, server_addr, username, sharing_folder);
-        display_menu(sock, server_addr, username);
+        // Announce resources upon registration, then keep announcing changes
+        watcher = start_watcher(sock, username);
+        announce_resources(sock, username, sharing_folder);
+        if (watcher != NULL) {
+            pthread_create(&watcher_thread_id, NULL, watcher_thread, watcher);
+        }
+        if (manifest != NULL) {
+            exit_status = run_batch(sock, username, manifest, batch_jobs, peer_limit, results) == 0 ? 0 : 1;
+        } else {
+            display_menu(sock, server_addr, username);
+        }
     }
 
     // Clean up
@@ -429,7 +3959,14 @@ int main(int argc, char* argv[]) {
     pthread_cancel(tcp_server_thread_id);
     pthread_join(listener, NULL);
     pthread_join(tcp_server_thread_id, NULL);
+    if (watcher != NULL) {
+        pthread_cancel(watcher_thread_id);
+        pthread_join(watcher_thread_id, NULL);
+    }
     close(sock);
     close(tcp_server_sock);
-    return 0;
+    if (results != NULL) {
+        fclose(results);
+    }
+    return exit_status;
 }
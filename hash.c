@@ -0,0 +1,152 @@
+// hash.c
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+#define PRIME5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Functions to read little-endian words; compilers turn these into plain loads
+static uint64_t read64(const uint8_t* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t hash, uint64_t acc) {
+    hash ^= hash_round(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+// Function to consume whole 32-byte stripes; returns the bytes used
+static size_t hash_stripes(uint64_t* acc, const uint8_t* data, size_t len) {
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    size_t offset = 0;
+    for (; offset + 32 <= len; offset += 32) {
+        a0 = hash_round(a0, read64(data + offset));
+        a1 = hash_round(a1, read64(data + offset + 8));
+        a2 = hash_round(a2, read64(data + offset + 16));
+        a3 = hash_round(a3, read64(data + offset + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return offset;
+}
+
+void hash_init(HashState* state) {
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = PRIME1 + PRIME2;
+    state->acc[1] = PRIME2;
+    state->acc[2] = 0;
+    state->acc[3] = -PRIME1;
+}
+
+void hash_update(HashState* state, const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    state->total_len += len;
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered < len ? 32 - state->buffered : len;
+        memcpy(state->buffer + state->buffered, bytes, take);
+        state->buffered += take;
+        bytes += take;
+        len -= take;
+        if (state->buffered < 32) {
+            return;
+        }
+        hash_stripes(state->acc, state->buffer, 32);
+        state->buffered = 0;
+    }
+    size_t used = hash_stripes(state->acc, bytes, len);
+    memcpy(state->buffer, bytes + used, len - used);
+    state->buffered = len - used;
+}
+
+uint64_t hash_final(const HashState* state) {
+    uint64_t hash;
+    if (state->total_len >= 32) {
+        const uint64_t* acc = state->acc;
+        hash = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = merge_round(hash, acc[i]);
+        }
+    } else {
+        hash = PRIME5;
+    }
+    hash += state->total_len;
+
+    const uint8_t* p = state->buffer;
+    size_t left = state->buffered;
+    for (; left >= 8; p += 8, left -= 8) {
+        hash ^= hash_round(0, read64(p));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        hash ^= *p * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Function to hash the contents of a file. A hash of 0 is reported as 1, since
+// 0 stands for an unknown hash in the protocol. Returns -1 if the file cannot
+// be read.
+int hash_file(const char* path, uint64_t* hash, uint64_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    uint8_t* buffer = malloc(HASH_READ_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    HashState state;
+    hash_init(&state);
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, HASH_READ_SIZE)) > 0) {
+        hash_update(&state, buffer, bytes_read);
+    }
+    free(buffer);
+    close(fd);
+    if (bytes_read < 0) {
+        return -1;
+    }
+    *hash = hash_final(&state);
+    if (*hash == 0) {
+        *hash = 1;
+    }
+    *size = state.total_len;
+    return 0;
+}
@@ -0,0 +1,29 @@
+// hash.h
+// Content hashing of shared files (XXH64), used by the client to announce
+// what a file holds and to check a download against it.
+//
+// XXH64 keeps four independent 64-bit accumulators and consumes 32 bytes per
+// round, so the four multiply-rotate chains run in parallel in the CPU's
+// pipelines and hashing is bound by memory bandwidth rather than latency.
+// The result is the standard XXH64 with seed 0.
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_READ_SIZE (1 << 20)  // Bytes read per call while hashing a file
+
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total_len;
+    uint8_t buffer[32];  // Input not yet consumed by a full round
+    size_t buffered;
+} HashState;
+
+void hash_init(HashState* state);
+void hash_update(HashState* state, const void* data, size_t len);
+uint64_t hash_final(const HashState* state);
+int hash_file(const char* path, uint64_t* hash, uint64_t* size);
+
+#endif
@@ -0,0 +1,191 @@
+// protocol.c
+#include <string.h>
+#include "protocol.h"
+
+// Function to start a frame; the payload is appended after the header
+void proto_writer_init(ProtoWriter* writer, void* buffer, size_t capacity,
+                       uint8_t opcode, uint8_t status, uint32_t request_id) {
+    writer->data = buffer;
+    writer->capacity = capacity;
+    writer->len = 0;
+    writer->overflow = 0;
+    proto_put_u8(writer, PROTO_MAGIC);
+    proto_put_u8(writer, PROTO_VERSION);
+    proto_put_u8(writer, opcode);
+    proto_put_u8(writer, status);
+    proto_put_u32(writer, request_id);
+    proto_put_u16(writer, 0);  // length, filled in by proto_finish
+}
+
+// Function to append raw bytes, flagging overflow instead of writing past the buffer
+static void proto_put_bytes(ProtoWriter* writer, const void* bytes, size_t count) {
+    if (writer->overflow || count > writer->capacity - writer->len) {
+        writer->overflow = 1;
+        return;
+    }
+    memcpy(writer->data + writer->len, bytes, count);
+    writer->len += count;
+}
+
+void proto_put_u8(ProtoWriter* writer, uint8_t value) {
+    proto_put_bytes(writer, &value, 1);
+}
+
+void proto_put_u16(ProtoWriter* writer, uint16_t value) {
+    uint8_t bytes[2] = { value >> 8, value };
+    proto_put_bytes(writer, bytes, 2);
+}
+
+void proto_put_u32(ProtoWriter* writer, uint32_t value) {
+    uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+    proto_put_bytes(writer, bytes, 4);
+}
+
+void proto_put_u64(ProtoWriter* writer, uint64_t value) {
+    proto_put_u32(writer, value >> 32);
+    proto_put_u32(writer, value);
+}
+
+void proto_put_str(ProtoWriter* writer, const char* value) {
+    size_t len = strlen(value);
+    if (len > 0xFFFF) {
+        writer->overflow = 1;
+        return;
+    }
+    proto_put_u16(writer, len);
+    proto_put_bytes(writer, value, len);
+}
+
+// Function to overwrite a u16 written earlier, e.g. a row count known only at the end
+void proto_patch_u16(ProtoWriter* writer, size_t offset, uint16_t value) {
+    if (offset + 2 <= writer->len) {
+        writer->data[offset] = value >> 8;
+        writer->data[offset + 1] = value;
+    }
+}
+
+void proto_patch_u32(ProtoWriter* writer, size_t offset, uint32_t value) {
+    if (offset + 4 <= writer->len) {
+        writer->data[offset] = value >> 24;
+        writer->data[offset + 1] = value >> 16;
+        writer->data[offset + 2] = value >> 8;
+        writer->data[offset + 3] = value;
+    }
+}
+
+// Function to change the version byte, used when answering a negotiation
+void proto_set_version(ProtoWriter* writer, uint8_t version) {
+    if (writer->len > 1) {
+        writer->data[1] = version;
+    }
+}
+
+// Function to fill in the payload length. Returns the frame size, or 0 if the
+// payload did not fit.
+size_t proto_finish(ProtoWriter* writer) {
+    if (writer->overflow || writer->len < PROTO_HEADER_SIZE || writer->len - PROTO_HEADER_SIZE > 0xFFFF) {
+        return 0;
+    }
+    proto_patch_u16(writer, 8, writer->len - PROTO_HEADER_SIZE);
+    return writer->len;
+}
+
+// Function to tell a binary frame from a text command
+int proto_is_frame(const void* buffer, size_t len) {
+    return len >= PROTO_HEADER_SIZE && ((const uint8_t*)buffer)[0] == PROTO_MAGIC;
+}
+
+// Function to decode a frame header and position the reader on the payload.
+// Returns -1 if the header is malformed or the length does not match.
+int proto_reader_init(ProtoReader* reader, ProtoHeader* header, const void* buffer, size_t len) {
+    reader->data = buffer;
+    reader->len = len;
+    reader->pos = 0;
+    reader->error = 0;
+    if (!proto_is_frame(buffer, len)) {
+        return -1;
+    }
+    proto_get_u8(reader);  // magic
+    header->version = proto_get_u8(reader);
+    header->opcode = proto_get_u8(reader);
+    header->status = proto_get_u8(reader);
+    header->request_id = proto_get_u32(reader);
+    header->length = proto_get_u16(reader);
+    if (header->version == 0 || (size_t)header->length != len - PROTO_HEADER_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to check that count more bytes can be read
+static const uint8_t* proto_take(ProtoReader* reader, size_t count) {
+    if (reader->error || count > reader->len - reader->pos) {
+        reader->error = 1;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->data + reader->pos;
+    reader->pos += count;
+    return bytes;
+}
+
+uint8_t proto_get_u8(ProtoReader* reader) {
+    const uint8_t* bytes = proto_take(reader, 1);
+    return bytes ? bytes[0] : 0;
+}
+
+uint16_t proto_get_u16(ProtoReader* reader) {
+    const uint8_t* bytes = proto_take(reader, 2);
+    return bytes ? (uint16_t)(bytes[0] << 8 | bytes[1]) : 0;
+}
+
+uint32_t proto_get_u32(ProtoReader* reader) {
+    const uint8_t* bytes = proto_take(reader, 4);
+    return bytes ? (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3] : 0;
+}
+
+uint64_t proto_get_u64(ProtoReader* reader) {
+    uint64_t high = proto_get_u32(reader);
+    return high << 32 | proto_get_u32(reader);
+}
+
+// Function to read a string field into out. Strings that are empty, do not fit
+// or contain a NUL byte are rejected with -1.
+int proto_get_str(ProtoReader* reader, char* out, size_t out_size) {
+    uint16_t len = proto_get_u16(reader);
+    const uint8_t* bytes = proto_take(reader, len);
+    if (bytes == NULL || len == 0 || len >= out_size || memchr(bytes, '\0', len) != NULL) {
+        reader->error = 1;
+        out[0] = '\0';
+        return -1;
+    }
+    memcpy(out, bytes, len);
+    out[len] = '\0';
+    return 0;
+}
+
+// Function to hash one name of a shared folder manifest (64-bit FNV-1a)
+uint64_t proto_manifest_hash(const char* name) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Function to hash one file of a shared folder manifest: its name, then its
+// size and content hash folded into the same FNV-1a state
+uint64_t proto_manifest_entry_hash(const char* name, uint64_t size, uint64_t content_hash) {
+    uint64_t hash = proto_manifest_hash(name);
+    if (size == 0 && content_hash == 0) {
+        return hash;
+    }
+    uint64_t fields[2] = { size, content_hash };
+    for (int i = 0; i < 2; i++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (uint8_t)(fields[i] >> shift);
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
@@ -0,0 +1,108 @@
+// protocol.h
+// Binary framing shared by the client and the server.
+//
+// Every frame starts with a fixed header, all integers in network byte order:
+//
+//   u8  magic       PROTO_MAGIC, never the first byte of a text command
+//   u8  version     protocol version the frame is encoded with
+//   u8  opcode      one of the OP_* values
+//   u8  status      STATUS_* in replies, 0 in requests
+//   u32 request_id  echoed unchanged in the reply
+//   u16 length      number of payload bytes after the header
+//
+// The payload is a sequence of fields: integers are fixed width and strings
+// are a u16 length followed by that many bytes (no terminator).
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0xB7
+#define PROTO_VERSION 2
+#define PROTO_HEADER_SIZE 10
+#define PROTO_END_CURSOR 0xFFFFFFFFu  // next_cursor value of the last page
+
+// Opcodes. A reply carries the opcode of its request.
+enum {
+    OP_NEGOTIATE = 1,       // -> (header version = highest supported)  <- (header version = chosen)
+    OP_REGISTER,            // -> str username, u16 tcp_port
+    OP_ANNOUNCE,            // -> str resource_name, str owner, v2: u64 size, u64 content_hash
+    OP_QUERY_RESOURCES,     // -> u32 cursor, u16 page_rows  <- page of: str name, str owner, u32 ip, u16 tcp_port
+    OP_QUERY_USERS,         // -> u32 cursor, u16 page_rows  <- page of: str username
+    OP_RESOURCE_INFO,       // -> str name, u32 cursor, u16 page_rows  <- page of: str owner, u32 ip, u16 tcp_port,
+                            //    v2: u64 size, u64 content_hash; owners of the same content are adjacent
+    OP_HELLO,               // server -> client liveness probe, no payload
+    OP_HELLO_RESPONSE,      // client -> server, no payload
+    OP_SEARCH,              // -> str pattern, u32 cursor, u16 page_rows  <- page of: str name, u16 owner_count
+    OP_ANNOUNCE_BULK,       // -> str owner, u16 count, count x (str name, v2: u64 size, u64 content_hash)  <- u16 added
+    OP_WITHDRAW,            // -> str owner, u16 count, count x str name  <- u16 removed
+    OP_SYNC,                // -> str owner, u32 count, u64 digest  <- u8 in_sync, u32 count held by the server
+    OP_LIST_OWNED,          // -> str owner, u32 cursor, u16 page_rows  <- page of: str name, v2: u64 size, u64 content_hash
+    OP_SHARD_MAP,           // -> no payload  <- u16 count, count x (u32 ip, u16 port); 0 if not sharded
+    OP_STATS,               // -> u32 cursor, u16 page_rows  <- page of: str line (Prometheus text format)
+    OP_COUNT
+};
+
+// Reply status codes. Any status other than STATUS_OK carries a str message.
+// Paged replies start with u32 next_cursor and u16 row count.
+enum {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1,
+    STATUS_NOT_FOUND = 2,
+    STATUS_WRONG_SHARD = 3  // the name belongs to another shard; fetch the shard map
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t request_id;
+    uint16_t length;
+} ProtoHeader;
+
+// Encoder writing into a caller-supplied buffer. Writes past the capacity set
+// overflow and are dropped, so callers only check once at the end.
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t len;
+    int overflow;
+} ProtoWriter;
+
+// Bounds-checked decoder. Reads past the end set error and return zeroes.
+typedef struct {
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+    int error;
+} ProtoReader;
+
+void proto_writer_init(ProtoWriter* writer, void* buffer, size_t capacity,
+                       uint8_t opcode, uint8_t status, uint32_t request_id);
+void proto_put_u8(ProtoWriter* writer, uint8_t value);
+void proto_put_u16(ProtoWriter* writer, uint16_t value);
+void proto_put_u32(ProtoWriter* writer, uint32_t value);
+void proto_put_u64(ProtoWriter* writer, uint64_t value);
+void proto_put_str(ProtoWriter* writer, const char* value);
+void proto_patch_u16(ProtoWriter* writer, size_t offset, uint16_t value);
+void proto_patch_u32(ProtoWriter* writer, size_t offset, uint32_t value);
+void proto_set_version(ProtoWriter* writer, uint8_t version);
+size_t proto_finish(ProtoWriter* writer);
+
+int proto_is_frame(const void* buffer, size_t len);
+int proto_reader_init(ProtoReader* reader, ProtoHeader* header, const void* buffer, size_t len);
+uint8_t proto_get_u8(ProtoReader* reader);
+uint16_t proto_get_u16(ProtoReader* reader);
+uint32_t proto_get_u32(ProtoReader* reader);
+uint64_t proto_get_u64(ProtoReader* reader);
+int proto_get_str(ProtoReader* reader, char* out, size_t out_size);
+
+// A shared folder is summarised for OP_SYNC by its name count and the sum,
+// modulo 2^64, of proto_manifest_entry_hash over its files. The sum does not
+// depend on order and can be updated one file at a time. A file announced
+// without a size and content hash (both 0) hashes as its name alone.
+uint64_t proto_manifest_hash(const char* name);
+uint64_t proto_manifest_entry_hash(const char* name, uint64_t size, uint64_t content_hash);
+
+#endif
@@ -1,290 +1,3123 @@
 // server.c
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include "protocol.h"
+#include "shard.h"
 
-#define PORT 12345
+#define PORT 12345  // Default UDP port
 #define BUFFER_SIZE 4096
-#define MAX_CLIENTS 100
-#define HELLO_INTERVAL 5  // Interval for hello messages in seconds
-#define HELLO_TIMEOUT 15  // Timeout for client response in seconds
+#define MAX_CLIENTS 1000000  // Upper bound on registered users; the table grows up to this
+#define DEFAULT_HELLO_INTERVAL 5  // Default interval for hello messages in seconds
+#define DEFAULT_HELLO_TIMEOUT 15  // Default timeout for client response in seconds
+#define WHEEL_SLOTS 512           // Slots in the liveness timer wheel
+#define WHEEL_TICK_MS 100         // Time covered by one timer wheel slot
+#define BATCH_SIZE 32     // Datagrams received or sent per recvmmsg/sendmmsg call
+#define PAGE_BYTES 1400   // Largest query reply, chosen to fit a single Ethernet frame
+#define DEFAULT_PAGE_ROWS 50
+#define MAX_PAGE_ROWS 500
+#define REPLY_CACHE_SLOTS 1024  // Replies to state-changing requests kept per worker for retransmissions
+#define REPLY_CACHE_TTL_SEC 30  // How long a retransmission is answered from the cache
+#define STATS_CACHE_TTL_SEC 30  // How long later pages of a stats scrape come from its first page's report
 
-// Structure for user directory entry
+#define RESOURCE_BUCKETS_INITIAL 1024  // Initial size of the resource hash table (power of two)
+#define USER_BUCKETS_INITIAL 256        // Initial size of the user hash tables (power of two)
+#define SEARCH_BUCKETS_INITIAL 4096     // Initial size of the trigram table (power of two)
+#define MAX_TRIGRAMS 128                // Longest literal, in bytes, that search looks at
+#define TRIGRAM_START 0x01              // Marker before the first character of a name
+#define TRIGRAM_END 0x02                // Marker after the last character of a name
+#define PUBLISH_INTERVAL_MS 5           // Shortest gap between two directory snapshots
+#define PUBLISH_MAX_INTERVAL_MS 1000    // Longest gap, however long a snapshot takes to build
+#define PUBLISH_COST_RATIO 10           // The gap is at least this many times the last build
+#define LOG_RECORD_BYTES 256            // Largest directory log record
+#define LOG_COMPACT_BYTES (4 << 20)     // Log size that triggers a compaction
+#define LOCK_COUNT 2                    // Directory locks, user_lock and resource_lock
+#define HISTOGRAM_BUCKETS 656           // 16 per power of two, up to about 2 hours in nanoseconds
+
+// Log levels for -v; per-request messages are LEVEL_DEBUG
+enum {
+    LEVEL_ERROR = 0,
+    LEVEL_WARN,
+    LEVEL_INFO,
+    LEVEL_DEBUG
+};
+
+// Directory log record types. Each record is a protocol frame whose opcode is
+// the record type and whose request_id holds a checksum of the payload.
+enum {
+    LOG_USER = 1,        // str username, u32 ip, u16 udp_port, u16 tcp_port, u8 binary
+    LOG_ADD,             // str owner, str name, u64 size, u64 content_hash (absent in older logs)
+    LOG_REMOVE,          // str owner, str name
+    LOG_EXPIRE,          // str username
+    LOG_SNAPSHOT_BEGIN,  // u32 generation of the first log to replay after the snapshot
+    LOG_SNAPSHOT_END
+};
+
+typedef struct ResourceDirectoryEntry ResourceDirectoryEntry;
+typedef struct UserDirectoryEntry UserDirectoryEntry;
+typedef struct ResourceName ResourceName;
+
+// What the owner announced a file to contain. Both fields are 0 when the
+// owner did not say, e.g. a text or version 1 announce.
 typedef struct {
+    uint64_t size;
+    uint64_t hash;
+} ResourceContent;
+
+// Structure for user directory entry. Entries are allocated individually and
+// never move, so a pointer to one is a stable handle for the user.
+struct UserDirectoryEntry {
     char username[50];
     struct sockaddr_in addr;
-    int status;  // 1 = active, 0 = inactive
+    int status;  // 1 = active, 0 = inactive, 2 = restored from disk and not yet heard from
     time_t last_response;
     int tcp_port; // New field for client's TCP server port
-} UserDirectoryEntry;
+    int binary;   // 1 if the user registered over the binary protocol
+    ResourceDirectoryEntry* resources; // Head of the chain of resources owned by this user
+    int resource_count;                // Length of that chain
+    uint64_t manifest_digest;          // Sum of proto_manifest_hash over the names it owns
+    unsigned int name_hash;
+    unsigned int addr_hash;
+    UserDirectoryEntry* name_next;     // Next user in the same username bucket
+    UserDirectoryEntry* addr_next;     // Next user in the same address bucket
+    UserDirectoryEntry* timer_next;    // Next user in the same timer wheel slot
+    int timer_rounds;                  // Full wheel turns left before the timer fires
+    int timer_scheduled;               // 1 while the user sits in the timer wheel
+    int snapshot_index;                // Position in the snapshot being built, -1 if left out
+    uint64_t hello_sent_ns;            // When the last unanswered hello went out, 0 if none
+};
+
+// Structure for one distinct resource name. All owners' entries for the name
+// share it, and it is what the search index points to.
+struct ResourceName {
+    char name[100];
+    ResourceDirectoryEntry* entries;  // Chain of the owners' entries for this name
+    int owner_count;
+    int list_index;       // Position in resource_names
+    int trigram_count;
+    uint32_t* trigrams;   // Distinct trigrams of the lowercased name
+    int* positions;       // Position of this name in each trigram's posting list
+};
+
+// Structure for the names containing one trigram
+typedef struct PostingList {
+    uint32_t trigram;
+    ResourceName** names;
+    int count, capacity;
+    struct PostingList* next;  // Next posting list in the same hash bucket
+} PostingList;
+
+// Structure for resource directory entry
+struct ResourceDirectoryEntry {
+    ResourceName* name;
+    UserDirectoryEntry* owner;
+    ResourceContent content;
+    unsigned int hash;
+    ResourceDirectoryEntry* bucket_next;  // Next entry in the same hash bucket
+    ResourceDirectoryEntry* bucket_prev;
+    ResourceDirectoryEntry* owner_next;   // Next resource owned by the same user
+    ResourceDirectoryEntry* owner_prev;
+    ResourceDirectoryEntry* name_next;    // Next owner's entry for the same name
+    ResourceDirectoryEntry* name_prev;
+    int list_index;                       // Position in resource_entries
+    int id;                               // Order of addition; the cursor of resource listings
+};
+
+// User directory: every user is indexed both by username and by UDP address.
+// user_entries lists them in registration order for listings.
+UserDirectoryEntry** user_entries = NULL;
+int user_count = 0, user_capacity = 0;
+UserDirectoryEntry** user_name_buckets = NULL;
+UserDirectoryEntry** user_addr_buckets = NULL;
+unsigned int user_bucket_count = 0;
+
+// Resource directory: a hash table keyed by resource name, plus a list of all
+// entries for listings. Both grow on demand. The list keeps the order in which
+// entries were added, so a paged listing can resume after the last id it
+// returned: removed entries leave a NULL hole until the list is compacted.
+ResourceDirectoryEntry** resource_buckets = NULL;
+unsigned int resource_bucket_count = 0;
+ResourceDirectoryEntry** resource_entries = NULL;
+int resource_count = 0, resource_capacity = 0;
+int resource_slots = 0;     // Slots of resource_entries in use, holes included
+int next_resource_id = 1;
+
+// Search index: every distinct name is listed in resource_names and in the
+// posting list of each of its trigrams. Maintained by add_resource and
+// remove_resource_entry under resource_lock.
+ResourceName** resource_names = NULL;
+int resource_name_count = 0, resource_name_capacity = 0;
+PostingList** posting_buckets = NULL;
+unsigned int posting_bucket_count = 0;
+int posting_count = 0;
+
+// Reader/writer locks for thread synchronization. Registration, announces and
+// expiry take them exclusive; the snapshot publisher takes them shared. Queries
+// never take them. When both are needed, user_lock is always taken first.
+typedef struct {
+    pthread_rwlock_t rwlock;
+    const char* name;
+    int index;  // Slot of this lock in each thread's LockStats
+} DirectoryLock;
+
+DirectoryLock user_lock = { PTHREAD_RWLOCK_INITIALIZER, "user_lock", 0 };
+DirectoryLock resource_lock = { PTHREAD_RWLOCK_INITIALIZER, "resource_lock", 1 };
+
+// How often and how long one thread waited for one directory lock
+typedef struct {
+    uint64_t acquisitions;
+    uint64_t contended;  // Acquisitions that had to wait
+    uint64_t wait_ns;    // Total time spent waiting
+} LockStats;
+
+// Immutable copy of the directory that queries read without taking a lock.
+// The publisher thread builds a new one after writes and swaps it in; the old
+// one is freed once no worker can still be reading it.
+typedef struct {
+    char username[50];
+    struct sockaddr_in addr;
+    int tcp_port;
+    int position;  // Position in user_entries; the cursor of user listings
+} SnapshotUser;
+
+typedef struct {
+    char name[100];
+    unsigned int hash;
+    int first_resource;  // Owners of this name are resources[first_resource..]
+    int resource_count;
+} SnapshotName;
+
+typedef struct {
+    int name;   // Index into names
+    int owner;  // Index into users
+    ResourceContent content;
+} SnapshotResource;
+
+// One row of the resource listing, which is in resource_entries order
+typedef struct {
+    int id;
+    int name;   // Index into names
+    int owner;  // Index into users
+} SnapshotListing;
+
+typedef struct {
+    uint32_t trigram;
+    int offset;  // Names containing the trigram are posting_names[offset..]
+    int count;   // 0 marks an empty slot
+} SnapshotPosting;
+
+typedef struct DirectorySnapshot {
+    SnapshotUser* users;           // Active users in registration order
+    int user_count;
+    SnapshotName* names;           // Names in resource_names order
+    int name_count;
+    SnapshotResource* resources;   // Resources grouped by name
+    int resource_count;
+    SnapshotListing* listing;      // The same resources in increasing id order
+    int listing_count;
+    int* name_table;               // Open-addressed, holds name index + 1
+    unsigned int name_table_size;
+    SnapshotPosting* postings;     // Open-addressed by trigram
+    unsigned int posting_table_size;
+    int* posting_names;
+    unsigned long retire_epoch;    // Global epoch at the time it was replaced
+    struct DirectorySnapshot* retired_next;
+} DirectorySnapshot;
+
+// Growable byte buffer
+typedef struct {
+    uint8_t* data;
+    size_t len, capacity;
+} ByteBuffer;
+
+// A batch of datagrams with their buffers, for recvmmsg/sendmmsg
+typedef struct {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovecs[BATCH_SIZE];
+    struct sockaddr_in addrs[BATCH_SIZE];
+    char buffers[BATCH_SIZE][BUFFER_SIZE];
+    int count;
+} DatagramBatch;
+
+// One page of a query reply, built by appending rows with a tracked length
+typedef struct {
+    char data[PAGE_BYTES];
+    size_t len;
+    int rows;
+} PageBuffer;
+
+// A decoded request, whichever protocol it arrived in
+typedef struct {
+    uint8_t opcode;
+    uint8_t version;
+    uint32_t request_id;
+    int binary;              // reply with a binary frame
+    char username[50];
+    char resource_name[100];
+    char owner[50];
+    char pattern[MAX_TRIGRAMS];
+    int tcp_port;
+    int cursor;
+    int page_rows;
+    ProtoReader name_list;   // names of a bulk request, read by next_request_name
+    int name_count;
+    int names_have_content;  // each name in name_list is followed by u64 size, u64 content_hash
+    ResourceContent content; // OP_ANNOUNCE: what the single resource holds
+    int names_read;
+    uint32_t manifest_count; // OP_SYNC: the client's view of its shared folder
+    uint64_t manifest_digest;
+} Request;
+
+// Reply to a paged query. Rows go to page for text requests and to writer
+// for binary ones.
+typedef struct {
+    Request* req;
+    PageBuffer page;
+    uint8_t frame[PAGE_BYTES];
+    ProtoWriter writer;
+    int rows;
+} ListReply;
+
+// A client to ping from the timer wheel
+typedef struct {
+    struct sockaddr_in addr;
+    int binary;
+} HelloTarget;
+
+// Log-linear latency histogram in nanoseconds (see histogram_bucket)
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+// Counters kept by one worker and only summed when stats are requested
+typedef struct {
+    Histogram latency[OP_COUNT];  // Time spent decoding and handling each command
+    Histogram hello_rtt;          // From sending a hello to handling its response
+    uint64_t malformed;
+    uint64_t duplicates;          // Retransmissions answered from the reply cache
+    LockStats locks[LOCK_COUNT];
+} WorkerStats;
+
+// Reply to a state-changing binary request. A retransmission of the request
+// gets this reply again instead of being applied a second time.
+typedef struct {
+    struct sockaddr_in addr;
+    uint32_t request_id;
+    uint8_t opcode;
+    time_t stored;
+    size_t len;  // 0 while the request is being handled
+    char data[PAGE_BYTES];
+} CachedReply;
+
+// Per-worker state: each worker owns a SO_REUSEPORT socket on server_port
+typedef struct {
+    int sockfd;
+    DatagramBatch rx;
+    DatagramBatch tx;
+    unsigned long epoch;  // Epoch at which the current snapshot was taken, 0 when idle
+    WorkerStats stats;
+    // A client address always hashes to the same SO_REUSEPORT socket, so its
+    // retransmissions reach the worker that cached the reply
+    CachedReply* reply_cache;
+    CachedReply* recording;  // Entry that takes the reply being handled, or NULL
+    // Stats report built for the first page of the last scrape, so that all its
+    // pages show the same moment
+    ByteBuffer stats_report;
+    struct sockaddr_in stats_addr;
+    time_t stats_built;
+} Worker;
+
+Worker* workers = NULL;
+int worker_count = 0;
+int server_port = PORT;
+int log_level = LEVEL_INFO;
+
+// Counters of the hello and publisher threads, each written by one thread only
+LockStats hello_lock_stats[LOCK_COUNT];
+LockStats publisher_lock_stats[LOCK_COUNT];
+LockStats main_lock_stats[LOCK_COUNT];
+// Lock counters of the calling thread: its worker's or one of the arrays above
+__thread LockStats* thread_lock_stats = main_lock_stats;
+uint64_t hellos_sent = 0;
+uint64_t users_expired = 0;
+uint64_t snapshots_published = 0;
+uint64_t snapshot_build_ns = 0;  // Time the last snapshot took to build and publish
+
+// Sharding, enabled with -s: the servers in shard_map split the resource
+// names between them and this one owns the names that map to self_shard.
+// Every shard keeps the full user directory; clients register with all of them.
+ShardMap shard_map;
+int self_shard = -1;
+int hello_interval = DEFAULT_HELLO_INTERVAL;
+int hello_timeout = DEFAULT_HELLO_TIMEOUT;
+
+// Liveness timer wheel: each active user sits in the slot of its next hello,
+// so a tick only looks at the users that are actually due
+UserDirectoryEntry* timer_wheel[WHEEL_SLOTS];
+unsigned long wheel_position = 0;  // Slot processed by the next tick
+pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Snapshot publication. Writers set publish_pending; the publisher thread
+// rebuilds current_snapshot and keeps replaced ones on retired_snapshots until
+// every worker has moved past their retire epoch.
+DirectorySnapshot* current_snapshot = NULL;
+DirectorySnapshot* retired_snapshots = NULL;
+unsigned long global_epoch = 1;
+int publish_pending = 0;
+pthread_mutex_t publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t publish_cond = PTHREAD_COND_INITIALIZER;
+
+// Persistence, enabled with -d. Every directory change is appended to
+// <state_dir>/directory.<generation>.log, and compaction writes the whole
+// directory to directory.snap and starts the next generation. Changes are
+// queued in log_pending and written before the directory lock is dropped, so
+// the log is only touched by a thread that keeps every writer out.
+const char* state_dir = NULL;
+int log_fd = -1;
+unsigned long log_generation = 1;
+size_t log_bytes = 0;
+ByteBuffer log_pending;
+int compact_pending = 0;  // Set when the log has grown enough; protected by publish_mutex
+
+// Function to write a log line if its level is enabled
+void log_at(int level, const char* format, ...) {
+    if (level > log_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Function to find the histogram bucket of a value: exact below 16, then 16
+// buckets per power of two, so every bucket is within 1/16 of its values
+int histogram_bucket(uint64_t value) {
+    if (value < 16) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_BUCKETS / 16 + 2) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return (exponent - 3) * 16 + ((value >> (exponent - 4)) & 15);
+}
+
+// Function to find the largest value that falls into a bucket
+uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int exponent = bucket / 16 + 3;
+    uint64_t width = 1ull << (exponent - 4);
+    return (16 + bucket % 16) * width + width - 1;
+}
+
+// Function to record a value. Each histogram has a single writer, so plain
+// additions published with relaxed stores are enough for a concurrent reader.
+void histogram_record(Histogram* histogram, uint64_t value) {
+    int bucket = histogram_bucket(value);
+    __atomic_store_n(&histogram->counts[bucket], histogram->counts[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->total, histogram->total + 1, __ATOMIC_RELAXED);
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to add one histogram into another
+void histogram_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+// Function to estimate a quantile as the upper limit of the bucket it falls in
+uint64_t histogram_quantile(const Histogram* histogram, double quantile) {
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += histogram->counts[i];
+    }
+    uint64_t rank = (uint64_t)(quantile * total), seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return 0;
+}
+
+// Function to bump a counter that only one thread writes
+void counter_add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+// Functions to take and release a directory lock, counting in the calling
+// thread's LockStats how often and how long it had to wait
+void lock_shared(DirectoryLock* lock) {
+    LockStats* stats = &thread_lock_stats[lock->index];
+    if (pthread_rwlock_tryrdlock(&lock->rwlock) != 0) {
+        uint64_t start = monotonic_ns();
+        pthread_rwlock_rdlock(&lock->rwlock);
+        counter_add(&stats->contended, 1);
+        counter_add(&stats->wait_ns, monotonic_ns() - start);
+    }
+    counter_add(&stats->acquisitions, 1);
+}
+
+void lock_exclusive(DirectoryLock* lock) {
+    LockStats* stats = &thread_lock_stats[lock->index];
+    if (pthread_rwlock_trywrlock(&lock->rwlock) != 0) {
+        uint64_t start = monotonic_ns();
+        pthread_rwlock_wrlock(&lock->rwlock);
+        counter_add(&stats->contended, 1);
+        counter_add(&stats->wait_ns, monotonic_ns() - start);
+    }
+    counter_add(&stats->acquisitions, 1);
+}
+
+void lock_release(DirectoryLock* lock) {
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+// Function to add one thread's counters for a lock into a total
+void lock_stats_merge(LockStats* total, LockStats* stats) {
+    total->acquisitions += __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED);
+    total->contended += __atomic_load_n(&stats->contended, __ATOMIC_RELAXED);
+    total->wait_ns += __atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED);
+}
+
+// FNV-1a hash of a resource name
+unsigned int hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash of a UDP address (ip, port)
+unsigned int hash_addr(struct sockaddr_in addr) {
+    unsigned int hash = ntohl(addr.sin_addr.s_addr) * 2654435761u;
+    return hash ^ (ntohs(addr.sin_port) * 40503u);
+}
+
+// Function to tell whether two UDP addresses are the same (ip and port)
+int same_addr(struct sockaddr_in a, struct sockaddr_in b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// Function to find a user by name; caller must hold user_lock
+UserDirectoryEntry* find_user(const char* username) {
+    if (user_bucket_count == 0) {
+        return NULL;
+    }
+    unsigned int hash = hash_name(username);
+    UserDirectoryEntry* user = user_name_buckets[hash & (user_bucket_count - 1)];
+    for (; user != NULL; user = user->name_next) {
+        if (user->name_hash == hash && strcmp(user->username, username) == 0) {
+            return user;
+        }
+    }
+    return NULL;
+}
+
+// Function to find a user by UDP address; caller must hold user_lock
+UserDirectoryEntry* find_user_by_addr(struct sockaddr_in addr) {
+    if (user_bucket_count == 0) {
+        return NULL;
+    }
+    unsigned int hash = hash_addr(addr);
+    UserDirectoryEntry* user = user_addr_buckets[hash & (user_bucket_count - 1)];
+    for (; user != NULL; user = user->addr_next) {
+        if (same_addr(user->addr, addr)) {
+            return user;
+        }
+    }
+    return NULL;
+}
+
+// Function to link a user into the address index; caller must hold user_lock exclusively
+void user_addr_insert(UserDirectoryEntry* user) {
+    UserDirectoryEntry** head = &user_addr_buckets[user->addr_hash & (user_bucket_count - 1)];
+    user->addr_next = *head;
+    *head = user;
+}
+
+// Function to unlink a user from the address index; caller must hold user_lock exclusively
+void user_addr_remove(UserDirectoryEntry* user) {
+    UserDirectoryEntry** link = &user_addr_buckets[user->addr_hash & (user_bucket_count - 1)];
+    while (*link != user) {
+        link = &(*link)->addr_next;
+    }
+    *link = user->addr_next;
+}
+
+// Function to double both user indexes; caller must hold user_lock exclusively
+int grow_user_buckets() {
+    unsigned int new_count = user_bucket_count ? user_bucket_count * 2 : USER_BUCKETS_INITIAL;
+    UserDirectoryEntry** new_name_buckets = calloc(new_count, sizeof(UserDirectoryEntry*));
+    UserDirectoryEntry** new_addr_buckets = calloc(new_count, sizeof(UserDirectoryEntry*));
+    if (new_name_buckets == NULL || new_addr_buckets == NULL) {
+        free(new_name_buckets);
+        free(new_addr_buckets);
+        return -1;
+    }
+    free(user_name_buckets);
+    free(user_addr_buckets);
+    user_name_buckets = new_name_buckets;
+    user_addr_buckets = new_addr_buckets;
+    user_bucket_count = new_count;
+    for (int i = 0; i < user_count; i++) {
+        UserDirectoryEntry* user = user_entries[i];
+        UserDirectoryEntry** head = &user_name_buckets[user->name_hash & (new_count - 1)];
+        user->name_next = *head;
+        *head = user;
+        user_addr_insert(user);
+    }
+    return 0;
+}
+
+// Function to put a user in the timer wheel so it is visited after delay_ms.
+// Does nothing if the user is already scheduled.
+void schedule_hello(UserDirectoryEntry* user, int delay_ms) {
+    int ticks = delay_ms / WHEEL_TICK_MS;
+    if (ticks < 1) {
+        ticks = 1;
+    }
+    pthread_mutex_lock(&wheel_mutex);
+    if (!user->timer_scheduled) {
+        UserDirectoryEntry** slot = &timer_wheel[(wheel_position + ticks - 1) % WHEEL_SLOTS];
+        user->timer_rounds = (ticks - 1) / WHEEL_SLOTS;
+        user->timer_next = *slot;
+        *slot = user;
+        user->timer_scheduled = 1;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Function to ask the publisher thread for a fresh snapshot after a write
+void request_publish() {
+    pthread_mutex_lock(&publish_mutex);
+    publish_pending = 1;
+    pthread_cond_signal(&publish_cond);
+    pthread_mutex_unlock(&publish_mutex);
+}
+
+// Function to checksum a log record payload (FNV-1a)
+uint32_t checksum_bytes(const uint8_t* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to append bytes to a buffer, growing it as needed. Returns -1 if
+// memory is exhausted.
+int buffer_append(ByteBuffer* buffer, const void* data, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (new_capacity < buffer->len + len) {
+            new_capacity *= 2;
+        }
+        uint8_t* new_data = realloc(buffer->data, new_capacity);
+        if (new_data == NULL) {
+            return -1;
+        }
+        buffer->data = new_data;
+        buffer->capacity = new_capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+// Function to checksum a finished log record and append it to buffer
+int log_record_end(ProtoWriter* writer, ByteBuffer* buffer) {
+    size_t len = proto_finish(writer);
+    if (len == 0) {
+        return -1;
+    }
+    proto_patch_u32(writer, 4, checksum_bytes(writer->data + PROTO_HEADER_SIZE, len - PROTO_HEADER_SIZE));
+    return buffer_append(buffer, writer->data, len);
+}
+
+int encode_user(ByteBuffer* buffer, UserDirectoryEntry* user) {
+    uint8_t frame[LOG_RECORD_BYTES];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), LOG_USER, STATUS_OK, 0);
+    proto_put_str(&writer, user->username);
+    proto_put_u32(&writer, ntohl(user->addr.sin_addr.s_addr));
+    proto_put_u16(&writer, ntohs(user->addr.sin_port));
+    proto_put_u16(&writer, user->tcp_port);
+    proto_put_u8(&writer, user->binary);
+    return log_record_end(&writer, buffer);
+}
+
+// Function to encode a resource record; content is NULL for LOG_REMOVE
+int encode_resource(ByteBuffer* buffer, uint8_t type, const char* owner, const char* resource_name,
+                    const ResourceContent* content) {
+    uint8_t frame[LOG_RECORD_BYTES];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), type, STATUS_OK, 0);
+    proto_put_str(&writer, owner);
+    proto_put_str(&writer, resource_name);
+    if (content != NULL) {
+        proto_put_u64(&writer, content->size);
+        proto_put_u64(&writer, content->hash);
+    }
+    return log_record_end(&writer, buffer);
+}
+
+int encode_expire(ByteBuffer* buffer, const char* username) {
+    uint8_t frame[LOG_RECORD_BYTES];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), LOG_EXPIRE, STATUS_OK, 0);
+    proto_put_str(&writer, username);
+    return log_record_end(&writer, buffer);
+}
+
+// Functions to queue a directory change for the log when persistence is on
+void persist_user(UserDirectoryEntry* user) {
+    if (log_fd >= 0 && encode_user(&log_pending, user) < 0) {
+        log_at(LEVEL_ERROR, "Failed to log registration of %s.\n", user->username);
+    }
+}
+
+void persist_resource(uint8_t type, const char* owner, const char* resource_name, const ResourceContent* content) {
+    if (log_fd >= 0 && encode_resource(&log_pending, type, owner, resource_name, content) < 0) {
+        log_at(LEVEL_ERROR, "Failed to log resource %s of %s.\n", resource_name, owner);
+    }
+}
+
+void persist_expire(const char* username) {
+    if (log_fd >= 0 && encode_expire(&log_pending, username) < 0) {
+        log_at(LEVEL_ERROR, "Failed to log expiry of %s.\n", username);
+    }
+}
+
+// Function to append the queued records to the log and ask for a compaction
+// once it grows past LOG_COMPACT_BYTES; caller must hold user_lock or
+// resource_lock exclusively
+void persist_flush() {
+    size_t written = 0;
+    while (log_fd >= 0 && written < log_pending.len) {
+        ssize_t n = write(log_fd, log_pending.data + written, log_pending.len - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("Failed to write directory log");
+            break;
+        }
+        written += n;
+    }
+    log_pending.len = 0;
+    log_bytes += written;
+    if (log_bytes > LOG_COMPACT_BYTES) {
+        pthread_mutex_lock(&publish_mutex);
+        compact_pending = 1;
+        pthread_cond_signal(&publish_cond);
+        pthread_mutex_unlock(&publish_mutex);
+    }
+}
+
+// Function to add user to directory. A username that is already known is
+// re-registered in place; it may only move to another address once its entry
+// has expired, so the owner checks on announces and withdrawals cannot be passed
+// by registering the name again. Returns 0 on success, -1 if the directory is
+// full or memory is exhausted, -2 if the name is in use from another address.
+int add_user(const char* username, struct sockaddr_in addr, int tcp_port, int binary) {
+    int result = 0;
+    lock_exclusive(&user_lock);
+    UserDirectoryEntry* user = find_user(username);
+    if (user != NULL && user->status != 0 && !same_addr(user->addr, addr)) {
+        result = -2;
+        goto out;
+    }
+    if (user != NULL) {
+        user_addr_remove(user);
+    } else {
+        if (user_count >= MAX_CLIENTS) {
+            result = -1;
+            goto out;
+        }
+        if ((user_count + 1) * 4 > (int)user_bucket_count * 3 && grow_user_buckets() < 0) {
+            result = -1;
+            goto out;
+        }
+        if (user_count == user_capacity) {
+            int new_capacity = user_capacity ? user_capacity * 2 : USER_BUCKETS_INITIAL;
+            UserDirectoryEntry** new_entries = realloc(user_entries, new_capacity * sizeof(UserDirectoryEntry*));
+            if (new_entries == NULL) {
+                result = -1;
+                goto out;
+            }
+            user_entries = new_entries;
+            user_capacity = new_capacity;
+        }
+        user = calloc(1, sizeof(UserDirectoryEntry));
+        if (user == NULL) {
+            result = -1;
+            goto out;
+        }
+        snprintf(user->username, sizeof(user->username), "%s", username);
+        user->name_hash = hash_name(username);
+        UserDirectoryEntry** head = &user_name_buckets[user->name_hash & (user_bucket_count - 1)];
+        user->name_next = *head;
+        *head = user;
+        user_entries[user_count++] = user;
+    }
+    user->addr = addr;
+    user->addr_hash = hash_addr(addr);
+    user_addr_insert(user);
+    user->status = 1;  // active
+    user->last_response = time(NULL);  // initial time
+    user->tcp_port = tcp_port; // store tcp port
+    user->binary = binary;
+    schedule_hello(user, hello_interval * 1000);
+    persist_user(user);
+    persist_flush();
+out:
+    lock_release(&user_lock);
+    if (result == 0) {
+        request_publish();
+    }
+    return result;
+}
+
+// Function to link an entry into its hash bucket; caller must hold resource_lock exclusively
+void bucket_insert(ResourceDirectoryEntry* entry) {
+    ResourceDirectoryEntry** head = &resource_buckets[entry->hash & (resource_bucket_count - 1)];
+    entry->bucket_prev = NULL;
+    entry->bucket_next = *head;
+    if (*head != NULL) {
+        (*head)->bucket_prev = entry;
+    }
+    *head = entry;
+}
+
+// Function to double the hash table once it gets too full; caller must hold resource_lock exclusively
+int grow_resource_buckets() {
+    unsigned int new_count = resource_bucket_count ? resource_bucket_count * 2 : RESOURCE_BUCKETS_INITIAL;
+    ResourceDirectoryEntry** new_buckets = calloc(new_count, sizeof(ResourceDirectoryEntry*));
+    if (new_buckets == NULL) {
+        return -1;
+    }
+    free(resource_buckets);
+    resource_buckets = new_buckets;
+    resource_bucket_count = new_count;
+    for (int i = 0; i < resource_slots; i++) {
+        if (resource_entries[i] != NULL) {
+            bucket_insert(resource_entries[i]);
+        }
+    }
+    return 0;
+}
+
+// Function to close the holes left in resource_entries by removed entries,
+// keeping the order of the rest; caller must hold resource_lock exclusively
+void compact_resource_entries() {
+    int live = 0;
+    for (int i = 0; i < resource_slots; i++) {
+        ResourceDirectoryEntry* entry = resource_entries[i];
+        if (entry != NULL) {
+            entry->list_index = live;
+            resource_entries[live++] = entry;
+        }
+    }
+    resource_slots = live;
+    if (next_resource_id == INT_MAX) {
+        // Ids ran out: number the entries again from 1, in the same order
+        for (int i = 0; i < live; i++) {
+            resource_entries[i]->id = i + 1;
+        }
+        next_resource_id = live + 1;
+    }
+}
+
+// Function to collect the trigrams of a lowercased literal. A literal that
+// starts the name is prefixed with two start markers and one that ends it is
+// followed by an end marker, so prefixes and suffixes are indexed too.
+// Duplicates are dropped. Returns the number of trigrams written to out.
+int extract_trigrams(const char* text, size_t text_len, int at_start, int at_end, uint32_t* out, int max) {
+    unsigned char padded[MAX_TRIGRAMS + 3];
+    size_t len = 0;
+    if (at_start) {
+        padded[len++] = TRIGRAM_START;
+        padded[len++] = TRIGRAM_START;
+    }
+    for (size_t i = 0; i < text_len && len < MAX_TRIGRAMS; i++) {
+        padded[len++] = tolower((unsigned char)text[i]);
+    }
+    if (at_end) {
+        padded[len++] = TRIGRAM_END;
+    }
+    int count = 0;
+    for (size_t i = 0; i + 3 <= len && count < max; i++) {
+        uint32_t trigram = (uint32_t)padded[i] << 16 | (uint32_t)padded[i + 1] << 8 | padded[i + 2];
+        int seen = 0;
+        for (int j = 0; j < count && !seen; j++) {
+            seen = out[j] == trigram;
+        }
+        if (!seen) {
+            out[count++] = trigram;
+        }
+    }
+    return count;
+}
+
+// Function to find the posting list of a trigram, optionally creating it;
+// caller must hold resource_lock (exclusively when create is set)
+PostingList* find_posting(uint32_t trigram, int create) {
+    unsigned int hash = trigram * 2654435761u;
+    if (posting_bucket_count > 0) {
+        PostingList* posting = posting_buckets[hash & (posting_bucket_count - 1)];
+        for (; posting != NULL; posting = posting->next) {
+            if (posting->trigram == trigram) {
+                return posting;
+            }
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if ((posting_count + 1) * 4 > (int)posting_bucket_count * 3) {
+        unsigned int new_count = posting_bucket_count ? posting_bucket_count * 2 : SEARCH_BUCKETS_INITIAL;
+        PostingList** new_buckets = calloc(new_count, sizeof(PostingList*));
+        if (new_buckets == NULL) {
+            return NULL;
+        }
+        for (unsigned int i = 0; i < posting_bucket_count; i++) {
+            PostingList* posting = posting_buckets[i];
+            while (posting != NULL) {
+                PostingList* next = posting->next;
+                PostingList** head = &new_buckets[(posting->trigram * 2654435761u) & (new_count - 1)];
+                posting->next = *head;
+                *head = posting;
+                posting = next;
+            }
+        }
+        free(posting_buckets);
+        posting_buckets = new_buckets;
+        posting_bucket_count = new_count;
+    }
+    PostingList* posting = calloc(1, sizeof(PostingList));
+    if (posting == NULL) {
+        return NULL;
+    }
+    posting->trigram = trigram;
+    PostingList** head = &posting_buckets[hash & (posting_bucket_count - 1)];
+    posting->next = *head;
+    *head = posting;
+    posting_count++;
+    return posting;
+}
+
+// Function to drop a name from one posting list in O(1) by moving the last
+// name into its slot; caller must hold resource_lock exclusively
+void posting_remove(PostingList* posting, int position) {
+    ResourceName* last = posting->names[--posting->count];
+    posting->names[position] = last;
+    for (int j = 0; j < last->trigram_count; j++) {
+        if (last->trigrams[j] == posting->trigram) {
+            last->positions[j] = position;
+            break;
+        }
+    }
+}
+
+// Function to add a new distinct name to the search index; caller must hold
+// resource_lock exclusively. Returns -1 if memory is exhausted.
+int index_name(ResourceName* record) {
+    uint32_t trigrams[MAX_TRIGRAMS];
+    int count = extract_trigrams(record->name, strlen(record->name), 1, 1, trigrams, MAX_TRIGRAMS);
+    if (resource_name_count == resource_name_capacity) {
+        int new_capacity = resource_name_capacity ? resource_name_capacity * 2 : RESOURCE_BUCKETS_INITIAL;
+        ResourceName** new_names = realloc(resource_names, new_capacity * sizeof(ResourceName*));
+        if (new_names == NULL) {
+            return -1;
+        }
+        resource_names = new_names;
+        resource_name_capacity = new_capacity;
+    }
+    record->trigrams = malloc(count * sizeof(uint32_t));
+    record->positions = malloc(count * sizeof(int));
+    if (count > 0 && (record->trigrams == NULL || record->positions == NULL)) {
+        free(record->trigrams);
+        free(record->positions);
+        return -1;
+    }
+    record->trigram_count = 0;
+    for (int i = 0; i < count; i++) {
+        PostingList* posting = find_posting(trigrams[i], 1);
+        if (posting != NULL && posting->count == posting->capacity) {
+            int new_capacity = posting->capacity ? posting->capacity * 2 : 4;
+            ResourceName** new_names = realloc(posting->names, new_capacity * sizeof(ResourceName*));
+            if (new_names == NULL) {
+                posting = NULL;
+            } else {
+                posting->names = new_names;
+                posting->capacity = new_capacity;
+            }
+        }
+        if (posting == NULL) {
+            // Undo the postings added so far
+            for (int j = 0; j < record->trigram_count; j++) {
+                posting_remove(find_posting(record->trigrams[j], 0), record->positions[j]);
+            }
+            free(record->trigrams);
+            free(record->positions);
+            return -1;
+        }
+        record->trigrams[record->trigram_count] = trigrams[i];
+        record->positions[record->trigram_count++] = posting->count;
+        posting->names[posting->count++] = record;
+    }
+    record->list_index = resource_name_count;
+    resource_names[resource_name_count++] = record;
+    return 0;
+}
+
+// Function to remove a name whose last owner went away from the search index;
+// caller must hold resource_lock exclusively
+void unindex_name(ResourceName* record) {
+    for (int i = 0; i < record->trigram_count; i++) {
+        posting_remove(find_posting(record->trigrams[i], 0), record->positions[i]);
+    }
+    ResourceName* last = resource_names[--resource_name_count];
+    resource_names[record->list_index] = last;
+    last->list_index = record->list_index;
+    free(record->trigrams);
+    free(record->positions);
+}
+
+// Function to find the shared record of a name that already has an owner;
+// caller must hold resource_lock
+ResourceName* find_resource_name(const char* resource_name, unsigned int hash) {
+    if (resource_bucket_count == 0) {
+        return NULL;
+    }
+    ResourceDirectoryEntry* entry = resource_buckets[hash & (resource_bucket_count - 1)];
+    for (; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->name->name, resource_name) == 0) {
+            return entry->name;
+        }
+    }
+    return NULL;
+}
+
+// Function to find the resource entry for a given name and owner; caller must hold resource_lock exclusively
+ResourceDirectoryEntry* find_resource(const char* resource_name, unsigned int hash, UserDirectoryEntry* owner) {
+    if (resource_bucket_count == 0) {
+        return NULL;
+    }
+    ResourceDirectoryEntry* entry = resource_buckets[hash & (resource_bucket_count - 1)];
+    for (; entry != NULL; entry = entry->bucket_next) {
+        if (entry->owner == owner && entry->hash == hash && strcmp(entry->name->name, resource_name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Function to add a resource owned by user unless it is already listed with
+// the same content; caller must hold user_lock shared and resource_lock
+// exclusively. Returns 1 if an entry was added or its content changed, 0 if it
+// already existed, -1 if memory is exhausted.
+int add_resource_locked(const char* resource_name, UserDirectoryEntry* user, const ResourceContent* content) {
+    unsigned int hash = hash_name(resource_name);
+    ResourceDirectoryEntry* existing = find_resource(resource_name, hash, user);
+    if (existing != NULL) {
+        if (existing->content.size == content->size && existing->content.hash == content->hash) {
+            return 0;
+        }
+        // The owner's file changed under the same name
+        user->manifest_digest -= proto_manifest_entry_hash(resource_name, existing->content.size, existing->content.hash);
+        user->manifest_digest += proto_manifest_entry_hash(resource_name, content->size, content->hash);
+        existing->content = *content;
+        persist_resource(LOG_ADD, user->username, resource_name, content);
+        return 1;
+    }
+    if ((resource_count + 1) * 4 > (int)resource_bucket_count * 3 && grow_resource_buckets() < 0) {
+        return -1;
+    }
+    if (next_resource_id == INT_MAX || (resource_slots == resource_capacity && resource_count * 2 <= resource_slots)) {
+        compact_resource_entries();
+    }
+    if (resource_slots == resource_capacity) {
+        int new_capacity = resource_capacity ? resource_capacity * 2 : RESOURCE_BUCKETS_INITIAL;
+        ResourceDirectoryEntry** new_list = realloc(resource_entries, new_capacity * sizeof(ResourceDirectoryEntry*));
+        if (new_list == NULL) {
+            return -1;
+        }
+        resource_entries = new_list;
+        resource_capacity = new_capacity;
+    }
+    ResourceDirectoryEntry* entry = malloc(sizeof(ResourceDirectoryEntry));
+    if (entry == NULL) {
+        return -1;
+    }
+    ResourceName* record = find_resource_name(resource_name, hash);
+    if (record == NULL) {
+        // First owner of this name: add it to the search index
+        record = calloc(1, sizeof(ResourceName));
+        if (record != NULL) {
+            snprintf(record->name, sizeof(record->name), "%s", resource_name);
+        }
+        if (record == NULL || index_name(record) < 0) {
+            free(record);
+            free(entry);
+            return -1;
+        }
+    }
+    record->owner_count++;
+    entry->name = record;
+    entry->owner = user;
+    entry->content = *content;
+    // Link into the name's chain
+    entry->name_prev = NULL;
+    entry->name_next = record->entries;
+    if (record->entries != NULL) {
+        record->entries->name_prev = entry;
+    }
+    record->entries = entry;
+    entry->hash = hash;
+    bucket_insert(entry);
+    // Link into the owner's chain
+    entry->owner_prev = NULL;
+    entry->owner_next = user->resources;
+    if (user->resources != NULL) {
+        user->resources->owner_prev = entry;
+    }
+    user->resources = entry;
+    user->resource_count++;
+    user->manifest_digest += proto_manifest_entry_hash(resource_name, content->size, content->hash);
+    entry->id = next_resource_id++;
+    entry->list_index = resource_slots;
+    resource_entries[resource_slots++] = entry;
+    resource_count++;
+    persist_resource(LOG_ADD, user->username, resource_name, content);
+    return 1;
+}
+
+// Function to add resource to directory. Only the owner's registered address
+// may announce. Returns 0 on success, -1 if the owner is unknown, the sender is
+// not the owner or memory is exhausted.
+int add_resource(const char* resource_name, const char* owner, struct sockaddr_in addr, const ResourceContent* content) {
+    int result = -1;
+    // The owner chain is protected by resource_lock, so the user table is only read here
+    lock_shared(&user_lock);
+    lock_exclusive(&resource_lock);
+    UserDirectoryEntry* user = find_user(owner);
+    if (user != NULL && same_addr(user->addr, addr)) {
+        result = add_resource_locked(resource_name, user, content);
+        persist_flush();
+    }
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (result > 0) {
+        request_publish();
+    }
+    return result < 0 ? -1 : 0;
+}
+
+// Function to read the next resource name of a request: the names of a bulk
+// frame in turn, or the single name of a text request. The announced content
+// is stored in content unless it is NULL. Returns -1 when done.
+int next_request_name(Request* req, char* out, size_t out_size, ResourceContent* content) {
+    ResourceContent announced = { 0, 0 };
+    if (req->names_read == req->name_count) {
+        return -1;
+    }
+    req->names_read++;
+    int result = 0;
+    if (!req->binary) {
+        snprintf(out, out_size, "%s", req->resource_name);
+        announced = req->content;
+    } else {
+        result = proto_get_str(&req->name_list, out, out_size);
+        if (req->names_have_content) {
+            announced.size = proto_get_u64(&req->name_list);
+            announced.hash = proto_get_u64(&req->name_list);
+        }
+    }
+    if (content != NULL) {
+        *content = announced;
+    }
+    return result;
+}
+
+// Function to add every resource name carried by a request under one lock
+// acquisition. Like withdrawals, only the owner's registered address may
+// announce. Returns the number of entries added, or -1 if the owner is unknown,
+// the sender is not the owner or memory is exhausted. Names added before memory
+// ran out are kept and published; announcing them again changes nothing.
+int add_resources(const char* owner, struct sockaddr_in addr, Request* req) {
+    int added = 0, failed = 0;
+    char resource_name[100];
+    ResourceContent content;
+    lock_shared(&user_lock);
+    lock_exclusive(&resource_lock);
+    UserDirectoryEntry* user = find_user(owner);
+    if (user == NULL || !same_addr(user->addr, addr)) {
+        failed = 1;
+    }
+    while (!failed && next_request_name(req, resource_name, sizeof(resource_name), &content) == 0) {
+        int result = add_resource_locked(resource_name, user, &content);
+        if (result < 0) {
+            failed = 1;
+        } else {
+            added += result;
+        }
+    }
+    persist_flush();
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (added > 0) {
+        request_publish();
+    }
+    return failed ? -1 : added;
+}
+
+// Function to unlink and free one resource entry in O(1); caller must hold
+// resource_lock exclusively
+void remove_resource_entry(ResourceDirectoryEntry* entry) {
+    if (entry->bucket_prev != NULL) {
+        entry->bucket_prev->bucket_next = entry->bucket_next;
+    } else {
+        resource_buckets[entry->hash & (resource_bucket_count - 1)] = entry->bucket_next;
+    }
+    if (entry->bucket_next != NULL) {
+        entry->bucket_next->bucket_prev = entry->bucket_prev;
+    }
+    resource_entries[entry->list_index] = NULL;  // Closed by the next compaction
+    resource_count--;
+    if (entry->owner_prev != NULL) {
+        entry->owner_prev->owner_next = entry->owner_next;
+    } else {
+        entry->owner->resources = entry->owner_next;
+    }
+    if (entry->owner_next != NULL) {
+        entry->owner_next->owner_prev = entry->owner_prev;
+    }
+    entry->owner->resource_count--;
+    entry->owner->manifest_digest -= proto_manifest_entry_hash(entry->name->name, entry->content.size,
+                                                               entry->content.hash);
+    if (entry->name_prev != NULL) {
+        entry->name_prev->name_next = entry->name_next;
+    } else {
+        entry->name->entries = entry->name_next;
+    }
+    if (entry->name_next != NULL) {
+        entry->name_next->name_prev = entry->name_prev;
+    }
+    if (--entry->name->owner_count == 0) {
+        unindex_name(entry->name);
+        free(entry->name);
+    }
+    free(entry);
+}
+
+// Function to withdraw every resource a user owns by walking its owner chain;
+// caller must hold user_lock and resource_lock exclusively
+void remove_user_resources(UserDirectoryEntry* user) {
+    while (user->resources != NULL) {
+        remove_resource_entry(user->resources);
+    }
+}
+
+// Function to withdraw the resource names carried by a request. Only the
+// owner's registered address may withdraw its resources. Returns the number of
+// entries removed, or -1 if the owner is unknown or the sender is not the owner.
+int withdraw_resources(const char* owner, struct sockaddr_in addr, Request* req) {
+    int removed = 0;
+    char resource_name[100];
+    lock_shared(&user_lock);
+    lock_exclusive(&resource_lock);
+    UserDirectoryEntry* user = find_user(owner);
+    if (user == NULL || !same_addr(user->addr, addr)) {
+        removed = -1;
+    }
+    while (removed >= 0 && next_request_name(req, resource_name, sizeof(resource_name), NULL) == 0) {
+        ResourceDirectoryEntry* entry = find_resource(resource_name, hash_name(resource_name), user);
+        if (entry != NULL) {
+            persist_resource(LOG_REMOVE, user->username, resource_name, NULL);
+            remove_resource_entry(entry);
+            removed++;
+        }
+    }
+    persist_flush();
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (removed > 0) {
+        request_publish();
+    }
+    return removed;
+}
+
+// Function to map a whole file read-only. Returns -1 if it cannot be opened;
+// an empty file maps to NULL with size 0.
+int map_file(const char* path, uint8_t** data, size_t* size) {
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            *data = map;
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to read the record at *offset of a mapped log. Returns 0 and
+// advances *offset, or -1 at the end of the data or at a torn or corrupt record.
+int next_log_record(const uint8_t* data, size_t size, size_t* offset, ProtoReader* reader, ProtoHeader* header) {
+    if (size - *offset < PROTO_HEADER_SIZE) {
+        return -1;
+    }
+    const uint8_t* record = data + *offset;
+    size_t len = PROTO_HEADER_SIZE + (record[8] << 8 | record[9]);
+    if (len > size - *offset || proto_reader_init(reader, header, record, len) < 0 ||
+        checksum_bytes(record + PROTO_HEADER_SIZE, len - PROTO_HEADER_SIZE) != header->request_id) {
+        return -1;
+    }
+    *offset += len;
+    return 0;
+}
+
+// Function to read the next intact record like next_log_record, skipping a
+// damaged record followed by intact ones. The damaged record's length prefix is
+// tried first, then every later byte; the checksum tells when a record is found
+// again. Each skipped record is counted in *skipped. Returns -1 at the end of the
+// data, with *offset left on the torn or damaged tail if there is one.
+int read_log_record(const uint8_t* data, size_t size, size_t* offset, ProtoReader* reader, ProtoHeader* header,
+                    int* skipped) {
+    if (next_log_record(data, size, offset, reader, header) == 0) {
+        return 0;
+    }
+    size_t damaged = *offset;
+    if (size - damaged >= PROTO_HEADER_SIZE) {
+        *offset = damaged + PROTO_HEADER_SIZE + (data[damaged + 8] << 8 | data[damaged + 9]);
+        if (*offset < size && next_log_record(data, size, offset, reader, header) == 0) {
+            (*skipped)++;
+            return 0;
+        }
+    }
+    for (size_t probe = damaged + 1; probe < size; probe++) {
+        *offset = probe;
+        if (data[probe] == PROTO_MAGIC && next_log_record(data, size, offset, reader, header) == 0) {
+            (*skipped)++;
+            return 0;
+        }
+    }
+    *offset = damaged;
+    return -1;
+}
+
+// Function to apply one log record while the directory is being restored.
+// Runs before any other thread is started.
+void apply_log_record(ProtoReader* reader, ProtoHeader* header) {
+    char username[50], resource_name[100];
+    proto_get_str(reader, username, sizeof(username));
+    if (header->opcode == LOG_USER) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(proto_get_u32(reader));
+        addr.sin_port = htons(proto_get_u16(reader));
+        int tcp_port = proto_get_u16(reader);
+        int binary = proto_get_u8(reader);
+        UserDirectoryEntry* known = find_user(username);
+        if (!reader->error) {
+            if (known != NULL) {
+                known->status = 0;  // Only accepted registrations were logged, so a move is replayed as it was
+            }
+            add_user(username, addr, tcp_port, binary);
+        }
+    } else if (header->opcode == LOG_ADD) {
+        if (proto_get_str(reader, resource_name, sizeof(resource_name)) == 0) {
+            ResourceContent content = { 0, 0 };
+            if (reader->pos < reader->len) {
+                content.size = proto_get_u64(reader);
+                content.hash = proto_get_u64(reader);
+            }
+            UserDirectoryEntry* user = find_user(username);
+            if (!reader->error && user != NULL) {
+                add_resource_locked(resource_name, user, &content);
+            }
+        }
+    } else if (header->opcode == LOG_REMOVE || header->opcode == LOG_EXPIRE) {
+        if (header->opcode == LOG_REMOVE && proto_get_str(reader, resource_name, sizeof(resource_name)) < 0) {
+            return;
+        }
+        UserDirectoryEntry* user = find_user(username);
+        if (user == NULL) {
+            return;
+        }
+        if (header->opcode == LOG_EXPIRE) {
+            user->status = 0;
+            remove_user_resources(user);
+        } else {
+            ResourceDirectoryEntry* entry = find_resource(resource_name, hash_name(resource_name), user);
+            if (entry != NULL) {
+                remove_resource_entry(entry);
+            }
+        }
+    }
+}
+
+// Function to format the path of the log of one generation
+void log_path(char* out, size_t size, unsigned long generation) {
+    snprintf(out, size, "%s/directory.%lu.log", state_dir, generation);
+}
+
+// Function to restore the directory from state_dir: the snapshot is mapped
+// and applied, then the logs written since it are replayed. Users that come
+// back are marked unconfirmed until they answer a hello. Afterwards the last
+// log is opened for appending. Returns -1 if the state cannot be used.
+int load_directory() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create state directory");
+        return -1;
+    }
+    char path[PATH_MAX];
+    uint8_t* data;
+    size_t size, offset = 0;
+    ProtoReader reader;
+    ProtoHeader header;
+    unsigned long generation = 1;
+    int skipped = 0;
+
+    snprintf(path, sizeof(path), "%s/directory.snap", state_dir);
+    if (map_file(path, &data, &size) == 0) {
+        if (next_log_record(data, size, &offset, &reader, &header) == 0 && header.opcode == LOG_SNAPSHOT_BEGIN) {
+            generation = proto_get_u32(&reader);
+            while (read_log_record(data, size, &offset, &reader, &header, &skipped) == 0 &&
+                   header.opcode != LOG_SNAPSHOT_END) {
+                apply_log_record(&reader, &header);
+            }
+        }
+        if (skipped > 0) {
+            log_at(LEVEL_WARN, "Skipped %d damaged record(s) in %s.\n", skipped, path);
+        }
+        if (header.opcode != LOG_SNAPSHOT_END) {
+            log_at(LEVEL_WARN, "Snapshot %s is incomplete; restoring what it holds.\n", path);
+        }
+        munmap(data, size);
+    }
+
+    // A compaction that did not finish leaves more than one log behind
+    log_generation = generation;
+    for (;; generation++) {
+        log_path(path, sizeof(path), generation);
+        if (map_file(path, &data, &size) < 0) {
+            break;
+        }
+        offset = 0;
+        skipped = 0;
+        while (read_log_record(data, size, &offset, &reader, &header, &skipped) == 0) {
+            apply_log_record(&reader, &header);
+        }
+        if (skipped > 0) {
+            log_at(LEVEL_WARN, "Skipped %d damaged record(s) in %s.\n", skipped, path);
+        }
+        if (offset < size) {
+            log_at(LEVEL_WARN, "Dropping %zu bytes of a torn record at the end of %s.\n", size - offset, path);
+            if (truncate(path, offset) < 0) {
+                perror("Failed to truncate directory log");
+            }
+        }
+        if (data != NULL) {
+            munmap(data, size);
+        }
+        log_generation = generation;
+    }
+
+    log_path(path, sizeof(path), log_generation);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        perror("Failed to open directory log");
+        return -1;
+    }
+    struct stat st;
+    log_bytes = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+
+    int restored = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < user_count; i++) {
+        if (__atomic_load_n(&user_entries[i]->status, __ATOMIC_RELAXED) == 1) {
+            __atomic_store_n(&user_entries[i]->status, 2, __ATOMIC_RELAXED);  // unconfirmed until its next hello response
+            user_entries[i]->last_response = now;
+            restored++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_at(LEVEL_INFO, "Restored %d user(s) and %d resource(s) from %s in %.1f ms.\n", restored, resource_count, state_dir,
+           (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+// Function to write the whole directory to a new snapshot and start the next
+// log generation. The image is built and the log switched under shared locks,
+// which keeps every writer out; the file is written after they are dropped.
+// Returns -1 on failure, in which case the current log stays in use.
+int compact_directory() {
+    ByteBuffer image = { NULL, 0, 0 };
+    uint8_t frame[LOG_RECORD_BYTES];
+    ProtoWriter writer;
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    int failed = 0;
+
+    lock_shared(&user_lock);
+    lock_shared(&resource_lock);
+    unsigned long generation = log_generation + 1;
+    proto_writer_init(&writer, frame, sizeof(frame), LOG_SNAPSHOT_BEGIN, STATUS_OK, 0);
+    proto_put_u32(&writer, generation);
+    failed |= log_record_end(&writer, &image);
+    for (int i = 0; i < user_count && !failed; i++) {
+        // Hello responses set status under the shared lock too
+        if (__atomic_load_n(&user_entries[i]->status, __ATOMIC_RELAXED) != 0) {
+            failed |= encode_user(&image, user_entries[i]);
+        }
+    }
+    for (int i = 0; i < resource_slots && !failed; i++) {
+        ResourceDirectoryEntry* entry = resource_entries[i];
+        if (entry == NULL) {
+            continue;
+        }
+        failed |= encode_resource(&image, LOG_ADD, entry->owner->username, entry->name->name, &entry->content);
+    }
+    proto_writer_init(&writer, frame, sizeof(frame), LOG_SNAPSHOT_END, STATUS_OK, 0);
+    failed |= log_record_end(&writer, &image);
+    int new_fd = -1;
+    if (!failed) {
+        log_path(path, sizeof(path), generation);
+        new_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    }
+    if (new_fd >= 0) {
+        fsync(log_fd);
+        close(log_fd);
+        log_fd = new_fd;
+        log_generation = generation;
+        log_bytes = 0;
+    }
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (new_fd < 0) {
+        perror("Failed to start a new directory log");
+        free(image.data);
+        return -1;
+    }
+
+    // Replace the snapshot atomically; until the rename, the old snapshot and
+    // both logs still describe the directory
+    snprintf(path, sizeof(path), "%s/directory.snap", state_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/directory.snap.tmp", state_dir);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t written = 0;
+    while (fd >= 0 && written < image.len) {
+        ssize_t n = write(fd, image.data + written, image.len - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    free(image.data);
+    if (fd < 0 || written < image.len || fsync(fd) < 0 || rename(tmp_path, path) < 0) {
+        perror("Failed to write directory snapshot");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    log_path(path, sizeof(path), generation - 1);
+    unlink(path);
+    return 0;
+}
+
+// Function to free a snapshot and all its arrays
+void free_snapshot(DirectorySnapshot* snapshot) {
+    free(snapshot->users);
+    free(snapshot->names);
+    free(snapshot->resources);
+    free(snapshot->listing);
+    free(snapshot->name_table);
+    free(snapshot->postings);
+    free(snapshot->posting_names);
+    free(snapshot);
+}
+
+// Function to size an open-addressed table: a power of two at least twice count
+unsigned int snapshot_table_size(int count) {
+    unsigned int size = 16;
+    while (size < (unsigned int)count * 2) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Function to order resources by content hash, then size, for qsort
+int compare_resource_content(const void* a, const void* b) {
+    const ResourceContent* left = &((const SnapshotResource*)a)->content;
+    const ResourceContent* right = &((const SnapshotResource*)b)->content;
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    if (left->size != right->size) {
+        return left->size < right->size ? -1 : 1;
+    }
+    return 0;
+}
+
+// Function to copy the directory into a new immutable snapshot. Caller must
+// hold user_lock and resource_lock shared. Returns NULL if memory is exhausted.
+DirectorySnapshot* build_snapshot() {
+    DirectorySnapshot* snapshot = calloc(1, sizeof(DirectorySnapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    int posting_name_total = 0;
+    for (int i = 0; i < resource_name_count; i++) {
+        posting_name_total += resource_names[i]->trigram_count;
+    }
+    snapshot->name_table_size = snapshot_table_size(resource_name_count);
+    snapshot->posting_table_size = snapshot_table_size(posting_count);
+    snapshot->users = malloc((user_count + 1) * sizeof(SnapshotUser));
+    snapshot->names = malloc((resource_name_count + 1) * sizeof(SnapshotName));
+    snapshot->resources = malloc((resource_count + 1) * sizeof(SnapshotResource));
+    snapshot->listing = malloc((resource_count + 1) * sizeof(SnapshotListing));
+    snapshot->name_table = calloc(snapshot->name_table_size, sizeof(int));
+    snapshot->postings = calloc(snapshot->posting_table_size, sizeof(SnapshotPosting));
+    snapshot->posting_names = malloc((posting_name_total + 1) * sizeof(int));
+    if (snapshot->users == NULL || snapshot->names == NULL || snapshot->resources == NULL || snapshot->listing == NULL ||
+        snapshot->name_table == NULL || snapshot->postings == NULL || snapshot->posting_names == NULL) {
+        free_snapshot(snapshot);
+        return NULL;
+    }
+
+    for (int i = 0; i < user_count; i++) {
+        UserDirectoryEntry* user = user_entries[i];
+        if (__atomic_load_n(&user->status, __ATOMIC_RELAXED) == 0) {
+            user->snapshot_index = -1;
+            continue;
+        }
+        SnapshotUser* copy = &snapshot->users[snapshot->user_count];
+        memcpy(copy->username, user->username, sizeof(copy->username));
+        copy->addr = user->addr;
+        copy->tcp_port = user->tcp_port;
+        copy->position = i;
+        user->snapshot_index = snapshot->user_count++;
+    }
+
+    unsigned int name_mask = snapshot->name_table_size - 1;
+    for (int i = 0; i < resource_name_count; i++) {
+        ResourceName* record = resource_names[i];
+        SnapshotName* copy = &snapshot->names[snapshot->name_count];
+        memcpy(copy->name, record->name, sizeof(copy->name));
+        copy->hash = hash_name(record->name);
+        copy->first_resource = snapshot->resource_count;
+        for (ResourceDirectoryEntry* entry = record->entries; entry != NULL; entry = entry->name_next) {
+            if (entry->owner->snapshot_index < 0) {
+                continue;
+            }
+            SnapshotResource* resource = &snapshot->resources[snapshot->resource_count++];
+            resource->name = snapshot->name_count;
+            resource->owner = entry->owner->snapshot_index;
+            resource->content = entry->content;
+        }
+        copy->resource_count = snapshot->resource_count - copy->first_resource;
+        // Owners holding the same content are listed together, so a download
+        // can take every source of one version from consecutive rows
+        qsort(&snapshot->resources[copy->first_resource], copy->resource_count, sizeof(SnapshotResource),
+              compare_resource_content);
+        unsigned int slot = copy->hash & name_mask;
+        while (snapshot->name_table[slot] != 0) {
+            slot = (slot + 1) & name_mask;
+        }
+        snapshot->name_table[slot] = ++snapshot->name_count;
+    }
+
+    // Names are at the same position in resource_names and in the snapshot
+    for (int i = 0; i < resource_slots; i++) {
+        ResourceDirectoryEntry* entry = resource_entries[i];
+        if (entry == NULL || entry->owner->snapshot_index < 0) {
+            continue;
+        }
+        SnapshotListing* row = &snapshot->listing[snapshot->listing_count++];
+        row->id = entry->id;
+        row->name = entry->name->list_index;
+        row->owner = entry->owner->snapshot_index;
+    }
+
+    // Posting lists refer to names by their position, which is the same in
+    // resource_names and in the snapshot
+    unsigned int posting_mask = snapshot->posting_table_size - 1;
+    int offset = 0;
+    for (unsigned int b = 0; b < posting_bucket_count; b++) {
+        for (PostingList* posting = posting_buckets[b]; posting != NULL; posting = posting->next) {
+            if (posting->count == 0) {
+                continue;
+            }
+            unsigned int slot = (posting->trigram * 2654435761u) & posting_mask;
+            while (snapshot->postings[slot].count != 0) {
+                slot = (slot + 1) & posting_mask;
+            }
+            snapshot->postings[slot].trigram = posting->trigram;
+            snapshot->postings[slot].offset = offset;
+            snapshot->postings[slot].count = posting->count;
+            for (int j = 0; j < posting->count; j++) {
+                snapshot->posting_names[offset++] = posting->names[j]->list_index;
+            }
+        }
+    }
+    return snapshot;
+}
+
+// Function to build a snapshot of the directory and make it the current one.
+// The snapshot it replaces is retired. Returns -1 if memory is exhausted.
+int publish_snapshot() {
+    lock_shared(&user_lock);
+    lock_shared(&resource_lock);
+    DirectorySnapshot* snapshot = build_snapshot();
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (snapshot == NULL) {
+        log_at(LEVEL_ERROR, "Failed to build directory snapshot.\n");
+        return -1;
+    }
+    DirectorySnapshot* old = __atomic_exchange_n(&current_snapshot, snapshot, __ATOMIC_SEQ_CST);
+    counter_add(&snapshots_published, 1);
+    if (old != NULL) {
+        // Readers that can still see old took their epoch before this increment
+        old->retire_epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+        old->retired_next = retired_snapshots;
+        retired_snapshots = old;
+    }
+    return 0;
+}
+
+// Function to free the retired snapshots that no worker can still be reading
+void reclaim_snapshots() {
+    unsigned long oldest = ULONG_MAX;
+    for (int i = 0; i < worker_count; i++) {
+        unsigned long epoch = __atomic_load_n(&workers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    DirectorySnapshot** link = &retired_snapshots;
+    while (*link != NULL) {
+        DirectorySnapshot* snapshot = *link;
+        if (snapshot->retire_epoch < oldest) {
+            *link = snapshot->retired_next;
+            free_snapshot(snapshot);
+        } else {
+            link = &snapshot->retired_next;
+        }
+    }
+}
+
+// Function to pin the current snapshot for the duration of one request
+DirectorySnapshot* snapshot_acquire(Worker* worker) {
+    __atomic_store_n(&worker->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+}
+
+// Function to unpin the snapshot taken by snapshot_acquire
+void snapshot_release(Worker* worker) {
+    __atomic_store_n(&worker->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Function to find a name in a snapshot. Returns NULL if it has no owner.
+SnapshotName* snapshot_find_name(DirectorySnapshot* snapshot, const char* resource_name) {
+    unsigned int hash = hash_name(resource_name);
+    unsigned int mask = snapshot->name_table_size - 1;
+    for (unsigned int slot = hash & mask; snapshot->name_table[slot] != 0; slot = (slot + 1) & mask) {
+        SnapshotName* name = &snapshot->names[snapshot->name_table[slot] - 1];
+        if (name->hash == hash && strcmp(name->name, resource_name) == 0) {
+            return name;
+        }
+    }
+    return NULL;
+}
+
+// Function to find the posting list of a trigram in a snapshot
+SnapshotPosting* snapshot_find_posting(DirectorySnapshot* snapshot, uint32_t trigram) {
+    unsigned int mask = snapshot->posting_table_size - 1;
+    for (unsigned int slot = (trigram * 2654435761u) & mask; snapshot->postings[slot].count != 0; slot = (slot + 1) & mask) {
+        if (snapshot->postings[slot].trigram == trigram) {
+            return &snapshot->postings[slot];
+        }
+    }
+    return NULL;
+}
+
+// Function to pick the candidates for a glob pattern: the shortest posting
+// list among the trigrams its literal parts require, as indexes into the
+// snapshot's names. Sets *candidates to NULL and returns -1 when the pattern
+// has no usable trigram, in which case every name is a candidate.
+int search_candidates(DirectorySnapshot* snapshot, const char* pattern, int** candidates) {
+    uint32_t trigrams[MAX_TRIGRAMS];
+    char literal[MAX_TRIGRAMS];
+    size_t literal_len = 0;
+    int literal_at_start = 1;
+    SnapshotPosting* best = NULL;
+    int have_trigram = 0;
+
+    *candidates = NULL;
+    for (size_t i = 0;; i++) {
+        char c = pattern[i];
+        int wildcard = c == '*' || c == '?' || c == '[';
+        if (c == '\0' || wildcard) {
+            int count = extract_trigrams(literal, literal_len, literal_at_start, c == '\0', trigrams, MAX_TRIGRAMS);
+            for (int j = 0; j < count; j++) {
+                SnapshotPosting* posting = snapshot_find_posting(snapshot, trigrams[j]);
+                if (posting == NULL) {
+                    return 0;  // A required trigram occurs nowhere, so nothing matches
+                }
+                if (best == NULL || posting->count < best->count) {
+                    best = posting;
+                }
+                have_trigram = 1;
+            }
+            if (c == '\0') {
+                break;
+            }
+            if (c == '[') {
+                // Skip the bracket expression; fnmatch checks it later
+                while (pattern[i + 1] != '\0' && pattern[i + 1] != ']') {
+                    i++;
+                }
+                if (pattern[i + 1] == ']') {
+                    i++;
+                }
+            }
+            literal_len = 0;
+            literal_at_start = 0;
+            continue;
+        }
+        if (c == '\\' && pattern[i + 1] != '\0') {
+            c = pattern[++i];
+        }
+        if (literal_len < sizeof(literal)) {
+            literal[literal_len++] = c;
+        }
+    }
+    if (!have_trigram) {
+        return -1;
+    }
+    *candidates = snapshot->posting_names + best->offset;
+    return best->count;
+}
+
+// Thread function to publish a new snapshot after writes and to compact the
+// directory log. Bursts of writes between two snapshots are folded into one.
+// A snapshot copies the whole directory, so the gap grows with the time the
+// last one took: building costs at most about 1/PUBLISH_COST_RATIO of a core,
+// and of the writers' time under the shared locks, however busy the directory.
+void* publisher_thread(void* arg) {
+    long gap_ms = PUBLISH_INTERVAL_MS;
+    thread_lock_stats = publisher_lock_stats;
+    while (1) {
+        pthread_mutex_lock(&publish_mutex);
+        while (!publish_pending && !compact_pending && retired_snapshots == NULL) {
+            pthread_cond_wait(&publish_cond, &publish_mutex);
+        }
+        int pending = publish_pending, compact = compact_pending;
+        publish_pending = 0;
+        compact_pending = 0;
+        pthread_mutex_unlock(&publish_mutex);
+        if (pending) {
+            uint64_t start = monotonic_ns();
+            if (publish_snapshot() < 0) {
+                request_publish();  // Try again on the next round
+            }
+            uint64_t elapsed = monotonic_ns() - start;
+            __atomic_store_n(&snapshot_build_ns, elapsed, __ATOMIC_RELAXED);
+            gap_ms = elapsed * PUBLISH_COST_RATIO / 1000000;
+            gap_ms = gap_ms < PUBLISH_INTERVAL_MS ? PUBLISH_INTERVAL_MS
+                   : gap_ms > PUBLISH_MAX_INTERVAL_MS ? PUBLISH_MAX_INTERVAL_MS : gap_ms;
+        }
+        if (compact && compact_directory() < 0) {
+            log_at(LEVEL_ERROR, "Directory compaction failed; will retry when the log grows.\n");
+        }
+        reclaim_snapshots();
+        usleep(gap_ms * 1000);
+    }
+    return NULL;
+}
+
+// Function to send every datagram queued in a batch
+void flush_batch(int sockfd, DatagramBatch* batch) {
+    int sent = 0;
+    while (sent < batch->count) {
+        int n = sendmmsg(sockfd, batch->msgs + sent, batch->count - sent, 0);
+        if (n <= 0) {
+            perror("sendmmsg failed");
+            break;
+        }
+        sent += n;
+    }
+    batch->count = 0;
+}
+
+// Function to queue a datagram; the batch is flushed when it fills up
+void queue_datagram(int sockfd, DatagramBatch* tx, struct sockaddr_in addr, const char* data, size_t len) {
+    if (tx->count == BATCH_SIZE) {
+        flush_batch(sockfd, tx);
+    }
+    int i = tx->count++;
+    if (len > BUFFER_SIZE) {
+        len = BUFFER_SIZE;
+    }
+    memcpy(tx->buffers[i], data, len);
+    tx->addrs[i] = addr;
+    tx->iovecs[i].iov_base = tx->buffers[i];
+    tx->iovecs[i].iov_len = len;
+    memset(&tx->msgs[i], 0, sizeof(tx->msgs[i]));
+    tx->msgs[i].msg_hdr.msg_name = &tx->addrs[i];
+    tx->msgs[i].msg_hdr.msg_namelen = sizeof(tx->addrs[i]);
+    tx->msgs[i].msg_hdr.msg_iov = &tx->iovecs[i];
+    tx->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// Function to queue a reply on a worker's socket
+void queue_reply(Worker* worker, struct sockaddr_in addr, const char* data, size_t len) {
+    if (worker->recording != NULL && len <= PAGE_BYTES) {
+        memcpy(worker->recording->data, data, len);
+        worker->recording->len = len;
+        worker->recording = NULL;
+    }
+    queue_datagram(worker->sockfd, &worker->tx, addr, data, len);
+}
+
+// Function to find the reply cache entry of a request. Returns the entry with
+// its reply if the request was already handled, or claims the slot for it and
+// returns NULL.
+CachedReply* find_cached_reply(Worker* worker, struct sockaddr_in addr, uint32_t request_id, uint8_t opcode) {
+    uint32_t hash = (addr.sin_addr.s_addr ^ (uint32_t)addr.sin_port << 16 ^ request_id) * 2654435761u;
+    CachedReply* entry = &worker->reply_cache[hash % REPLY_CACHE_SLOTS];
+    time_t now = time(NULL);
+    if (entry->len > 0 && entry->request_id == request_id && entry->opcode == opcode &&
+        same_addr(entry->addr, addr) &&
+        now - entry->stored <= REPLY_CACHE_TTL_SEC) {
+        return entry;
+    }
+    entry->addr = addr;
+    entry->request_id = request_id;
+    entry->opcode = opcode;
+    entry->stored = now;
+    entry->len = 0;
+    worker->recording = entry;
+    return NULL;
+}
+
+// Function to append a formatted row to a page. Returns -1 and leaves the page
+// unchanged if the row does not fit.
+int page_append(PageBuffer* page, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(page->data + page->len, PAGE_BYTES - page->len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= PAGE_BYTES - page->len) {
+        page->data[page->len] = '\0';
+        return -1;
+    }
+    page->len += n;
+    page->rows++;
+    return 0;
+}
+
+// Function to read the optional "<cursor> <page_size>" arguments of a query
+void parse_page_args(const char* args, int* cursor, int* page_rows) {
+    *cursor = 0;
+    *page_rows = DEFAULT_PAGE_ROWS;
+    sscanf(args, "%d %d", cursor, page_rows);
+    if (*cursor < 0) {
+        *cursor = 0;
+    }
+    if (*page_rows < 1 || *page_rows > MAX_PAGE_ROWS) {
+        *page_rows = MAX_PAGE_ROWS;
+    }
+}
+
+// Function to mark a user inactive and withdraw its resources;
+// caller must hold user_lock and resource_lock exclusively
+void expire_user(UserDirectoryEntry* user) {
+    log_at(LEVEL_INFO, "User %s has disconnected.\n", user->username);
+    user->status = 0;  // mark as inactive
+    remove_user_resources(user);
+    persist_expire(user->username);
+}
+
+// Function to process one timer wheel slot: ping the users that are due and
+// still responsive, and expire the ones whose last response is too old.
+// The hellos are sent in sendmmsg batches after the directory lock is dropped.
+void process_hello_tick(int sockfd, DatagramBatch* batch) {
+    static UserDirectoryEntry** due = NULL;
+    static HelloTarget* ping_targets = NULL;
+    static int due_capacity = 0;
+    int due_count = 0, ping_count = 0, expired_count = 0;
+    time_t now = time(NULL);
+
+    // Detach every user whose timer fires on this tick
+    pthread_mutex_lock(&wheel_mutex);
+    UserDirectoryEntry** link = &timer_wheel[wheel_position % WHEEL_SLOTS];
+    wheel_position++;
+    while (*link != NULL) {
+        UserDirectoryEntry* user = *link;
+        if (user->timer_rounds > 0) {
+            user->timer_rounds--;
+            link = &user->timer_next;
+            continue;
+        }
+        if (due_count == due_capacity) {
+            int new_capacity = due_capacity ? due_capacity * 2 : BATCH_SIZE;
+            UserDirectoryEntry** new_due = realloc(due, new_capacity * sizeof(UserDirectoryEntry*));
+            HelloTarget* new_targets = realloc(ping_targets, new_capacity * sizeof(HelloTarget));
+            if (new_due != NULL) {
+                due = new_due;
+            }
+            if (new_targets != NULL) {
+                ping_targets = new_targets;
+            }
+            if (new_due == NULL || new_targets == NULL) {
+                break;  // Leave the rest in the slot for the next turn
+            }
+            due_capacity = new_capacity;
+        }
+        *link = user->timer_next;
+        user->timer_scheduled = 0;
+        due[due_count++] = user;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+    if (due_count == 0) {
+        return;
+    }
+
+    // Sort the due users into pings and expiries; expired ones are kept at the front of due
+    lock_shared(&user_lock);
+    for (int i = 0; i < due_count; i++) {
+        UserDirectoryEntry* user = due[i];
+        if (__atomic_load_n(&user->status, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        if (now - __atomic_load_n(&user->last_response, __ATOMIC_RELAXED) <= hello_timeout) {
+            __atomic_store_n(&user->hello_sent_ns, monotonic_ns(), __ATOMIC_RELAXED);
+            ping_targets[ping_count].addr = user->addr;
+            ping_targets[ping_count++].binary = user->binary;
+            schedule_hello(user, hello_interval * 1000);
+        } else {
+            due[expired_count++] = user;
+        }
+    }
+    lock_release(&user_lock);
+
+    if (expired_count > 0) {
+        lock_exclusive(&user_lock);
+        lock_exclusive(&resource_lock);
+        for (int i = 0; i < expired_count; i++) {
+            UserDirectoryEntry* user = due[i];
+            // The user may have answered or re-registered in the meantime
+            if (user->status != 0 && now - user->last_response > hello_timeout) {
+                expire_user(user);
+                counter_add(&users_expired, 1);
+            } else if (user->status != 0) {
+                schedule_hello(user, hello_interval * 1000);
+            }
+        }
+        persist_flush();
+        lock_release(&resource_lock);
+        lock_release(&user_lock);
+        request_publish();
+    }
+
+    char hello_message[] = "hello";
+    uint8_t hello_frame[PROTO_HEADER_SIZE];
+    ProtoWriter writer;
+    proto_writer_init(&writer, hello_frame, sizeof(hello_frame), OP_HELLO, STATUS_OK, 0);
+    size_t hello_frame_len = proto_finish(&writer);
+    for (int i = 0; i < ping_count; i++) {
+        if (ping_targets[i].binary) {
+            queue_datagram(sockfd, batch, ping_targets[i].addr, (char*)hello_frame, hello_frame_len);
+        } else {
+            queue_datagram(sockfd, batch, ping_targets[i].addr, hello_message, strlen(hello_message));
+        }
+    }
+    flush_batch(sockfd, batch);
+    counter_add(&hellos_sent, ping_count);
+}
+
+// Function to tell whether this server owns a resource name
+int owns_name(const char* resource_name) {
+    return self_shard < 0 || shard_for_name(&shard_map, resource_name) == self_shard;
+}
+
+// Function to find this server in the shard map: the entry on server_port
+// whose address can be bound locally. Returns its index, or -1.
+int find_self_shard() {
+    for (int i = 0; i < shard_map.count; i++) {
+        if (ntohs(shard_map.nodes[i].sin_port) != server_port) {
+            continue;
+        }
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in probe = shard_map.nodes[i];
+        probe.sin_port = 0;
+        int local = sockfd >= 0 && bind(sockfd, (struct sockaddr*)&probe, sizeof(probe)) == 0;
+        if (sockfd >= 0) {
+            close(sockfd);
+        }
+        if (local) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-// Structure for resource directory entry
-typedef struct {
-    char resource_name[100];
-    char owner[50];
-} ResourceDirectoryEntry;
-
-UserDirectoryEntry user_directory[MAX_CLIENTS];
-ResourceDirectoryEntry resource_directory[MAX_CLIENTS * 10]; // Increased size to hold more resources
-int user_count = 0, resource_count = 0;
-
-// Mutexes for thread synchronization
-pthread_mutex_t user_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t resource_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Function to add user to directory
-void add_user(const char* username, struct sockaddr_in addr, int tcp_port) {
-    pthread_mutex_lock(&user_mutex);
-    strcpy(user_directory[user_count].username, username);
-    user_directory[user_count].addr = addr;
-    user_directory[user_count].status = 1;  // active
-    user_directory[user_count].last_response = time(NULL);  // initial time
-    user_directory[user_count].tcp_port = tcp_port; // store tcp port
-    user_count++;
-    pthread_mutex_unlock(&user_mutex);
-}
-
-// Function to add resource to directory
-void add_resource(const char* resource_name, const char* owner) {
-    pthread_mutex_lock(&resource_mutex);
-    strcpy(resource_directory[resource_count].resource_name, resource_name);
-    strcpy(resource_directory[resource_count].owner, owner);
-    resource_count++;
-    pthread_mutex_unlock(&resource_mutex);
+// Function to answer a request with a status and a message. Text clients get
+// the message itself; binary clients get a frame that carries it unless the
+// status is STATUS_OK.
+void send_status(Worker* worker, struct sockaddr_in addr, Request* req, uint8_t status, const char* message) {
+    if (!req->binary) {
+        queue_reply(worker, addr, message, strlen(message));
+        return;
+    }
+    uint8_t frame[BUFFER_SIZE];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), req->opcode, status, req->request_id);
+    if (status != STATUS_OK) {
+        proto_put_str(&writer, message);
+    }
+    size_t frame_len = proto_finish(&writer);
+    if (frame_len > 0) {
+        queue_reply(worker, addr, (char*)frame, frame_len);
+    }
 }
 
-// Function to send hello messages to clients
-void send_hello_messages(int sockfd) {
-    char hello_message[] = "hello";
-    pthread_mutex_lock(&user_mutex);
-    for (int i = 0; i < user_count; i++) {
-        if (user_directory[i].status == 1) {
-            sendto(sockfd, hello_message, strlen(hello_message), 0,
-                   (struct sockaddr*)&user_directory[i].addr, sizeof(user_directory[i].addr));
+// Function to redirect a request for a name owned by another shard
+void send_wrong_shard(Worker* worker, struct sockaddr_in addr, Request* req, const char* resource_name) {
+    char owner[32], message[BUFFER_SIZE];
+    shard_format(&shard_map, shard_for_name(&shard_map, resource_name), owner, sizeof(owner));
+    snprintf(message, sizeof(message), "Error: Resource '%s' belongs to shard %s.", resource_name, owner);
+    send_status(worker, addr, req, STATUS_WRONG_SHARD, message);
+}
+
+// Function to start the reply to a paged query
+void list_begin(ListReply* list, Request* req) {
+    list->req = req;
+    list->rows = 0;
+    list->page.len = 0;
+    list->page.rows = 0;
+    list->page.data[0] = '\0';
+    if (req->binary) {
+        proto_writer_init(&list->writer, list->frame, PAGE_BYTES, req->opcode, STATUS_OK, req->request_id);
+        proto_put_u32(&list->writer, PROTO_END_CURSOR);  // next_cursor, patched by list_send
+        proto_put_u16(&list->writer, 0);                 // row count, patched by list_send
+    }
+}
+
+// Function to accept or roll back a binary row depending on whether it fit
+int list_commit_row(ListReply* list, size_t mark) {
+    if (list->writer.overflow) {
+        list->writer.len = mark;
+        list->writer.overflow = 0;
+        return -1;
+    }
+    list->rows++;
+    return 0;
+}
+
+// Function to add a resource row. Returns -1 if the page is full.
+int list_add_resource(ListReply* list, const char* name, SnapshotUser* owner) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    if (list->req->binary) {
+        size_t mark = list->writer.len;
+        proto_put_str(&list->writer, name);
+        proto_put_str(&list->writer, owner->username);
+        proto_put_u32(&list->writer, ntohl(owner->addr.sin_addr.s_addr));
+        proto_put_u16(&list->writer, owner->tcp_port);
+        return list_commit_row(list, mark);
+    }
+    char owner_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(owner->addr.sin_addr), owner_ip, INET_ADDRSTRLEN);
+    if (page_append(&list->page, "%s (Owner: %s, IP: %s, TCP Port: %d)\n",
+                    name, owner->username, owner_ip, owner->tcp_port) < 0) {
+        return -1;
+    }
+    list->rows++;
+    return 0;
+}
+
+// Function to add a user row. Returns -1 if the page is full.
+int list_add_user(ListReply* list, SnapshotUser* user) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    if (list->req->binary) {
+        size_t mark = list->writer.len;
+        proto_put_str(&list->writer, user->username);
+        return list_commit_row(list, mark);
+    }
+    if (page_append(&list->page, "%s\n", user->username) < 0) {
+        return -1;
+    }
+    list->rows++;
+    return 0;
+}
+
+// Function to add an owner row of get resource_info. The content is sent to
+// version 2 clients and shown in text replies when known. Returns -1 if the
+// page is full.
+int list_add_owner(ListReply* list, SnapshotUser* owner, const ResourceContent* content) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    if (list->req->binary) {
+        size_t mark = list->writer.len;
+        proto_put_str(&list->writer, owner->username);
+        proto_put_u32(&list->writer, ntohl(owner->addr.sin_addr.s_addr));
+        proto_put_u16(&list->writer, owner->tcp_port);
+        if (list->req->version >= 2) {
+            proto_put_u64(&list->writer, content->size);
+            proto_put_u64(&list->writer, content->hash);
         }
+        return list_commit_row(list, mark);
     }
-    pthread_mutex_unlock(&user_mutex);
+    char owner_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(owner->addr.sin_addr), owner_ip, INET_ADDRSTRLEN);
+    int result;
+    if (content->hash != 0) {
+        result = page_append(&list->page, "%s %s %d %llu %016llx\n", owner->username, owner_ip, owner->tcp_port,
+                             (unsigned long long)content->size, (unsigned long long)content->hash);
+    } else {
+        result = page_append(&list->page, "%s %s %d\n", owner->username, owner_ip, owner->tcp_port);
+    }
+    if (result < 0) {
+        return -1;
+    }
+    list->rows++;
+    return 0;
 }
 
-// Function to check client statuses based on hello response timeout
-void check_client_statuses() {
-    time_t current_time = time(NULL);
-    pthread_mutex_lock(&user_mutex);
-    for (int i = 0; i < user_count; i++) {
-        if (user_directory[i].status == 1 && (current_time - user_directory[i].last_response) > HELLO_TIMEOUT) {
-            printf("User %s has disconnected.\n", user_directory[i].username);
-            user_directory[i].status = 0;  // mark as inactive
-            // Remove user's resources
-            pthread_mutex_lock(&resource_mutex);
-            for (int j = 0; j < resource_count; ) {
-                if (strcmp(resource_directory[j].owner, user_directory[i].username) == 0) {
-                    // Shift resources
-                    for (int k = j; k < resource_count - 1; k++) {
-                        resource_directory[k] = resource_directory[k + 1];
-                    }
-                    resource_count--;
-                } else {
-                    j++;
-                }
-            }
-            pthread_mutex_unlock(&resource_mutex);
+// Function to add a row of list_owned, which is binary only: the name, and its
+// content for version 2 clients
+int list_add_owned(ListReply* list, const char* name, const ResourceContent* content) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    size_t mark = list->writer.len;
+    proto_put_str(&list->writer, name);
+    if (list->req->version >= 2) {
+        proto_put_u64(&list->writer, content->size);
+        proto_put_u64(&list->writer, content->hash);
+    }
+    return list_commit_row(list, mark);
+}
+
+// Function to add one line of text, e.g. of the stats report. Returns -1 if the page is full.
+int list_add_line(ListReply* list, const char* line) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    if (list->req->binary) {
+        size_t mark = list->writer.len;
+        proto_put_str(&list->writer, line);
+        return list_commit_row(list, mark);
+    }
+    if (page_append(&list->page, "%s\n", line) < 0) {
+        return -1;
+    }
+    list->rows++;
+    return 0;
+}
+
+// Function to add a search match row. Returns -1 if the page is full.
+int list_add_match(ListReply* list, SnapshotName* name) {
+    if (list->rows == list->req->page_rows) {
+        return -1;
+    }
+    if (list->req->binary) {
+        size_t mark = list->writer.len;
+        proto_put_str(&list->writer, name->name);
+        proto_put_u16(&list->writer, name->resource_count > 0xFFFF ? 0xFFFF : name->resource_count);
+        return list_commit_row(list, mark);
+    }
+    if (page_append(&list->page, "%s (Owners: %d)\n", name->name, name->resource_count) < 0) {
+        return -1;
+    }
+    list->rows++;
+    return 0;
+}
+
+// Function to send a page together with the cursor for the next one; -1 means
+// this was the last page
+void list_send(Worker* worker, struct sockaddr_in addr, ListReply* list, int next_cursor) {
+    if (list->req->binary) {
+        proto_patch_u32(&list->writer, PROTO_HEADER_SIZE, next_cursor < 0 ? PROTO_END_CURSOR : (uint32_t)next_cursor);
+        proto_patch_u16(&list->writer, PROTO_HEADER_SIZE + 4, list->rows);
+        size_t frame_len = proto_finish(&list->writer);
+        queue_reply(worker, addr, (char*)list->frame, frame_len);
+        return;
+    }
+    char message[PAGE_BYTES + 32];
+    int header_len = next_cursor < 0 ? snprintf(message, sizeof(message), "Next: end\n")
+                                     : snprintf(message, sizeof(message), "Next: %d\n", next_cursor);
+    memcpy(message + header_len, list->page.data, list->page.len);
+    queue_reply(worker, addr, message, header_len + list->page.len);
+}
+
+// Text protocol parsers: each receives the text after the command word
+
+int parse_text_register(const char* args, Request* req) {
+    return sscanf(args, "%49s %d", req->username, &req->tcp_port) == 2 ? 0 : -1;
+}
+
+// Function to read "<name> <owner> [<size> <hash in hex>]"
+int parse_text_announce(const char* args, Request* req) {
+    unsigned long long size, hash;
+    int fields = sscanf(args, "%99s %49s %llu %llx", req->resource_name, req->owner, &size, &hash);
+    if (fields == 4) {
+        req->content.size = size;
+        req->content.hash = hash;
+    }
+    return fields == 2 || fields == 4 ? 0 : -1;
+}
+
+int parse_text_withdraw(const char* args, Request* req) {
+    req->name_count = 1;
+    return sscanf(args, "%99s %49s", req->resource_name, req->owner) == 2 ? 0 : -1;
+}
+
+int parse_text_page(const char* args, Request* req) {
+    parse_page_args(args, &req->cursor, &req->page_rows);
+    return 0;
+}
+
+int parse_text_resource_info(const char* args, Request* req) {
+    int consumed = 0;
+    if (sscanf(args, "%99s%n", req->resource_name, &consumed) != 1) {
+        return -1;
+    }
+    parse_page_args(args + consumed, &req->cursor, &req->page_rows);
+    return 0;
+}
+
+int parse_text_search(const char* args, Request* req) {
+    int consumed = 0;
+    if (sscanf(args, "%127s%n", req->pattern, &consumed) != 1) {
+        return -1;
+    }
+    parse_page_args(args + consumed, &req->cursor, &req->page_rows);
+    return 0;
+}
+
+// Binary protocol decoders: each reads the payload fields of its opcode
+
+int decode_register(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->username, sizeof(req->username));
+    req->tcp_port = proto_get_u16(reader);
+    return reader->error ? -1 : 0;
+}
+
+int decode_announce(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->resource_name, sizeof(req->resource_name));
+    proto_get_str(reader, req->owner, sizeof(req->owner));
+    if (req->version >= 2) {
+        req->content.size = proto_get_u64(reader);
+        req->content.hash = proto_get_u64(reader);
+    }
+    return reader->error ? -1 : 0;
+}
+
+// Function to read an owner followed by a counted list of resource names, each
+// with its content in a version 2 bulk announce. The names are checked here
+// and read again by the handler through next_request_name.
+int decode_name_list(ProtoReader* reader, Request* req) {
+    char resource_name[100];
+    proto_get_str(reader, req->owner, sizeof(req->owner));
+    req->name_count = proto_get_u16(reader);
+    req->names_have_content = req->opcode == OP_ANNOUNCE_BULK && req->version >= 2;
+    req->name_list = *reader;
+    for (int i = 0; i < req->name_count && !reader->error; i++) {
+        proto_get_str(reader, resource_name, sizeof(resource_name));
+        if (req->names_have_content) {
+            proto_get_u64(reader);
+            proto_get_u64(reader);
         }
     }
-    pthread_mutex_unlock(&user_mutex);
+    return reader->error ? -1 : 0;
+}
+
+int decode_sync(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->owner, sizeof(req->owner));
+    req->manifest_count = proto_get_u32(reader);
+    req->manifest_digest = proto_get_u64(reader);
+    return reader->error ? -1 : 0;
+}
+
+// Function to read the u32 cursor and u16 page size of a paged query
+int decode_page(ProtoReader* reader, Request* req) {
+    uint32_t cursor = proto_get_u32(reader);
+    req->cursor = cursor > INT_MAX ? INT_MAX : (int)cursor;
+    req->page_rows = proto_get_u16(reader);
+    if (req->page_rows < 1 || req->page_rows > MAX_PAGE_ROWS) {
+        req->page_rows = MAX_PAGE_ROWS;
+    }
+    return reader->error ? -1 : 0;
+}
+
+int decode_resource_info(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->resource_name, sizeof(req->resource_name));
+    return decode_page(reader, req);
+}
+
+int decode_search(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->pattern, sizeof(req->pattern));
+    return decode_page(reader, req);
+}
+
+int decode_list_owned(ProtoReader* reader, Request* req) {
+    proto_get_str(reader, req->owner, sizeof(req->owner));
+    return decode_page(reader, req);
+}
+
+// Command handlers
+
+void handle_negotiate(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    uint8_t frame[PROTO_HEADER_SIZE];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), OP_NEGOTIATE, STATUS_OK, req->request_id);
+    proto_set_version(&writer, req->version < PROTO_VERSION ? req->version : PROTO_VERSION);
+    queue_reply(worker, client_addr, (char*)frame, proto_finish(&writer));
 }
 
-// Function to handle client requests
-void handle_client(int sockfd, struct sockaddr_in client_addr, char* buffer) {
-    if (strncmp(buffer, "register", 8) == 0) {
-        char username[50];
-        int tcp_port;
-        sscanf(buffer, "register %s %d", username, &tcp_port);
-        add_user(username, client_addr, tcp_port);
-        printf("User %s registered with TCP port %d.\n", username, tcp_port);
+void handle_register(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    int result = add_user(req->username, client_addr, req->tcp_port, req->binary);
+    if (result == 0) {
+        log_at(LEVEL_DEBUG, "User %s registered with TCP port %d.\n", req->username, req->tcp_port);
         // Send acknowledgment
-        char ack_message[] = "Registration successful";
-        sendto(sockfd, ack_message, strlen(ack_message), 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-    } else if (strncmp(buffer, "announce", 8) == 0) {
-        char resource_name[100], owner[50];
-        sscanf(buffer, "announce %s %s", resource_name, owner);
-        add_resource(resource_name, owner);
-        printf("Resource %s announced by %s\n", resource_name, owner);
+        send_status(worker, client_addr, req, STATUS_OK, "Registration successful");
+    } else if (result == -2) {
+        send_status(worker, client_addr, req, STATUS_ERROR,
+                    "Registration failed: username is in use from another address until it expires");
+    } else {
+        send_status(worker, client_addr, req, STATUS_ERROR, "Registration failed: user directory is full");
+    }
+}
+
+void handle_announce(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    if (!owns_name(req->resource_name)) {
+        send_wrong_shard(worker, client_addr, req, req->resource_name);
+        return;
+    }
+    if (add_resource(req->resource_name, req->owner, client_addr, &req->content) == 0) {
+        log_at(LEVEL_DEBUG, "Resource %s announced by %s\n", req->resource_name, req->owner);
         // Send acknowledgment
-        char ack_message[] = "Resource announced successfully";
-        sendto(sockfd, ack_message, strlen(ack_message), 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-    } else if (strncmp(buffer, "query resources", 15) == 0) {
-        char resource_list[BUFFER_SIZE] = "";
-        pthread_mutex_lock(&resource_mutex);
-        if (resource_count == 0) {
-            strcpy(resource_list, "No resources available.");
+        send_status(worker, client_addr, req, STATUS_OK, "Resource announced successfully");
+    } else {
+        send_status(worker, client_addr, req, STATUS_ERROR, "Error: Resource could not be announced.");
+    }
+}
+
+// Function to answer a bulk request with the number of names it changed
+void send_count(Worker* worker, struct sockaddr_in client_addr, Request* req, int count) {
+    uint8_t frame[PROTO_HEADER_SIZE + 2];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), req->opcode, STATUS_OK, req->request_id);
+    proto_put_u16(&writer, count);
+    queue_reply(worker, client_addr, (char*)frame, proto_finish(&writer));
+}
+
+void handle_announce_bulk(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // Refuse the whole batch if any name belongs elsewhere; withdrawals are
+    // accepted anywhere so names left behind by a shard change can be cleaned up
+    Request probe = *req;
+    char resource_name[100];
+    while (self_shard >= 0 && next_request_name(&probe, resource_name, sizeof(resource_name), NULL) == 0) {
+        if (!owns_name(resource_name)) {
+            send_wrong_shard(worker, client_addr, req, resource_name);
+            return;
+        }
+    }
+    int added = add_resources(req->owner, client_addr, req);
+    if (added < 0) {
+        send_status(worker, client_addr, req, STATUS_ERROR, "Error: Resources could not be announced.");
+        return;
+    }
+    log_at(LEVEL_DEBUG, "%d of %d resource(s) announced by %s\n", added, req->name_count, req->owner);
+    send_count(worker, client_addr, req, added);
+}
+
+void handle_withdraw(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    int removed = withdraw_resources(req->owner, client_addr, req);
+    if (removed < 0) {
+        send_status(worker, client_addr, req, STATUS_ERROR, "Error: Only the owner can withdraw its resources.");
+        return;
+    }
+    log_at(LEVEL_DEBUG, "%d resource(s) withdrawn by %s\n", removed, req->owner);
+    if (req->binary) {
+        send_count(worker, client_addr, req, removed);
+    } else {
+        send_status(worker, client_addr, req, STATUS_OK, removed ? "Resource withdrawn successfully" : "Error: Resource not found.");
+    }
+}
+
+void handle_sync(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // Compare the client's manifest with what the directory lists for it
+    int found = 0, in_sync = 0;
+    uint32_t count = 0;
+    lock_shared(&user_lock);
+    lock_shared(&resource_lock);
+    UserDirectoryEntry* user = find_user(req->owner);
+    if (user != NULL) {
+        found = 1;
+        count = user->resource_count;
+        in_sync = count == req->manifest_count && user->manifest_digest == req->manifest_digest;
+    }
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    if (!found) {
+        send_status(worker, client_addr, req, STATUS_NOT_FOUND, "Error: Unknown user.");
+        return;
+    }
+    uint8_t frame[PROTO_HEADER_SIZE + 5];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), req->opcode, STATUS_OK, req->request_id);
+    proto_put_u8(&writer, in_sync);
+    proto_put_u32(&writer, count);
+    queue_reply(worker, client_addr, (char*)frame, proto_finish(&writer));
+}
+
+void handle_list_owned(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // The cursor is a position in the owner's chain
+    ListReply list;
+    int next_cursor = -1, position = 0;
+    list_begin(&list, req);
+    lock_shared(&user_lock);
+    lock_shared(&resource_lock);
+    UserDirectoryEntry* user = find_user(req->owner);
+    ResourceDirectoryEntry* entry = user != NULL ? user->resources : NULL;
+    for (; entry != NULL; entry = entry->owner_next, position++) {
+        if (position < req->cursor) {
+            continue;
+        }
+        if (list_add_owned(&list, entry->name->name, &entry->content) < 0) {
+            next_cursor = position;
+            break;
+        }
+    }
+    lock_release(&resource_lock);
+    lock_release(&user_lock);
+    list_send(worker, client_addr, &list, next_cursor);
+}
+
+void handle_shard_map(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    if (!req->binary) {
+        PageBuffer page = { .len = 0, .rows = 0 };
+        page.data[0] = '\0';
+        for (int i = 0; i < shard_map.count; i++) {
+            char node[32];
+            shard_format(&shard_map, i, node, sizeof(node));
+            page_append(&page, "%s\n", node);
+        }
+        if (shard_map.count == 0) {
+            page_append(&page, "Not sharded\n");
+        }
+        queue_reply(worker, client_addr, page.data, page.len);
+        return;
+    }
+    uint8_t frame[PROTO_HEADER_SIZE + 2 + MAX_SHARDS * 6];
+    ProtoWriter writer;
+    proto_writer_init(&writer, frame, sizeof(frame), req->opcode, STATUS_OK, req->request_id);
+    proto_put_u16(&writer, shard_map.count);
+    for (int i = 0; i < shard_map.count; i++) {
+        proto_put_u32(&writer, ntohl(shard_map.nodes[i].sin_addr.s_addr));
+        proto_put_u16(&writer, ntohs(shard_map.nodes[i].sin_port));
+    }
+    queue_reply(worker, client_addr, (char*)frame, proto_finish(&writer));
+}
+
+void handle_query_resources(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // The cursor is the id of the first resource not yet returned. Ids only
+    // grow, so entries added or removed between pages do not shift the rest.
+    ListReply list;
+    int next_cursor = -1;
+    list_begin(&list, req);
+    DirectorySnapshot* snapshot = snapshot_acquire(worker);
+    int low = 0, high = snapshot->listing_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (snapshot->listing[middle].id < req->cursor) {
+            low = middle + 1;
         } else {
-            strcpy(resource_list, "Resources:\n");
-            for (int i = 0; i < resource_count; i++) {
-                char resource_entry[300];
-                // Find the owner's IP address and TCP port
-                char owner_ip[INET_ADDRSTRLEN];
-                int owner_tcp_port = 0;
-                int owner_active = 0;
-                pthread_mutex_lock(&user_mutex);
-                for (int j = 0; j < user_count; j++) {
-                    if (strcmp(user_directory[j].username, resource_directory[i].owner) == 0) {
-                        inet_ntop(AF_INET, &(user_directory[j].addr.sin_addr), owner_ip, INET_ADDRSTRLEN);
-                        owner_tcp_port = user_directory[j].tcp_port;
-                        owner_active = user_directory[j].status;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&user_mutex);
+            high = middle;
+        }
+    }
+    for (int i = low; i < snapshot->listing_count; i++) {
+        SnapshotListing* row = &snapshot->listing[i];
+        if (list_add_resource(&list, snapshot->names[row->name].name, &snapshot->users[row->owner]) < 0) {
+            next_cursor = row->id;
+            break;
+        }
+    }
+    snapshot_release(worker);
+    list_send(worker, client_addr, &list, next_cursor);
+}
 
-                if (owner_active == 1) {
-                    snprintf(resource_entry, sizeof(resource_entry), "%s (Owner: %s, IP: %s, TCP Port: %d)\n",
-                             resource_directory[i].resource_name, resource_directory[i].owner, owner_ip, owner_tcp_port);
-                    strcat(resource_list, resource_entry);
-                }
-            }
-            if (strlen(resource_list) == strlen("Resources:\n")) {
-                strcpy(resource_list, "No resources available.");
-            }
+void handle_query_users(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // The cursor is the user_entries position of the first user not yet
+    // returned; users keep their position for good
+    ListReply list;
+    int next_cursor = -1;
+    list_begin(&list, req);
+    DirectorySnapshot* snapshot = snapshot_acquire(worker);
+    int low = 0, high = snapshot->user_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (snapshot->users[middle].position < req->cursor) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (int i = low; i < snapshot->user_count; i++) {
+        if (list_add_user(&list, &snapshot->users[i]) < 0) {
+            next_cursor = snapshot->users[i].position;
+            break;
+        }
+    }
+    snapshot_release(worker);
+    list_send(worker, client_addr, &list, next_cursor);
+}
+
+void handle_hello_response(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // Only the liveness fields change, so a shared lock plus atomic stores is enough
+    lock_shared(&user_lock);
+    UserDirectoryEntry* user = find_user_by_addr(client_addr);
+    if (user != NULL) {
+        uint64_t sent = __atomic_exchange_n(&user->hello_sent_ns, 0, __ATOMIC_RELAXED);
+        if (sent != 0) {
+            histogram_record(&worker->stats.hello_rtt, monotonic_ns() - sent);
+        }
+        __atomic_store_n(&user->last_response, time(NULL), __ATOMIC_RELAXED);
+        // mark as active; a user that had expired shows up in queries again.
+        // Its timer was dropped when it expired, so it goes back into the wheel.
+        int previous = __atomic_exchange_n(&user->status, 1, __ATOMIC_RELAXED);
+        if (previous == 0) {
+            schedule_hello(user, hello_interval * 1000);
+            request_publish();
+        } else if (previous == 2) {
+            log_at(LEVEL_INFO, "User %s confirmed after restart.\n", user->username);
+        }
+    }
+    lock_release(&user_lock);
+}
+
+void handle_resource_info(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    if (!owns_name(req->resource_name)) {
+        send_wrong_shard(worker, client_addr, req, req->resource_name);
+        return;
+    }
+    // The cursor counts the owners already returned
+    ListReply list;
+    int next_cursor = -1;
+    list_begin(&list, req);
+    DirectorySnapshot* snapshot = snapshot_acquire(worker);
+    SnapshotName* name = snapshot_find_name(snapshot, req->resource_name);
+    int owner_count = name != NULL ? name->resource_count : 0;
+    for (int i = req->cursor; i < owner_count; i++) {
+        SnapshotResource* resource = &snapshot->resources[name->first_resource + i];
+        if (list_add_owner(&list, &snapshot->users[resource->owner], &resource->content) < 0) {
+            next_cursor = i;
+            break;
+        }
+    }
+    snapshot_release(worker);
+    if (req->cursor == 0 && list.rows == 0) {
+        char error_message[BUFFER_SIZE];
+        snprintf(error_message, BUFFER_SIZE, "Error: Resource '%s' not found.", req->resource_name);
+        send_status(worker, client_addr, req, STATUS_NOT_FOUND, error_message);
+    } else {
+        list_send(worker, client_addr, &list, next_cursor);
+    }
+}
+
+void handle_search(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // A pattern without wildcards is a case-insensitive substring search
+    char glob[MAX_TRIGRAMS + 2];
+    if (strpbrk(req->pattern, "*?[") == NULL) {
+        snprintf(glob, sizeof(glob), "*%s*", req->pattern);
+    } else {
+        snprintf(glob, sizeof(glob), "%s", req->pattern);
+    }
+    // The cursor counts the matches already returned
+    ListReply list;
+    int next_cursor = -1, position = 0;
+    list_begin(&list, req);
+    DirectorySnapshot* snapshot = snapshot_acquire(worker);
+    int* candidates;
+    int candidate_count = search_candidates(snapshot, glob, &candidates);
+    if (candidate_count < 0) {
+        candidate_count = snapshot->name_count;
+    }
+    for (int i = 0; i < candidate_count; i++) {
+        SnapshotName* name = &snapshot->names[candidates != NULL ? candidates[i] : i];
+        if (name->resource_count == 0 || fnmatch(glob, name->name, FNM_CASEFOLD) != 0) {
+            continue;
+        }
+        if (position++ < req->cursor) {
+            continue;
+        }
+        if (list_add_match(&list, name) < 0) {
+            next_cursor = position - 1;
+            break;
+        }
+    }
+    snapshot_release(worker);
+    list_send(worker, client_addr, &list, next_cursor);
+}
+
+// Structure describing one command in both protocols
+typedef struct {
+    const char* name;                                    // name used in stats
+    const char* text_command;                            // command word(s) in the text protocol, NULL if binary only
+    int (*parse_text)(const char* args, Request* req);   // NULL if the command takes no arguments
+    int (*decode)(ProtoReader* reader, Request* req);    // NULL if the frame has no payload
+    void (*handle)(Worker* worker, struct sockaddr_in client_addr, Request* req);
+    int cache_reply;                                     // 1 if a retransmission must not be applied twice
+} CommandHandler;
+
+// Dispatch table indexed by opcode, defined after the handlers
+extern const CommandHandler command_table[OP_COUNT];
+
+// Function to append one formatted line of the stats report
+void report_line(ByteBuffer* report, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n > 0 && (size_t)n < sizeof(line)) {
+        buffer_append(report, line, n + 1);  // keep the terminator; lines are split on it later
+    }
+}
+
+// Function to report the count and latency quantiles of a histogram
+void report_histogram(ByteBuffer* report, const char* metric, const char* labels, const Histogram* histogram) {
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    const char* separator = labels[0] ? "," : "";
+    if (labels[0]) {
+        report_line(report, "%s_count{%s} %llu", metric, labels, (unsigned long long)histogram->total);
+        report_line(report, "%s_max{%s} %llu", metric, labels, (unsigned long long)histogram->max);
+    } else {
+        report_line(report, "%s_count %llu", metric, (unsigned long long)histogram->total);
+        report_line(report, "%s_max %llu", metric, (unsigned long long)histogram->max);
+    }
+    for (int i = 0; i < 3; i++) {
+        report_line(report, "%s{%s%squantile=\"%g\"} %llu", metric, labels, separator, quantiles[i],
+                    (unsigned long long)histogram_quantile(histogram, quantiles[i]));
+    }
+}
+
+// Function to build the stats report, one metric per line in the Prometheus
+// text format. Per-worker figures are summed here, so workers never share
+// counters while handling requests.
+void build_stats_report(Worker* worker, ByteBuffer* report) {
+    Histogram* merged = calloc(1, sizeof(Histogram));
+    if (merged == NULL) {
+        return;
+    }
+    uint64_t malformed = 0, duplicates = 0;
+    for (int op = 1; op < OP_COUNT; op++) {
+        memset(merged, 0, sizeof(Histogram));
+        for (int i = 0; i < worker_count; i++) {
+            histogram_merge(merged, &workers[i].stats.latency[op]);
+        }
+        if (merged->total > 0) {
+            char labels[64];
+            snprintf(labels, sizeof(labels), "command=\"%s\"", command_table[op].name);
+            report_histogram(report, "p2p_request_latency_ns", labels, merged);
+        }
+    }
+    memset(merged, 0, sizeof(Histogram));
+    for (int i = 0; i < worker_count; i++) {
+        histogram_merge(merged, &workers[i].stats.hello_rtt);
+        malformed += __atomic_load_n(&workers[i].stats.malformed, __ATOMIC_RELAXED);
+        duplicates += __atomic_load_n(&workers[i].stats.duplicates, __ATOMIC_RELAXED);
+    }
+    report_histogram(report, "p2p_hello_rtt_ns", "", merged);
+    free(merged);
+    report_line(report, "p2p_requests_malformed_total %llu", (unsigned long long)malformed);
+    report_line(report, "p2p_requests_duplicate_total %llu", (unsigned long long)duplicates);
+    report_line(report, "p2p_hellos_sent_total %llu",
+                (unsigned long long)__atomic_load_n(&hellos_sent, __ATOMIC_RELAXED));
+    report_line(report, "p2p_users_expired_total %llu",
+                (unsigned long long)__atomic_load_n(&users_expired, __ATOMIC_RELAXED));
+    report_line(report, "p2p_snapshots_published_total %llu",
+                (unsigned long long)__atomic_load_n(&snapshots_published, __ATOMIC_RELAXED));
+    report_line(report, "p2p_snapshot_build_ns %llu",
+                (unsigned long long)__atomic_load_n(&snapshot_build_ns, __ATOMIC_RELAXED));
+
+    DirectoryLock* locks[LOCK_COUNT] = { &user_lock, &resource_lock };
+    for (int i = 0; i < LOCK_COUNT; i++) {
+        LockStats total = { 0, 0, 0 };
+        lock_stats_merge(&total, &hello_lock_stats[i]);
+        lock_stats_merge(&total, &publisher_lock_stats[i]);
+        lock_stats_merge(&total, &main_lock_stats[i]);
+        for (int w = 0; w < worker_count; w++) {
+            lock_stats_merge(&total, &workers[w].stats.locks[i]);
+        }
+        report_line(report, "p2p_lock_acquisitions_total{lock=\"%s\"} %llu", locks[i]->name,
+                    (unsigned long long)total.acquisitions);
+        report_line(report, "p2p_lock_contended_total{lock=\"%s\"} %llu", locks[i]->name,
+                    (unsigned long long)total.contended);
+        report_line(report, "p2p_lock_wait_ns_total{lock=\"%s\"} %llu", locks[i]->name,
+                    (unsigned long long)total.wait_ns);
+    }
+
+    // Directory sizes come from the current snapshot and the master tables' counters
+    DirectorySnapshot* snapshot = snapshot_acquire(worker);
+    report_line(report, "p2p_users_listed %d", snapshot->user_count);
+    snapshot_release(worker);
+    report_line(report, "p2p_users_registered %d", __atomic_load_n(&user_count, __ATOMIC_RELAXED));
+    report_line(report, "p2p_resources %d", __atomic_load_n(&resource_count, __ATOMIC_RELAXED));
+    report_line(report, "p2p_resource_names %d", __atomic_load_n(&resource_name_count, __ATOMIC_RELAXED));
+    report_line(report, "p2p_trigrams %d", __atomic_load_n(&posting_count, __ATOMIC_RELAXED));
+}
+
+void handle_stats(Worker* worker, struct sockaddr_in client_addr, Request* req) {
+    // The cursor counts the lines already returned. Later pages of a scrape are
+    // cut from the report built for its first page.
+    ByteBuffer* report = &worker->stats_report;
+    time_t now = time(NULL);
+    if (req->cursor == 0 || report->len == 0 || !same_addr(worker->stats_addr, client_addr) ||
+        now - worker->stats_built > STATS_CACHE_TTL_SEC) {
+        report->len = 0;
+        build_stats_report(worker, report);
+        worker->stats_addr = client_addr;
+        worker->stats_built = now;
+    }
+    ListReply list;
+    int next_cursor = -1, line_index = 0;
+    list_begin(&list, req);
+    for (size_t offset = 0; offset < report->len; offset += strlen((char*)report->data + offset) + 1, line_index++) {
+        if (line_index < req->cursor) {
+            continue;
+        }
+        if (list_add_line(&list, (char*)report->data + offset) < 0) {
+            next_cursor = line_index;
+            break;
+        }
+    }
+    list_send(worker, client_addr, &list, next_cursor);
+}
+
+// Dispatch table indexed by opcode
+const CommandHandler command_table[OP_COUNT] = {
+    [OP_NEGOTIATE]       = { "negotiate", NULL, NULL, NULL, handle_negotiate },
+    [OP_REGISTER]        = { "register", "register", parse_text_register, decode_register, handle_register, 1 },
+    [OP_ANNOUNCE]        = { "announce", "announce", parse_text_announce, decode_announce, handle_announce, 1 },
+    [OP_QUERY_RESOURCES] = { "query_resources", "query resources", parse_text_page, decode_page, handle_query_resources },
+    [OP_QUERY_USERS]     = { "query_users", "query users", parse_text_page, decode_page, handle_query_users },
+    [OP_RESOURCE_INFO]   = { "resource_info", "get resource_info", parse_text_resource_info, decode_resource_info, handle_resource_info },
+    [OP_HELLO_RESPONSE]  = { "hello_response", "hello response", NULL, NULL, handle_hello_response },
+    [OP_SEARCH]          = { "search", "search", parse_text_search, decode_search, handle_search },
+    [OP_ANNOUNCE_BULK]   = { "announce_bulk", NULL, NULL, decode_name_list, handle_announce_bulk, 1 },
+    [OP_WITHDRAW]        = { "withdraw", "withdraw", parse_text_withdraw, decode_name_list, handle_withdraw, 1 },
+    [OP_SYNC]            = { "sync", NULL, NULL, decode_sync, handle_sync },
+    [OP_LIST_OWNED]      = { "list_owned", NULL, NULL, decode_list_owned, handle_list_owned },
+    [OP_SHARD_MAP]       = { "shard_map", "shard map", NULL, NULL, handle_shard_map },
+    [OP_STATS]           = { "stats", "stats", parse_text_page, decode_page, handle_stats },
+};
+
+// Function to handle client requests: decode a binary frame or a text command
+// into a Request, then dispatch it through command_table
+void handle_client(Worker* worker, struct sockaddr_in client_addr, char* buffer, size_t len) {
+    uint64_t start = monotonic_ns();
+    Request req;
+    memset(&req, 0, sizeof(req));
+    const CommandHandler* command = NULL;
+
+    if (proto_is_frame(buffer, len)) {
+        ProtoReader reader;
+        ProtoHeader header;
+        if (proto_reader_init(&reader, &header, buffer, len) < 0 || header.opcode >= OP_COUNT ||
+            command_table[header.opcode].handle == NULL) {
+            return;
+        }
+        command = &command_table[header.opcode];
+        req.opcode = header.opcode;
+        req.version = header.version;
+        req.request_id = header.request_id;
+        req.binary = 1;
+        if (command->decode != NULL && command->decode(&reader, &req) < 0) {
+            counter_add(&worker->stats.malformed, 1);
+            send_status(worker, client_addr, &req, STATUS_ERROR, "Error: Malformed request.");
+            return;
         }
-        pthread_mutex_unlock(&resource_mutex);
-        sendto(sockfd, resource_list, strlen(resource_list), 0,
-               (struct sockaddr*)&client_addr, sizeof(client_addr));
-    } else if (strncmp(buffer, "query users", 11) == 0) {
-        char user_list[BUFFER_SIZE] = "";
-        pthread_mutex_lock(&user_mutex);
-        int active_users = 0;
-        for (int i = 0; i < user_count; i++) {
-            if (user_directory[i].status == 1) {
-                active_users++;
-                strcat(user_list, user_directory[i].username);
-                strcat(user_list, "\n");
+        if (command->cache_reply && header.request_id != 0) {
+            CachedReply* cached = find_cached_reply(worker, client_addr, header.request_id, header.opcode);
+            if (cached != NULL) {
+                counter_add(&worker->stats.duplicates, 1);
+                queue_reply(worker, client_addr, cached->data, cached->len);
+                return;
             }
         }
-        if (active_users == 0) {
-            strcpy(user_list, "No active users.");
-        } else {
-            char header[] = "Active users:\n";
-            memmove(user_list + strlen(header), user_list, strlen(user_list) + 1);
-            memcpy(user_list, header, strlen(header));
-        }
-        pthread_mutex_unlock(&user_mutex);
-        sendto(sockfd, user_list, strlen(user_list), 0,
-               (struct sockaddr*)&client_addr, sizeof(client_addr));
-    } else if (strcmp(buffer, "hello response") == 0) {
-        pthread_mutex_lock(&user_mutex);
-        for (int i = 0; i < user_count; i++) {
-            if (user_directory[i].addr.sin_addr.s_addr == client_addr.sin_addr.s_addr &&
-                user_directory[i].addr.sin_port == client_addr.sin_port) {
-                user_directory[i].last_response = time(NULL);
-                user_directory[i].status = 1;  // mark as active
+    } else {
+        for (int op = 0; op < OP_COUNT; op++) {
+            const char* word = command_table[op].text_command;
+            size_t word_len = word ? strlen(word) : 0;
+            if (word != NULL && strncmp(buffer, word, word_len) == 0 &&
+                (buffer[word_len] == '\0' || buffer[word_len] == ' ')) {
+                command = &command_table[op];
+                req.opcode = op;
                 break;
             }
         }
-        pthread_mutex_unlock(&user_mutex);
-    } else if (strncmp(buffer, "get resource_info", 17) == 0) {
-        char resource_name[100];
-        sscanf(buffer, "get resource_info %s", resource_name);
-        // Find all resources in the resource directory with the given name
-        pthread_mutex_lock(&resource_mutex);
-        int found = 0;
-        char owners_list[BUFFER_SIZE] = "";
-        for (int i = 0; i < resource_count; i++) {
-            if (strcmp(resource_directory[i].resource_name, resource_name) == 0) {
-                // Get the owner's IP and TCP port
-                char owner_ip[INET_ADDRSTRLEN];
-                int owner_tcp_port = 0;
-                int owner_active = 0;
-                pthread_mutex_lock(&user_mutex);
-                for (int j = 0; j < user_count; j++) {
-                    if (strcmp(user_directory[j].username, resource_directory[i].owner) == 0) {
-                        inet_ntop(AF_INET, &(user_directory[j].addr.sin_addr), owner_ip, INET_ADDRSTRLEN);
-                        owner_tcp_port = user_directory[j].tcp_port;
-                        owner_active = user_directory[j].status;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&user_mutex);
-                if (owner_active == 1) {
-                    char owner_info[200];
-                    snprintf(owner_info, sizeof(owner_info), "%s %s %d\n",
-                             resource_directory[i].owner, owner_ip, owner_tcp_port);
-                    strcat(owners_list, owner_info);
-                    found = 1;
-                }
-            }
+        if (command == NULL) {
+            return;
         }
-        pthread_mutex_unlock(&resource_mutex);
-        if (!found) {
-            char error_message[BUFFER_SIZE];
-            snprintf(error_message, BUFFER_SIZE, "Error: Resource '%s' not found.", resource_name);
-            sendto(sockfd, error_message, strlen(error_message), 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-        } else {
-            sendto(sockfd, owners_list, strlen(owners_list), 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
+        if (command->parse_text != NULL && command->parse_text(buffer + strlen(command->text_command), &req) < 0) {
+            counter_add(&worker->stats.malformed, 1);
+            send_status(worker, client_addr, &req, STATUS_ERROR, "Error: Malformed request.");
+            return;
         }
     }
+    command->handle(worker, client_addr, &req);
+    worker->recording = NULL;
+    histogram_record(&worker->stats.latency[req.opcode], monotonic_ns() - start);
+}
+
+// Function to create a UDP socket bound to server_port with SO_REUSEPORT, so that
+// every worker can own one and the kernel spreads datagrams across them
+int create_worker_socket() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    int optval = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(sockfd);
+        return -1;
+    }
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(server_port);
+
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
-// Thread function to handle client messages
+// Thread function to handle client messages: drain datagrams in batches with
+// recvmmsg, then flush all replies with sendmmsg
 void* client_handler_thread(void* arg) {
-    int sockfd = *(int*)arg;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
+    Worker* worker = (Worker*)arg;
+    DatagramBatch* rx = &worker->rx;
+    thread_lock_stats = worker->stats.locks;
+
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        rx->iovecs[i].iov_base = rx->buffers[i];
+        rx->iovecs[i].iov_len = BUFFER_SIZE - 1;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovecs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+    }
 
     while (1) {
-        int bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                                      (struct sockaddr*)&client_addr, &addr_len);
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            handle_client(sockfd, client_addr, buffer);
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+        }
+        // Block for the first datagram, then take whatever else is already queued
+        int received = recvmmsg(worker->sockfd, rx->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            perror("recvmmsg failed");
+            continue;
         }
+        for (int i = 0; i < received; i++) {
+            rx->buffers[i][rx->msgs[i].msg_len] = '\0';
+            handle_client(worker, rx->addrs[i], rx->buffers[i], rx->msgs[i].msg_len);
+        }
+        flush_batch(worker->sockfd, &worker->tx);
     }
     return NULL;
 }
 
-// Thread function to send hello messages and check client statuses
+// Thread function to send hello messages and check client statuses, one
+// timer wheel slot per tick
 void* hello_thread(void* arg) {
     int sockfd = *(int*)arg;
+    thread_lock_stats = hello_lock_stats;
+    DatagramBatch* batch = calloc(1, sizeof(DatagramBatch));
+    if (batch == NULL) {
+        perror("Failed to allocate hello batch");
+        return NULL;
+    }
+    struct timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
     while (1) {
-        send_hello_messages(sockfd);
-        check_client_statuses();
-        sleep(HELLO_INTERVAL);
+        process_hello_tick(sockfd, batch);
+        next_tick.tv_nsec += WHEEL_TICK_MS * 1000000L;
+        if (next_tick.tv_nsec >= 1000000000L) {
+            next_tick.tv_sec++;
+            next_tick.tv_nsec -= 1000000000L;
+        }
+        // Returns immediately when we are behind, so missed slots are caught up
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
     }
+    free(batch);
     return NULL;
 }
 
-int main() {
-    int sockfd;
-    struct sockaddr_in server_addr;
-
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
+int main(int argc, char* argv[]) {
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "w:i:t:d:p:s:v:")) != -1) {
+        switch (opt) {
+            case 'w':
+                worker_count = atoi(optarg);
+                break;
+            case 'i':
+                hello_interval = atoi(optarg);
+                break;
+            case 't':
+                hello_timeout = atoi(optarg);
+                break;
+            case 'd':
+                state_dir = optarg;
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'v':
+                log_level = atoi(optarg);
+                break;
+            case 's':
+                if (shard_map_parse(&shard_map, optarg) < 0) {
+                    fprintf(stderr, "Invalid shard list '%s'; expected ip:port,ip:port,...\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-i hello_interval] [-t hello_timeout] [-d state_dir] [-p port] [-s shard_list] [-v log_level]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    if (hello_interval < 1 || hello_timeout < 1) {
+        fprintf(stderr, "Hello interval and timeout must be at least one second.\n");
         exit(EXIT_FAILURE);
     }
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    if (shard_map.count > 0) {
+        self_shard = find_self_shard();
+        if (self_shard < 0) {
+            fprintf(stderr, "This server (port %d) is not in the shard list.\n", server_port);
+            exit(EXIT_FAILURE);
+        }
+        log_at(LEVEL_INFO, "Running as shard %d of %d.\n", self_shard + 1, shard_map.count);
+    }
 
-    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
+    workers = calloc(worker_count, sizeof(Worker));
+    pthread_t* worker_threads = calloc(worker_count, sizeof(pthread_t));
+    if (workers == NULL || worker_threads == NULL) {
+        perror("Failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].sockfd = create_worker_socket();
+        if (workers[i].sockfd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        workers[i].reply_cache = calloc(REPLY_CACHE_SLOTS, sizeof(CachedReply));
+        if (workers[i].reply_cache == NULL) {
+            perror("Failed to allocate reply cache");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (state_dir != NULL && load_directory() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Queries always find a snapshot, even before the first write
+    if (publish_snapshot() < 0) {
         exit(EXIT_FAILURE);
     }
+    log_at(LEVEL_INFO, "Server listening on port %d with %d worker(s).\n", server_port, worker_count);
 
-    pthread_t client_thread_id, hello_thread_id;
+    pthread_t hello_thread_id, publisher_thread_id;
 
-    pthread_create(&client_thread_id, NULL, client_handler_thread, &sockfd);
-    pthread_create(&hello_thread_id, NULL, hello_thread, &sockfd);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_create(&worker_threads[i], NULL, client_handler_thread, &workers[i]);
+    }
+    // Hellos go out through the first worker's socket so replies come back to server_port
+    pthread_create(&hello_thread_id, NULL, hello_thread, &workers[0].sockfd);
+    pthread_create(&publisher_thread_id, NULL, publisher_thread, NULL);
 
-    pthread_join(client_thread_id, NULL);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(worker_threads[i], NULL);
+    }
     pthread_join(hello_thread_id, NULL);
+    pthread_join(publisher_thread_id, NULL);
 
-    close(sockfd);
+    for (int i = 0; i < worker_count; i++) {
+        close(workers[i].sockfd);
+        free(workers[i].stats_report.data);
+    }
+    free(workers);
+    free(worker_threads);
     return 0;
 }
@@ -0,0 +1,103 @@
+// shard.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "shard.h"
+#include "protocol.h"
+
+// Function to spread the bits of a 64-bit hash before taking 32 of them
+static uint32_t mix_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+// Function to add a shard; the ring must be rebuilt afterwards. Returns -1 if
+// the map is full.
+int shard_map_add(ShardMap* map, struct sockaddr_in node) {
+    if (map->count == MAX_SHARDS) {
+        return -1;
+    }
+    map->nodes[map->count++] = node;
+    return 0;
+}
+
+// Function to read a comma-separated list of ip:port shards. Returns -1 if an
+// entry is malformed or there are too many.
+int shard_map_parse(ShardMap* map, const char* list) {
+    char copy[MAX_SHARDS * 24];
+    snprintf(copy, sizeof(copy), "%s", list);
+    char* saveptr;
+    for (char* item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char* colon = strrchr(item, ':');
+        struct sockaddr_in node;
+        memset(&node, 0, sizeof(node));
+        node.sin_family = AF_INET;
+        if (colon == NULL) {
+            return -1;
+        }
+        *colon = '\0';
+        int port = atoi(colon + 1);
+        if (port < 1 || port > 65535 || inet_pton(AF_INET, item, &node.sin_addr) != 1) {
+            return -1;
+        }
+        node.sin_port = htons(port);
+        if (shard_map_add(map, node) < 0) {
+            return -1;
+        }
+    }
+    shard_map_build(map);
+    return 0;
+}
+
+static int compare_points(const void* a, const void* b) {
+    uint32_t x = ((const RingPoint*)a)->point, y = ((const RingPoint*)b)->point;
+    return x < y ? -1 : x > y;
+}
+
+// Function to place every shard on the ring. A shard's points depend only on
+// its own address, so shards keep their points when others join or leave.
+void shard_map_build(ShardMap* map) {
+    map->ring_size = 0;
+    for (int i = 0; i < map->count; i++) {
+        char label[64];
+        shard_format(map, i, label, sizeof(label));
+        size_t label_len = strlen(label);
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            snprintf(label + label_len, sizeof(label) - label_len, "#%d", v);
+            map->ring[map->ring_size].point = mix_hash(proto_manifest_hash(label));
+            map->ring[map->ring_size++].shard = i;
+        }
+    }
+    qsort(map->ring, map->ring_size, sizeof(RingPoint), compare_points);
+}
+
+// Function to find the shard that owns a name. Returns -1 for an empty map.
+int shard_for_name(const ShardMap* map, const char* name) {
+    if (map->ring_size == 0) {
+        return -1;
+    }
+    uint32_t hash = mix_hash(proto_manifest_hash(name));
+    // First point at or after the hash, wrapping around to the start
+    int low = 0, high = map->ring_size;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (map->ring[mid].point < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return map->ring[low == map->ring_size ? 0 : low].shard;
+}
+
+// Function to write a shard's address as ip:port
+void shard_format(const ShardMap* map, int shard, char* out, size_t size) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &map->nodes[shard].sin_addr, ip, sizeof(ip));
+    snprintf(out, size, "%s:%d", ip, ntohs(map->nodes[shard].sin_port));
+}
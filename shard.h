@@ -0,0 +1,37 @@
+// shard.h
+// Consistent hashing of resource names onto directory shards, shared by the
+// client and the server so both pick the same owner for every name.
+//
+// Every shard is placed on a 32-bit ring at SHARD_VNODES points derived from
+// its address, and a name belongs to the first shard point at or after the
+// name's hash. Adding a shard to N others therefore moves about 1/(N+1) of
+// the names, all of them to the new shard.
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define MAX_SHARDS 64
+#define SHARD_VNODES 128  // Ring points per shard; more points even out the split
+
+typedef struct {
+    uint32_t point;
+    int shard;  // Index into nodes
+} RingPoint;
+
+typedef struct {
+    struct sockaddr_in nodes[MAX_SHARDS];
+    int count;
+    RingPoint ring[MAX_SHARDS * SHARD_VNODES];
+    int ring_size;
+} ShardMap;
+
+int shard_map_add(ShardMap* map, struct sockaddr_in node);
+int shard_map_parse(ShardMap* map, const char* list);
+void shard_map_build(ShardMap* map);
+int shard_for_name(const ShardMap* map, const char* name);
+void shard_format(const ShardMap* map, int shard, char* out, size_t size);
+
+#endif